@@ -2,35 +2,45 @@
 #include <cstring>
 #include "mod_audio_stream.h"
 //#include <ixwebsocket/IXWebSocket.h>
-#include "WebSocketClient.h"
+#include "ws_transport.h"
+#include "ws_pool.h"
+#include "tls_cache.h"
+#include "stream_reaper.h"
+#include "ws_event_loop.h"
+#include "ws_endpoints.h"
+#include "stream_subscribers.h"
+#include "stream_registry.h"
+#include "stream_latency.h"
+#include "stream_metrics.h"
+#include "stream_config.h"
+#include "stream_playback.h"
+#include "stream_wav.h"
+#include "stream_recorder.h"
+#include "stream_stretch.h"
+#include "stream_echo.h"
+#include "stream_bargein.h"
+#include "stream_comfort.h"
+#include "stream_scratch.h"
+#include "base64.h"
 #include <switch_json.h>
-#include <fstream>
 #include <switch_buffer.h>
 #include <unordered_map>
-#include <unordered_set>
-#include "base64.h"
+#include <algorithm>
+#include <condition_variable>
+#include <chrono>
+#include <cmath>
 
 #define FRAME_SIZE_8000  320 /* 1000x0.02 (20ms)= 160 x(16bit= 2 bytes) 320 frame size*/
 
+#define RECONNECT_BACKOFF_MS          (500)
+#define RECONNECT_MAX_BACKOFF_MS      (8000)
+#define RECONNECT_CONNECT_TIMEOUT_MS  (10000)
+
+#define VOICE_MEAN_AMPLITUDE          (300)     // uplink frames above this count as caller speech
+#define PLAYBACK_MAX_SEC              (10)      // 播放缓冲上限，超出的音频丢弃
+
 // G.711 A-law encoding - Standard ITU-T G.711 implementation
 namespace {
-    // 小端序写入辅助函数
-    inline void write_le16(std::ofstream& file, uint16_t value) {
-        uint8_t bytes[2];
-        bytes[0] = value & 0xFF;
-        bytes[1] = (value >> 8) & 0xFF;
-        file.write((char*)bytes, 2);
-    }
-    
-    inline void write_le32(std::ofstream& file, uint32_t value) {
-        uint8_t bytes[4];
-        bytes[0] = value & 0xFF;
-        bytes[1] = (value >> 8) & 0xFF;
-        bytes[2] = (value >> 16) & 0xFF;
-        bytes[3] = (value >> 24) & 0xFF;
-        file.write((char*)bytes, 4);
-    }
-    
     // A-law 段查找表
     static const int16_t seg_aend[8] = {0x1F, 0x3F, 0x7F, 0xFF, 0x1FF, 0x3FF, 0x7FF, 0xFFF};
     
@@ -83,87 +93,211 @@ namespace {
             return aval ^ mask;
         }
     }
-}
 
-class AudioStreamer {
-public:
+    // Recent uplink audio, kept to be resent after a reconnect. Offsets count every byte
+    // ever appended, so they can be compared with what the server acknowledged.
+    class ReplayBuffer {
+    public:
+        void init(size_t capacity) {
+            m_data.resize(capacity);
+        }
 
-    AudioStreamer(const char* uuid, const char* wsUri, responseHandler_t callback, int deflate, int heart_beat,
-                    bool suppressLog, const char* extra_headers, bool no_reconnect,
-                    const char* tls_cafile, const char* tls_keyfile, const char* tls_certfile,
-                    bool tls_disable_hostname_validation): m_sessionId(uuid), m_notify(callback),
-                    m_suppress_log(suppressLog), m_extra_headers(extra_headers), m_playFile(0){
-
-        WebSocketHeaders hdrs;
-        WebSocketTLSOptions tls;
-
-        if (m_extra_headers) {
-            cJSON *headers_json = cJSON_Parse(m_extra_headers);
-            if (headers_json) {
-                cJSON *iterator = headers_json->child;
-                while (iterator) {
-                    if (iterator->type == cJSON_String && iterator->valuestring != nullptr) {
-                        hdrs.set(iterator->string, iterator->valuestring);
-                    }
-                    iterator = iterator->next;
-                }
-                cJSON_Delete(headers_json);
+        void append(const uint8_t* data, size_t len) {
+            m_total += len;
+            const size_t cap = m_data.size();
+            if (!cap) return;
+            if (len >= cap) {
+                data += len - cap;
+                len = cap;
+            }
+            size_t tail = (m_head + m_size) % cap;
+            size_t first = std::min(len, cap - tail);
+            memcpy(&m_data[tail], data, first);
+            memcpy(&m_data[0], data + first, len - first);
+            m_size += len;
+            if (m_size > cap) {
+                m_head = (m_head + m_size - cap) % cap;
+                m_size = cap;
             }
         }
 
-        client.setUrl(wsUri);
+        uint64_t start() const { return m_total - m_size; }
+        uint64_t end() const { return m_total; }
+
+        // calls fn(data, len) with chunks of at most chunk bytes, from absolute offset on
+        template <typename F>
+        void replay(uint64_t from, size_t chunk, F fn) const {
+            const size_t cap = m_data.size();
+            if (from < start()) from = start();
+            size_t pos = (m_head + (size_t)(from - start())) % (cap ? cap : 1);
+            size_t left = (size_t)(m_total - from);
+            while (left > 0) {
+                size_t len = std::min(std::min(left, chunk), cap - pos);
+                fn(&m_data[pos], len);
+                pos = (pos + len) % cap;
+                left -= len;
+            }
+        }
 
-        // Setup eventual TLS options.
-        // tls_cafile may hold the special values
-        // NONE, which disables validation and SYSTEM which uses
-        // the system CAs bundle
-        if (tls_cafile) {
-            tls.caFile = tls_cafile;
+    private:
+        std::vector<uint8_t> m_data;
+        size_t m_head = 0;
+        size_t m_size = 0;
+        uint64_t m_total = 0;
+    };
+
+    const char* raw_file_type(int sampleRate) {
+        switch (sampleRate) {
+            case 8000: return ".r8";
+            case 16000: return ".r16";
+            case 24000: return ".r24";
+            case 32000: return ".r32";
+            case 48000: return ".r48";
+            case 64000: return ".r64";
+            default: return "";
         }
+    }
 
-        if (tls_keyfile) {
-            tls.keyFile = tls_keyfile;
+    // crude energy check, only used to time the end of the caller's turn
+    bool frame_has_voice(const switch_frame_t& frame) {
+        const auto* samples = static_cast<const int16_t*>(frame.data);
+        const size_t count = frame.datalen / sizeof(int16_t);
+        if (!count) return false;
+        uint64_t sum = 0;
+        for (size_t i = 0; i < count; i++) sum += samples[i] < 0 ? -(int32_t) samples[i] : samples[i];
+        return sum / count > VOICE_MEAN_AMPLITUDE;
+    }
+
+    // in-process subscribers get every event, the event bus only when the session did not opt out
+    void deliver_event(switch_core_session_t* session, const std::string& uuid, responseHandler_t handler, bool eventBus,
+                       const char* eventName, const char* json, size_t len) {
+        subscribers_dispatch(uuid, eventName, json, len);
+        if (eventBus) handler(session, eventName, json);
+    }
+
+    /*
+     * The streamer's handle on its session, used by the transport callbacks instead of looking the
+     * uuid up in the core session table for every message. Each use takes a read lock on the
+     * session; detach() is called from the media bug cleanup, before the session can go away,
+     * and waits for callbacks still using it.
+     */
+    class SessionLink {
+    public:
+        explicit SessionLink(switch_core_session_t* session): m_session(session) {}
+
+        // the read locked session, or nullptr once detached; pair with release()
+        switch_core_session_t* acquire() {
+            m_lock.lock();
+            if (m_session && switch_core_session_read_lock(m_session) == SWITCH_STATUS_SUCCESS) {
+                return m_session;
+            }
+            m_lock.unlock();
+            return nullptr;
         }
 
-        if (tls_certfile) {
-            tls.certFile = tls_certfile;
+        void release(switch_core_session_t* session) {
+            switch_core_session_rwunlock(session);
+            m_lock.unlock();
         }
 
-        tls.disableHostnameValidation = tls_disable_hostname_validation;
-        client.setTLSOptions(tls);
+        // recursive, a callback closing the media bug ends up in here on its own thread
+        void detach() {
+            std::lock_guard<std::recursive_mutex> guard(m_lock);
+            m_session = nullptr;
+        }
 
-        // Optional heart beat, sent every xx seconds when there is not any traffic
-        // to make sure that load balancers do not kill an idle connection.
-        if(heart_beat)
-            client.setPingInterval(heart_beat);
+    private:
+        std::recursive_mutex m_lock;
+        switch_core_session_t* m_session;
+    };
+}
 
-        // Per message deflate connection is enabled by default. You can tweak its parameters or disable it
-        if(deflate)
-            client.enableCompression(false);
+class AudioStreamer {
+public:
 
-        // Set extra headers if any
-        if(!hdrs.empty())
-            client.setHeaders(hdrs);
+    // The transport options (TLS, headers, multiplexing, pooling) come ready made with the
+    // profile, see stream_config.cpp; tls.caFile may hold the special values NONE, which
+    // disables validation, and SYSTEM which uses the system CAs bundle.
+    AudioStreamer(switch_core_session_t* session, const char* uuid, const char* wsUri, responseHandler_t callback,
+                    const StreamProfile& settings, const char* metadata, int sampling, int channels,
+                    const std::shared_ptr<StreamEntry>& entry): m_sessionId(uuid), m_session(session),
+                    m_notify(callback), m_eventBus(settings->eventBus), m_entry(entry), m_counters(entry->counters),
+                    m_created(switch_micro_time_now()), m_settings(settings){
+
+        if (metadata) m_initialMetadata = metadata;
+
+        // One or more endpoints, each connection attempt picks one of them, see ws_endpoints.cpp
+        m_endpoints = endpoint_split(wsUri);
+        m_policy = settings->policy;
+        m_setupTimeoutMs = settings->setupTimeoutMs;
+        m_setupDeadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(m_setupTimeoutMs);
+
+        // Reconnect after an abnormal drop, replaying the uplink audio the server may have missed
+        m_reconnectAttempts = settings->reconnectAttempts;
+        m_bytesPerMs = sampling * channels * sizeof(int16_t) / 1000;
+        if ((m_reconnectAttempts > 0 || m_endpoints.size() > 1) && settings->replayMs > 0) {
+            m_replay.init(settings->replayMs * m_bytesPerMs);
+        }
 
-        // Setup a callback to be fired when a message or an event (open, close, error) is received
-        client.setMessageCallback([this](const std::string& message) {
-            eventCallback(MESSAGE, message.c_str());
-        });
+        openTransport();
+    }
 
-        client.setOpenCallback([this]() {
+    // Setup a callback to be fired when a message or an event (open, close, error) is received.
+    // Events from a connection we already replaced carry an older generation and are ignored.
+    TransportCallbacks makeCallbacks(uint32_t gen, const std::string& uri, switch_time_t connectStart) {
+        TransportCallbacks cb;
+        cb.onMessage = [this, gen](const char* message, size_t len) {
+            if (gen != m_generation) return;
+            eventCallback(MESSAGE, message, len);
+        };
+
+        cb.onOpen = [this, gen, uri, connectStart]() {
+            if (gen != m_generation) return;
+            const switch_time_t now = switch_micro_time_now();
+            const switch_time_t connectUsec = now - connectStart;
+            endpoint_connected(uri, connectUsec);
+            if (!m_wasOpen) {
+                latency_record(LATENCY_CONNECT, uri, now - m_created);
+                m_firstOpen = now;
+            }
+            m_counters->add(m_counters->connects);
+            m_counters->add(m_counters->connectUsec, connectUsec);
+            if (!m_draining) m_entry->state = STREAM_CONNECTED;
+            {
+                std::lock_guard<std::recursive_mutex> guard(m_transportLock);
+                m_openUri = uri;
+            }
+            m_openGeneration = gen;
+            m_wasOpen = true;
             cJSON *root;
             root = cJSON_CreateObject();
             cJSON_AddStringToObject(root, "status", "connected");
+            if (m_endpoints.size() > 1) cJSON_AddStringToObject(root, "endpoint", uri.c_str());
             char *json_str = cJSON_PrintUnformatted(root);
             eventCallback(CONNECT_SUCCESS, json_str);
             cJSON_Delete(root);
             switch_safe_free(json_str);
-        });
+        };
+
+        cb.onError = [this, gen, uri](int code, const std::string &msg) {
+            if (gen != m_generation) return;
+            markFailed(gen, uri);
+            int lost = connectionLost();
+            if (lost == FAILOVER_STARTED) {
+                switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "(%s) %s failed: %d %s, trying another endpoint\n",
+                                  m_sessionId.c_str(), uri.c_str(), code, msg.c_str());
+                return;
+            }
+            if (lost == RECONNECT_ATTEMPT_FAILED) {
+                switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "(%s) reconnect attempt failed: %d %s\n",
+                                  m_sessionId.c_str(), code, msg.c_str());
+                return;
+            }
 
-        client.setErrorCallback([this](int code, const std::string &msg) {
             cJSON *root, *message;
             root = cJSON_CreateObject();
-            cJSON_AddStringToObject(root, "status", "error");
+            cJSON_AddStringToObject(root, "status", lost == RECONNECT_STARTED ? "disconnected" : "error");
+            if (lost == RECONNECT_STARTED) cJSON_AddTrueToObject(root, "reconnecting");
             message = cJSON_CreateObject();
             cJSON_AddNumberToObject(message, "code", code);
             cJSON_AddStringToObject(message, "error", msg.c_str());
@@ -171,16 +305,32 @@ public:
 
             char *json_str = cJSON_PrintUnformatted(root);
 
-            eventCallback(CONNECT_ERROR, json_str);
+            eventCallback(lost == RECONNECT_STARTED ? CONNECTION_DROPPED : CONNECT_ERROR, json_str);
 
             cJSON_Delete(root);
             switch_safe_free(json_str);
-        });
+        };
+
+        cb.onClose = [this, gen, uri](int code, const std::string &reason) {
+            if (gen != m_generation) return;
+            markFailed(gen, uri);
+            // a normal closure is the server ending the stream, not a network failure
+            int lost = code != 1000 ? connectionLost() : RECONNECT_NONE;
+            if (lost == FAILOVER_STARTED) {
+                switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "(%s) %s closed: %d %s, trying another endpoint\n",
+                                  m_sessionId.c_str(), uri.c_str(), code, reason.c_str());
+                return;
+            }
+            if (lost == RECONNECT_ATTEMPT_FAILED) {
+                switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "(%s) reconnect attempt closed: %d %s\n",
+                                  m_sessionId.c_str(), code, reason.c_str());
+                return;
+            }
 
-        client.setCloseCallback([this](int code, const std::string &reason) {
             cJSON *root, *message;
             root = cJSON_CreateObject();
             cJSON_AddStringToObject(root, "status", "disconnected");
+            if (lost == RECONNECT_STARTED) cJSON_AddTrueToObject(root, "reconnecting");
             message = cJSON_CreateObject();
             cJSON_AddNumberToObject(message, "code", code);
             cJSON_AddStringToObject(message, "reason", reason.c_str());
@@ -191,10 +341,263 @@ public:
 
             cJSON_Delete(root);
             switch_safe_free(json_str);
-        });
+        };
+        return cb;
+    }
+
+    // Creates a connection for the current generation, closing the one it replaces.
+    void openTransport() {
+        uint32_t gen = ++m_generation;
+        TransportConfig cfg(m_settings->transport);
+        cfg.uri = endpoint_pick(m_endpoints, m_policy);
+        m_counters->setEndpoint(cfg.uri);
+        if (m_endpoints.size() > 1) {
+            switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "(%s) connecting to %s\n", m_sessionId.c_str(), cfg.uri.c_str());
+        }
+
+        std::unique_ptr<StreamTransport> previous;
+        std::string released;
+        std::unique_ptr<StreamTransport> transport = transport_create(cfg, m_sessionId,
+                                                                      makeCallbacks(gen, cfg.uri, switch_micro_time_now()));
+        StreamTransport* pending = transport.get();
+        {
+            std::lock_guard<std::recursive_mutex> guard(m_transportLock);
+            previous = std::move(m_transport);
+            m_transport = std::move(transport);
+            m_uri = cfg.uri;
+            released.swap(m_openUri);
+        }
+        if (previous) previous->close();
+        if (!released.empty()) endpoint_released(released);
+
+        // Now that our callback is setup, we can start connecting.
+        // A multiplexed stream joining an open connection gets its open callback right away.
+        pending->connect();
+    }
 
-        // Now that our callback is setup, we can start our background thread and receive messages
-        client.connect();
+    // a connection that never opened counts once against its endpoint
+    void markFailed(uint32_t gen, const std::string& uri) {
+        if (m_openGeneration != gen && m_failedGeneration.exchange(gen) != gen) endpoint_failed(uri);
+    }
+
+    enum { RECONNECT_NONE, RECONNECT_STARTED, FAILOVER_STARTED, RECONNECT_ATTEMPT_FAILED };
+
+    // A connection that never opened fails over to another endpoint until the setup deadline,
+    // one that dropped is reconnected. Either way the retries run on m_reconnectThread.
+    int connectionLost() {
+        std::thread previous;
+        bool setup;
+        {
+            std::lock_guard<std::mutex> lk(m_reconnectMutex);
+            // a graceful-shutdown is waiting for this close
+            if (m_closing || m_draining) return RECONNECT_NONE;
+            if (m_reconnecting) {
+                m_attemptFailed = true;
+                m_reconnectCond.notify_all();
+                return RECONNECT_ATTEMPT_FAILED;
+            }
+            setup = !m_wasOpen;
+            if (setup ? m_endpoints.size() < 2 || std::chrono::steady_clock::now() >= m_setupDeadline : !m_reconnectAttempts) {
+                return RECONNECT_NONE;
+            }
+            {
+                std::lock_guard<std::recursive_mutex> guard(m_transportLock);
+                m_reconnecting = true;
+                m_failingOver = setup;
+                m_dropOffset = m_replay.end();
+            }
+            m_entry->state = STREAM_RECONNECTING;
+            if (!setup) {
+                switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "(%s) connection lost, reconnecting\n", m_sessionId.c_str());
+            }
+            // the thread of the previous outage is about to return, if it has not already
+            previous = std::move(m_reconnectThread);
+            m_reconnectThread = std::thread([this, setup]() { reconnectLoop(setup); });
+        }
+        if (previous.joinable()) previous.join();
+        return setup ? FAILOVER_STARTED : RECONNECT_STARTED;
+    }
+
+    // moves a connected stream to other endpoints, as a failover: the new server gets the
+    // initial metadata and the buffered audio, no resume marker
+    bool migrate(const std::vector<std::string>& endpoints) {
+        std::thread previous;
+        {
+            std::lock_guard<std::mutex> lk(m_reconnectMutex);
+            if (m_closing || m_draining || m_reconnecting || !m_wasOpen) return false;
+            // no reconnect thread is running, nothing else reads the endpoints now
+            m_endpoints = endpoints;
+            m_setupDeadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(m_setupTimeoutMs);
+            {
+                std::lock_guard<std::recursive_mutex> guard(m_transportLock);
+                m_reconnecting = true;
+                m_failingOver = true;
+                m_dropOffset = m_replay.end();
+            }
+            m_entry->state = STREAM_RECONNECTING;
+            switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_INFO, "(%s) migrating to %s\n", m_sessionId.c_str(), endpoints[0].c_str());
+            previous = std::move(m_reconnectThread);
+            m_reconnectThread = std::thread([this]() { reconnectLoop(true, true); });
+        }
+        if (previous.joinable()) previous.join();
+        return true;
+    }
+
+    void reconnectLoop(bool setup, bool migrating = false) {
+        for (int attempt = 1; setup || attempt <= m_reconnectAttempts; attempt++) {
+            // every other endpoint is tried right away, the same ones again after a backoff
+            int retry = attempt - (int) m_endpoints.size() - (migrating ? 1 : 0);
+            int delay = retry < 0 ? 0 : std::min(RECONNECT_MAX_BACKOFF_MS, RECONNECT_BACKOFF_MS << std::min(retry, 4));
+            int timeout = RECONNECT_CONNECT_TIMEOUT_MS;
+            if (setup) {
+                auto left = std::chrono::duration_cast<std::chrono::milliseconds>(m_setupDeadline - std::chrono::steady_clock::now()).count();
+                if (left <= delay) break;
+                timeout = (int) std::min<int64_t>(timeout, left - delay);
+            }
+            {
+                std::unique_lock<std::mutex> lk(m_reconnectMutex);
+                if (m_reconnectCond.wait_for(lk, std::chrono::milliseconds(delay), [this]() { return m_closing.load(); })) return;
+                m_attemptFailed = false;
+            }
+            if (setup) {
+                m_failovers++;
+            } else {
+                switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_INFO, "(%s) reconnect attempt %d/%d\n",
+                                  m_sessionId.c_str(), attempt, m_reconnectAttempts);
+            }
+            openTransport();
+            {
+                std::unique_lock<std::mutex> lk(m_reconnectMutex);
+                bool done = m_reconnectCond.wait_for(lk, std::chrono::milliseconds(timeout), [this]() {
+                    return m_closing || !m_reconnecting || m_attemptFailed;
+                });
+                if (m_closing || !m_reconnecting) return;
+                if (!done) {
+                    std::lock_guard<std::recursive_mutex> guard(m_transportLock);
+                    markFailed(m_generation, m_uri);
+                }
+            }
+        }
+
+        {
+            std::lock_guard<std::recursive_mutex> guard(m_transportLock);
+            m_reconnecting = false;
+            m_failingOver = false;
+        }
+        cJSON *root, *message;
+        root = cJSON_CreateObject();
+        cJSON_AddStringToObject(root, "status", "error");
+        message = cJSON_CreateObject();
+        cJSON_AddNumberToObject(message, "code", 6);
+        if (setup) {
+            switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "(%s) no endpoint reachable within the setup timeout\n",
+                              m_sessionId.c_str());
+            cJSON_AddStringToObject(message, "error", "no endpoint reachable");
+            cJSON_AddItemToObject(root, "message", message);
+            cJSON_AddNumberToObject(root, "failovers", m_failovers);
+        } else {
+            switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "(%s) giving up after %d reconnect attempts\n",
+                              m_sessionId.c_str(), m_reconnectAttempts);
+            cJSON_AddStringToObject(message, "error", "reconnect failed");
+            cJSON_AddItemToObject(root, "message", message);
+            cJSON_AddNumberToObject(root, "reconnects", m_reconnects);
+        }
+        char *json_str = cJSON_PrintUnformatted(root);
+        // closes the media bug, this object may be gone once it returns
+        eventCallback(CONNECT_ERROR, json_str);
+        cJSON_Delete(root);
+        switch_safe_free(json_str);
+    }
+
+    // The new connection is open and the initial metadata went out: resend what the server
+    // has not acknowledged, then let live audio through again. Returns the connect event body.
+    char* resumeAfterReconnect(switch_core_session_t *session) {
+        if (m_failingOver) return connectedAfterFailover(session);
+
+        uint64_t replayed, lost;
+        {
+            std::lock_guard<std::recursive_mutex> guard(m_transportLock);
+            const uint64_t start = m_replay.start();
+            const uint64_t missing = m_ackSeen ? m_acked : m_dropOffset;
+            const uint64_t from = m_ackSeen ? std::max(m_acked, start) : start;
+            lost = start > missing ? start - missing : 0;
+            replayed = m_replay.end() - from;
+
+            if (m_transport) {
+                char marker[128];
+                int n = snprintf(marker, sizeof(marker), "{\"type\":\"resume\",\"offset\":%llu,\"reconnects\":%d}",
+                                 (unsigned long long) from, m_reconnects + 1);
+                m_transport->sendText(marker, n);
+                StreamTransport* transport = m_transport.get();
+                m_replay.replay(from, FRAME_SIZE_8000 * m_bytesPerMs / 16, [transport](const uint8_t* data, size_t len) {
+                    transport->sendBinary(data, len);
+                });
+            }
+            m_reconnects++;
+            m_reconnecting = false;
+        }
+        {
+            std::lock_guard<std::mutex> lk(m_reconnectMutex);
+            m_reconnectCond.notify_all();
+        }
+
+        const uint64_t replayedMs = m_bytesPerMs ? replayed / m_bytesPerMs : 0;
+        const uint64_t lostMs = m_bytesPerMs ? lost / m_bytesPerMs : 0;
+        switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_NOTICE, "(%s) reconnected (#%d), replayed %llu ms, lost %llu ms\n",
+                          m_sessionId.c_str(), m_reconnects, (unsigned long long) replayedMs, (unsigned long long) lostMs);
+
+        cJSON *root = cJSON_CreateObject();
+        cJSON_AddStringToObject(root, "status", "connected");
+        cJSON_AddNumberToObject(root, "reconnects", m_reconnects);
+        cJSON_AddNumberToObject(root, "replayedMs", replayedMs);
+        cJSON_AddNumberToObject(root, "lostMs", lostMs);
+        char *json_str = cJSON_PrintUnformatted(root);
+        cJSON_Delete(root);
+        return json_str;
+    }
+
+    // First connection of the stream, on another endpoint than the first one picked.
+    // What was captured meanwhile is simply the beginning of the stream.
+    char* connectedAfterFailover(switch_core_session_t *session) {
+        std::string uri;
+        uint64_t sent = 0;
+        {
+            std::lock_guard<std::recursive_mutex> guard(m_transportLock);
+            uri = m_uri;
+            if (m_transport) {
+                StreamTransport* transport = m_transport.get();
+                m_replay.replay(m_replay.start(), FRAME_SIZE_8000 * m_bytesPerMs / 16, [transport, &sent](const uint8_t* data, size_t len) {
+                    transport->sendBinary(data, len);
+                    sent += len;
+                });
+            }
+            m_reconnecting = false;
+            m_failingOver = false;
+        }
+        {
+            std::lock_guard<std::mutex> lk(m_reconnectMutex);
+            m_reconnectCond.notify_all();
+        }
+        switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_NOTICE, "(%s) connected to %s after %d failovers\n",
+                          m_sessionId.c_str(), uri.c_str(), m_failovers);
+
+        cJSON *root = cJSON_CreateObject();
+        cJSON_AddStringToObject(root, "status", "connected");
+        cJSON_AddStringToObject(root, "endpoint", uri.c_str());
+        cJSON_AddNumberToObject(root, "failovers", m_failovers);
+        cJSON_AddNumberToObject(root, "bufferedMs", m_bytesPerMs ? sent / m_bytesPerMs : 0);
+        char *json_str = cJSON_PrintUnformatted(root);
+        cJSON_Delete(root);
+        return json_str;
+    }
+
+    // len is the whole message as received, subscribers get all of it even past an embedded NUL
+    void notify(switch_core_session_t *session, const char* eventName, const char* json, size_t len) {
+        deliver_event(session, m_sessionId, m_notify, m_eventBus, eventName, json, len);
+    }
+
+    void notify(switch_core_session_t *session, const char* eventName, const char* json) {
+        notify(session, eventName, json, json ? strlen(json) : 0);
     }
 
     switch_media_bug_t *get_media_bug(switch_core_session_t *session) {
@@ -216,56 +619,158 @@ public:
     }
 
     inline void send_initial_metadata(switch_core_session_t *session) {
-        auto *bug = get_media_bug(session);
-        if(bug) {
-            auto* tech_pvt = (private_t*) switch_core_media_bug_get_user_data(bug);
-            if(tech_pvt && strlen(tech_pvt->initialMetadata) > 0) {
-                switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_DEBUG,
-                                          "sending initial metadata %s\n", tech_pvt->initialMetadata);
-                writeText(tech_pvt->initialMetadata);
-            }
+        if(!m_initialMetadata.empty()) {
+            switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_DEBUG,
+                                      "sending initial metadata %s\n", m_initialMetadata.c_str());
+            writeText(m_initialMetadata.c_str());
         }
     }
 
     void eventCallback(notifyEvent_t event, const char* message) {
-        switch_core_session_t* psession = switch_core_session_locate(m_sessionId.c_str());
+        eventCallback(event, message, message ? strlen(message) : 0);
+    }
+
+    // message is the transport's buffer, NUL terminated and only valid for the duration of the call
+    void eventCallback(notifyEvent_t event, const char* message, size_t len) {
+        switch_core_session_t* psession = m_session.acquire();
         if(psession) {
             switch (event) {
                 case CONNECT_SUCCESS:
                     send_initial_metadata(psession);
-                    m_notify(psession, EVENT_CONNECT, message);
+                    if (m_reconnecting) {
+                        char *json_str = resumeAfterReconnect(psession);
+                        notify(psession, EVENT_CONNECT, json_str);
+                        switch_safe_free(json_str);
+                    } else {
+                        notify(psession, EVENT_CONNECT, message, len);
+                    }
                     break;
                 case CONNECTION_DROPPED:
                     switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(psession), SWITCH_LOG_INFO, "connection closed\n");
-                    m_notify(psession, EVENT_DISCONNECT, message);
+                    notify(psession, EVENT_DISCONNECT, message, len);
                     break;
                 case CONNECT_ERROR:
                     switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(psession), SWITCH_LOG_INFO, "connection error\n");
-                    m_notify(psession, EVENT_ERROR, message);
+                    notify(psession, EVENT_ERROR, message, len);
 
-                    media_bug_close(psession);
+                    // when draining, queued playback still finishes, see stream_drain_check
+                    if (!m_draining) media_bug_close(psession);
 
                     break;
                 case MESSAGE:
-                    std::string msg(message);
-                    if(processMessage(psession, msg) != SWITCH_TRUE) {
-                        m_notify(psession, EVENT_JSON, msg.c_str());
+                    m_counters->add(m_counters->messages);
+                    if (!m_messageSeen.exchange(true)) {
+                        latency_record(LATENCY_FIRST_MESSAGE, m_counters->endpoint(), switch_micro_time_now() - m_firstOpen);
+                    }
+                    // the transport's buffer is passed through as is, only played audio gets rewritten
+                    std::string played;
+                    if(processMessage(psession, message, played) != SWITCH_TRUE) {
+                        notify(psession, EVENT_JSON, message, len);
                     }
-                    if(!m_suppress_log)
-                        switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(psession), SWITCH_LOG_DEBUG, "response: %s\n", msg.c_str());
+                    if(!m_settings->suppressLog)
+                        switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(psession), SWITCH_LOG_DEBUG, "response: %s\n",
+                                          played.empty() ? message : played.c_str());
                     break;
             }
-            switch_core_session_rwunlock(psession);
+            m_session.release(psession);
+        }
+    }
+
+    // cancelAudio drops the segment named by segmentId, or all of them without one; both
+    // commands answer with the segments left, see PlaybackQueue
+    void queueCommand(switch_core_session_t* session, cJSON* json, bool cancel) {
+        auto *bug = get_media_bug(session);
+        auto *tech_pvt = bug ? (private_t*) switch_core_media_bug_get_user_data(bug) : nullptr;
+        if (!tech_pvt) return;
+        const char* segmentId = cJSON_GetObjectCstr(json, "segmentId");
+        const size_t bytesPerSec = tech_pvt->sampling * tech_pvt->channels * sizeof(int16_t);
+
+        cJSON* reply = cJSON_CreateObject();
+        cJSON_AddStringToObject(reply, "type", "audioQueue");
+        cJSON* segments = cJSON_CreateArray();
+        switch_mutex_lock(tech_pvt->play_mutex);
+        auto *playback = static_cast<PlaybackQueue *>(tech_pvt->pPlayback);
+        auto *stretch = static_cast<TimeStretch *>(tech_pvt->pStretch);
+        if (cancel) {
+            long dropped = 0;
+            // what the stretcher holds was taken from the segment playing
+            bool cut = !segmentId;
+            if (!segmentId) {
+                if (playback) {
+                    dropped = playback->inuse() + (stretch ? stretch->held() * sizeof(int16_t) : 0);
+                    playback->clear();
+                }
+            } else {
+                cut = playback && playback->playing(segmentId);
+                dropped = playback ? playback->cancel(segmentId) : -1;
+                cJSON_AddStringToObject(reply, "cancelled", segmentId);
+            }
+            if (stretch && cut) stretch->reset();
+            // the cancelled segment's audio still in the resamplers goes with it
+            if (m_resampleOpen && (!segmentId || m_resampleSegment == segmentId)) {
+                m_playResampler.reset();
+                m_fileResampler.reset();
+                m_resampleOpen = false;
+            }
+            // the server discarded what the caller barged in on, what comes next plays as usual
+            tech_pvt->barged_in = 0;
+            cJSON_AddItemToObject(reply, "found", cJSON_CreateBool(dropped >= 0));
+            cJSON_AddNumberToObject(reply, "droppedMs", dropped > 0 ? (double) dropped * 1000 / bytesPerSec : 0);
         }
+        if (playback) playback->list(segments, bytesPerSec);
+        switch_mutex_unlock(tech_pvt->play_mutex);
+        cJSON_AddItemToObject(reply, "segments", segments);
+
+        switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_DEBUG, "(%s) %s %s\n", m_sessionId.c_str(),
+                          cancel ? "cancelAudio" : "listAudio", segmentId ? segmentId : "");
+        char* text = cJSON_PrintUnformatted(reply);
+        writeText(text);
+        free(text);
+        cJSON_Delete(reply);
+    }
+
+    // resumeAudio plays on at full volume after a local barge-in
+    void resumeAudio(switch_core_session_t* session) {
+        auto *bug = get_media_bug(session);
+        auto *tech_pvt = bug ? (private_t*) switch_core_media_bug_get_user_data(bug) : nullptr;
+        if (!tech_pvt) return;
+        switch_mutex_lock(tech_pvt->play_mutex);
+        const bool barged = tech_pvt->barged_in;
+        tech_pvt->barged_in = 0;
+        switch_mutex_unlock(tech_pvt->play_mutex);
+        switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_DEBUG, "(%s) resumeAudio%s\n", m_sessionId.c_str(),
+                          barged ? "" : ", playback was not held");
     }
 
-    switch_bool_t processMessage(switch_core_session_t* session, std::string& message) {
-        cJSON* json = cJSON_Parse(message.c_str());
+    switch_bool_t processMessage(switch_core_session_t* session, const char* message, std::string& played) {
+        m_scratch.reset();
+        cJSON* json = cJSON_Parse(message);
         switch_bool_t status = SWITCH_FALSE;
         if (!json) {
             return status;
         }
         const char* jsType = cJSON_GetObjectCstr(json, "type");
+        if(jsType && strcmp(jsType, "audioAck") == 0) {
+            // server confirms how many uplink bytes it has received, see resumeAfterReconnect
+            cJSON* jsBytes = cJSON_GetObjectItem(json, "bytes");
+            if (jsBytes) {
+                std::lock_guard<std::recursive_mutex> guard(m_transportLock);
+                m_acked = (uint64_t) jsBytes->valuedouble;
+                m_ackSeen = true;
+            }
+            cJSON_Delete(json);
+            return SWITCH_TRUE;
+        }
+        if(jsType && strcmp(jsType, "resumeAudio") == 0) {
+            resumeAudio(session);
+            cJSON_Delete(json);
+            return SWITCH_TRUE;
+        }
+        if(jsType && (strcmp(jsType, "cancelAudio") == 0 || strcmp(jsType, "listAudio") == 0)) {
+            queueCommand(session, json, strcmp(jsType, "cancelAudio") == 0);
+            cJSON_Delete(json);
+            return SWITCH_TRUE;
+        }
         if(jsType && strcmp(jsType, "streamAudio") == 0) {
             cJSON* jsonData = cJSON_GetObjectItem(json, "data");
             if(jsonData) {
@@ -280,25 +785,16 @@ public:
                                   jsAudioDataType ? jsAudioDataType : "NULL",
                                   jsonAudio && jsonAudio->valuestring ? "present" : "NULL");
                 
-                std::string fileType;
+                const char* fileType = "";
                 int sampleRate = 16000;
                 if (jsAudioDataType && 0 == strcmp(jsAudioDataType, "raw")) {
                     cJSON* jsonSampleRate = cJSON_GetObjectItem(jsonData, "sampleRate");
                     sampleRate = jsonSampleRate && jsonSampleRate->valueint ? jsonSampleRate->valueint : 0;
-                    std::unordered_map<int, const char*> sampleRateMap = {
-                            {8000, ".r8"},
-                            {16000, ".r16"},
-                            {24000, ".r24"},
-                            {32000, ".r32"},
-                            {48000, ".r48"},
-                            {64000, ".r64"}
-                    };
-                    auto it = sampleRateMap.find(sampleRate);
-                    fileType = (it != sampleRateMap.end()) ? it->second : "";
+                    fileType = raw_file_type(sampleRate);
                     
                     switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_INFO,
                                       "(%s) processMessage - raw audio, sampleRate: %d, fileType: %s\n",
-                                      m_sessionId.c_str(), sampleRate, fileType.c_str());
+                                      m_sessionId.c_str(), sampleRate, fileType);
                 } else if (jsAudioDataType && 0 == strcmp(jsAudioDataType, "wav")) {
                     fileType = ".wav";
                 } else if (jsAudioDataType && 0 == strcmp(jsAudioDataType, "mp3")) {
@@ -314,14 +810,17 @@ public:
                 switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_INFO,
                                   "(%s) processMessage - fileType determined: %s, jsonAudio: %s\n",
                                   m_sessionId.c_str(), 
-                                  fileType.empty() ? "EMPTY" : fileType.c_str(),
+                                  *fileType ? fileType : "EMPTY",
                                   jsonAudio && jsonAudio->valuestring ? "valid" : "NULL");
 
-                if(jsonAudio && jsonAudio->valuestring != nullptr && !fileType.empty()) {
+                if(jsonAudio && jsonAudio->valuestring != nullptr && *fileType) {
                     char finalFilePath[256];
-                    std::string rawAudio;
+                    // 各步骤的缓冲区都取自 m_scratch，下一条消息开始时整体回收
+                    const size_t encodedLen = strlen(jsonAudio->valuestring);
+                    uint8_t* rawAudio = m_scratch.alloc<uint8_t>(encodedLen / 4 * 3 + 3);
+                    size_t rawAudioLen;
                     try {
-                        rawAudio = base64_decode(jsonAudio->valuestring);
+                        rawAudioLen = base64_decode(jsonAudio->valuestring, encodedLen, rawAudio);
                     } catch (const std::exception& e) {
                         switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_ERROR, "(%s) processMessage - base64 decode error: %s\n",
                                           m_sessionId.c_str(), e.what());
@@ -333,14 +832,14 @@ public:
                     if (jsAudioDataType && 0 == strcmp(jsAudioDataType, "raw") && sampleRate > 0) {
                         switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_INFO,
                                           "(%s) processMessage - processing raw audio: %d Hz, size: %zu bytes (Float32 format)\n",
-                                          m_sessionId.c_str(), sampleRate, rawAudio.size());
+                                          m_sessionId.c_str(), sampleRate, rawAudioLen);
                         
                         // 步骤 1: 将 Float32 转换为 16-bit PCM（小端序）
                         // 原始格式：Float32, 24000Hz, 单声道, 小端序
-                        size_t input_samples = rawAudio.size() / sizeof(float);
-                        std::vector<int16_t> pcm16bit(input_samples);
+                        size_t input_samples = rawAudioLen / sizeof(float);
+                        int16_t* pcm16bit = m_scratch.alloc<int16_t>(input_samples);
                         
-                        const float* float_data = reinterpret_cast<const float*>(rawAudio.data());
+                        const float* float_data = reinterpret_cast<const float*>(rawAudio);
                         
                         for (size_t i = 0; i < input_samples; i++) {
                             float sample = float_data[i];
@@ -357,6 +856,14 @@ public:
                                           "(%s) processMessage - converted Float32 to 16-bit PCM: %zu samples\n",
                                           m_sessionId.c_str(), input_samples);
                         
+                        // 段的最后一片（无 segmentId 的分片自成一段）要把重采样器里剩余的音频冲出来；
+                        // 上一段没等到最后一片就换了段，先把它的尾巴冲出来
+                        const char* segmentId = cJSON_GetObjectCstr(jsonData, "segmentId");
+                        const std::string segment(segmentId ? segmentId : "");
+                        cJSON* jsLast = cJSON_GetObjectItem(jsonData, "last");
+                        const bool segmentEnds = !segmentId || (jsLast && jsLast->type == cJSON_True);
+                        const bool segmentSwitched = m_resampleOpen && segment != m_resampleSegment;
+
                         // 获取 tech_pvt 用于流式播放
                         auto *bug = get_media_bug(session);
                         private_t *tech_pvt = nullptr;
@@ -367,82 +874,97 @@ public:
                         // 步骤 2a: 流式播放 - 重采样到通话采样率并写入播放缓冲区
                         if (tech_pvt && tech_pvt->stream_play_enabled) {
                             int target_rate = tech_pvt->sampling;
-                            std::vector<int16_t> playbackSamples;
+                            const int16_t* playbackSamples = pcm16bit;
+                            size_t playbackCount = input_samples;
+                            int16_t* prevTail = nullptr;
+                            size_t prevTailCount = 0;
                             
+                            m_counters->add(m_counters->downlinkChunks);
+                            if (segmentSwitched) {
+                                prevTail = m_scratch.alloc<int16_t>(m_playResampler.tail());
+                                prevTailCount = m_playResampler.flush(prevTail, m_playResampler.tail());
+                            }
                             if (sampleRate != target_rate) {
                                 int err;
-                                SpeexResamplerState* resampler = speex_resampler_init(1, sampleRate, target_rate, SWITCH_RESAMPLE_QUALITY, &err);
+                                SpeexResamplerState* resampler = m_playResampler.get(sampleRate, target_rate, &err);
                                 
                                 if (err == 0 && resampler) {
+                                    const switch_time_t resampleStart = switch_micro_time_now();
                                     size_t output_samples = ((uint64_t)input_samples * target_rate + sampleRate - 1) / sampleRate;
-                                    playbackSamples.resize(output_samples);
-                                    spx_uint32_t in_len = input_samples;
-                                    spx_uint32_t out_len = output_samples;
-                                    
-                                    speex_resampler_process_int(resampler, 0,
-                                                                pcm16bit.data(),
-                                                                &in_len,
-                                                                playbackSamples.data(),
-                                                                &out_len);
+                                    const size_t tail = segmentEnds ? m_playResampler.tail() : 0;
+                                    int16_t* resampled = m_scratch.alloc<int16_t>(output_samples + tail);
+                                    spx_uint32_t out_len = m_playResampler.process(pcm16bit, input_samples, resampled, output_samples);
+                                    if (segmentEnds) out_len += m_playResampler.flush(resampled + out_len, tail);
                                     
-                                    playbackSamples.resize(out_len);
-                                    speex_resampler_destroy(resampler);
-                                } else {
-                                    playbackSamples = pcm16bit;
+                                    playbackSamples = resampled;
+                                    playbackCount = out_len;
+                                    m_counters->add(m_counters->resampleUsec, switch_micro_time_now() - resampleStart);
                                 }
-                            } else {
-                                playbackSamples = pcm16bit;
                             }
                             
-                            // 写入播放缓冲区
+                            // 写入播放队列（首段音频到达时才创建）；segmentId 相同的分片追加到同一段
+                            cJSON* jsPriority = cJSON_GetObjectItem(jsonData, "priority");
+                            cJSON* jsInterrupt = cJSON_GetObjectItem(jsonData, "interrupt");
+                            const bool interrupt = jsInterrupt && (jsInterrupt->type == cJSON_True ||
+                                                                   (jsInterrupt->type == cJSON_Number && jsInterrupt->valueint));
                             switch_mutex_lock(tech_pvt->play_mutex);
-                            size_t data_size = playbackSamples.size() * sizeof(int16_t);
-                            size_t available = switch_buffer_freespace(tech_pvt->play_buffer);
+                            if (!tech_pvt->pPlayback) {
+                                tech_pvt->pPlayback = new PlaybackQueue(tech_pvt->sampling * tech_pvt->channels * sizeof(int16_t) * PLAYBACK_MAX_SEC);
+                            }
+                            auto *playback = static_cast<PlaybackQueue *>(tech_pvt->pPlayback);
+                            // 上一段的尾巴只补给还在队列里的段，已播完的就丢掉
+                            if (prevTailCount && playback->queued(m_resampleSegment)) {
+                                playback->write(m_resampleSegment, 0, false, (const uint8_t*)prevTail, prevTailCount * sizeof(int16_t));
+                            }
+                            size_t data_size = playbackCount * sizeof(int16_t);
+                            size_t available = playback->freespace();
                             
-                            if (available >= data_size) {
-                                switch_buffer_write(tech_pvt->play_buffer,
-                                                   (uint8_t*)playbackSamples.data(),
-                                                   data_size);
+                            if (playback->write(segment, jsPriority ? jsPriority->valueint : 0, interrupt,
+                                                (const uint8_t*)playbackSamples, data_size)) {
+                                m_counters->add(m_counters->downlinkBytes, data_size);
                                 
-                                size_t buffer_inuse = switch_buffer_inuse(tech_pvt->play_buffer);
+                                size_t buffer_inuse = playback->inuse();
                                 double buffer_ms = (double)buffer_inuse / (tech_pvt->sampling * tech_pvt->channels * sizeof(int16_t)) * 1000.0;
                                 
                                 switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_INFO,
                                     "(%s) Streaming playback: queued %zu samples @ %d Hz (buffer: %.2f ms, available: %zu bytes)\n",
-                                    m_sessionId.c_str(), playbackSamples.size(), target_rate, buffer_ms, available);
+                                    m_sessionId.c_str(), playbackCount, target_rate, buffer_ms, available);
                             } else {
-                                size_t buffer_inuse = switch_buffer_inuse(tech_pvt->play_buffer);
+                                m_counters->add(m_counters->overruns);
+                                size_t buffer_inuse = playback->inuse();
                                 double buffer_ms = (double)buffer_inuse / (tech_pvt->sampling * tech_pvt->channels * sizeof(int16_t)) * 1000.0;
                                 switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_WARNING,
                                     "(%s) Play buffer full (%.2f ms), dropping %zu samples (need %zu bytes, available %zu bytes)\n",
-                                    m_sessionId.c_str(), buffer_ms, playbackSamples.size(), data_size, available);
+                                    m_sessionId.c_str(), buffer_ms, playbackCount, data_size, available);
                             }
                             switch_mutex_unlock(tech_pvt->play_mutex);
                         }
                         
-                        std::vector<int16_t> outputSamples;
+                        const int16_t* outputSamples = pcm16bit;
+                        size_t outputCount = input_samples;
                         
-                        // 步骤 2b: 文件保存 - 重采样到 8000Hz（兼容性）
+                        // 步骤 2b: 文件保存 - 重采样到 8000Hz（兼容性）；上一段的尾巴写在本条消息的音频之前
+                        int16_t* fileTail = nullptr;
+                        size_t fileTailCount = 0;
+                        if (segmentSwitched) {
+                            fileTail = m_scratch.alloc<int16_t>(m_fileResampler.tail());
+                            fileTailCount = m_fileResampler.flush(fileTail, m_fileResampler.tail());
+                        }
                         if (sampleRate != 8000) {
                             int err;
-                            SpeexResamplerState* resampler = speex_resampler_init(1, sampleRate, 8000, SWITCH_RESAMPLE_QUALITY, &err);
+                            SpeexResamplerState* resampler = m_fileResampler.get(sampleRate, 8000, &err);
                             
                             if (err == 0 && resampler) {
                                 // 防止溢出：使用 uint64_t 进行中间计算
                                 size_t output_samples = ((uint64_t)input_samples * 8000 + sampleRate - 1) / sampleRate;
+                                const size_t tail = segmentEnds ? m_fileResampler.tail() : 0;
                                 
-                                outputSamples.resize(output_samples);
-                                spx_uint32_t in_len = input_samples;
-                                spx_uint32_t out_len = output_samples;
+                                int16_t* resampled = m_scratch.alloc<int16_t>(output_samples + tail);
+                                spx_uint32_t out_len = m_fileResampler.process(pcm16bit, input_samples, resampled, output_samples);
+                                if (segmentEnds) out_len += m_fileResampler.flush(resampled + out_len, tail);
                                 
-                                speex_resampler_process_int(resampler, 0,
-                                                            pcm16bit.data(),
-                                                            &in_len,
-                                                            outputSamples.data(),
-                                                            &out_len);
-                                
-                                outputSamples.resize(out_len);
-                                speex_resampler_destroy(resampler);
+                                outputSamples = resampled;
+                                outputCount = out_len;
                                 
                                 switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_INFO,
                                                   "(%s) processMessage - resampled from %d to 8000 Hz: %zu -> %zu samples\n",
@@ -456,72 +978,79 @@ public:
                             }
                         } else {
                             // 采样率已经是8000Hz，直接使用 16-bit 数据
-                            outputSamples = pcm16bit;
                             switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_INFO,
                                               "(%s) processMessage - no resampling needed, using %zu samples\n",
                                               m_sessionId.c_str(), input_samples);
                         }
                         
-                        // 生成 G.711 A-law WAV 文件
-                        switch_snprintf(finalFilePath, 256, "%s%s%s_%d.wav", SWITCH_GLOBAL_dirs.temp_dir,
-                                        SWITCH_PATH_SEPARATOR, m_sessionId.c_str(), m_playFile++);
-                        
                         // 将 PCM 转换为 A-law
-                        std::vector<uint8_t> alawData(outputSamples.size());
-                        for (size_t i = 0; i < outputSamples.size(); i++) {
+                        uint8_t* alawData = m_scratch.alloc<uint8_t>(outputCount);
+                        for (size_t i = 0; i < outputCount; i++) {
                             alawData[i] = linear_to_alaw(outputSamples[i]);
                         }
                         
                         switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_INFO,
                                           "(%s) processMessage - converted %zu samples to A-law\n",
-                                          m_sessionId.c_str(), outputSamples.size());
+                                          m_sessionId.c_str(), outputCount);
                         
-                        // 写入 G.711 A-law WAV 文件头和数据（小端序）
-                        std::ofstream wavFile(finalFilePath, std::ofstream::binary);
-                        if (wavFile.is_open()) {
-                            uint32_t dataSize = alawData.size();  // A-law 是 8-bit，每样本 1 字节
-                            uint32_t fileSize = 38 + dataSize;    // 使用 fmt size=18 时，总大小为 38+dataSize
-                            uint32_t outputSampleRate = 8000;     // 固定输出 8000 Hz
-                            uint16_t numChannels = 1;
-                            uint16_t bitsPerSample = 8;           // A-law 是 8-bit
-                            uint32_t byteRate = outputSampleRate * numChannels * bitsPerSample / 8;
-                            uint16_t blockAlign = numChannels * bitsPerSample / 8;
-                            
-                            // RIFF header (小端序)
-                            wavFile.write("RIFF", 4);
-                            write_le32(wavFile, fileSize);
-                            wavFile.write("WAVE", 4);
-                            
-                            // fmt chunk (小端序) - 使用标准建议的 size=18
-                            wavFile.write("fmt ", 4);
-                            write_le32(wavFile, 18);  // fmtSize: 标准建议为 18
-                            write_le16(wavFile, 6);   // audioFormat: G.711 A-law
-                            write_le16(wavFile, numChannels);
-                            write_le32(wavFile, outputSampleRate);
-                            write_le32(wavFile, byteRate);
-                            write_le16(wavFile, blockAlign);
-                            write_le16(wavFile, bitsPerSample);
-                            write_le16(wavFile, 0);   // cbSize: 扩展字段大小为 0
-                            
-                            // data chunk (小端序)
-                            wavFile.write("data", 4);
-                            write_le32(wavFile, dataSize);
-                            wavFile.write((char*)alawData.data(), dataSize);
-                            
-                            wavFile.close();
-                            
-                            m_Files.insert(finalFilePath);
-                            jsonFile = cJSON_CreateString(finalFilePath);
-                            cJSON_AddItemToObject(jsonData, "file", jsonFile);
-                            
-                            switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_INFO,
-                                              "(%s) processMessage - G.711 A-law WAV file created: %s (8000 Hz, %u bytes, %zu samples)\n",
-                                              m_sessionId.c_str(), finalFilePath, dataSize, outputSamples.size());
+                        if (m_settings->playFilePerChunk) {
+                            // 每条消息一个 G.711 A-law WAV 文件（旧的事件约定）；上一段的尾巴不属于本条消息，不写入
+                            switch_snprintf(finalFilePath, sizeof(finalFilePath), "%s%s%s_%d.wav", SWITCH_GLOBAL_dirs.temp_dir,
+                                            SWITCH_PATH_SEPARATOR, m_sessionId.c_str(), m_playFile++);
+                            WavWriter chunkWav;
+                            if (chunkWav.open(finalFilePath, WAV_ALAW, 8000, 1, 8) &&
+                                chunkWav.append(alawData, outputCount) >= 0 && chunkWav.close()) {
+                                m_playFiles.push_back(finalFilePath);
+                                jsonFile = cJSON_CreateString(finalFilePath);
+                                cJSON_AddItemToObject(jsonData, "file", jsonFile);
+                                
+                                switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_INFO,
+                                                  "(%s) processMessage - G.711 A-law WAV file created: %s (8000 Hz, %zu samples)\n",
+                                                  m_sessionId.c_str(), finalFilePath, outputCount);
+                            } else {
+                                chunkWav.close();
+                                remove(finalFilePath);
+                                switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_ERROR,
+                                                  "(%s) processMessage - failed to create WAV file: %s\n",
+                                                  m_sessionId.c_str(), finalFilePath);
+                            }
                         } else {
-                            switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_ERROR,
-                                              "(%s) processMessage - failed to create WAV file: %s\n",
-                                              m_sessionId.c_str(), finalFilePath);
+                            // 追加到本会话唯一的 G.711 A-law WAV 文件（8000 Hz，首段音频到达时创建）
+                            if (!m_playWav.isOpen() && !m_playWavFailed) {
+                                switch_snprintf(finalFilePath, sizeof(finalFilePath), "%s%s%s_play.wav", SWITCH_GLOBAL_dirs.temp_dir,
+                                                SWITCH_PATH_SEPARATOR, m_sessionId.c_str());
+                                if (!m_playWav.open(finalFilePath, WAV_ALAW, 8000, 1, 8)) {
+                                    m_playWavFailed = true;
+                                    switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_ERROR,
+                                                      "(%s) processMessage - failed to create WAV file: %s\n",
+                                                      m_sessionId.c_str(), finalFilePath);
+                                }
+                            }
+                            if (fileTailCount) {
+                                uint8_t* tailAlaw = m_scratch.alloc<uint8_t>(fileTailCount);
+                                for (size_t i = 0; i < fileTailCount; i++) tailAlaw[i] = linear_to_alaw(fileTail[i]);
+                                m_playWav.append(tailAlaw, fileTailCount);
+                            }
+                            const int64_t offset = m_playWav.append(alawData, outputCount);
+                            if (offset >= 0) {
+                                // A-law 每样本 1 字节：byteOffset 为文件内位置，sampleOffset 为音频内位置
+                                jsonFile = cJSON_CreateString(m_playWav.path().c_str());
+                                cJSON_AddItemToObject(jsonData, "file", jsonFile);
+                                cJSON_AddNumberToObject(jsonData, "byteOffset", offset);
+                                cJSON_AddNumberToObject(jsonData, "sampleOffset", offset - m_playWav.headerBytes());
+                                cJSON_AddNumberToObject(jsonData, "samples", outputCount);
+                            
+                                switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_INFO,
+                                                  "(%s) processMessage - appended %zu samples to %s at %lld\n",
+                                                  m_sessionId.c_str(), outputCount, m_playWav.path().c_str(), (long long) offset);
+                            } else if (m_playWav.isOpen()) {
+                                switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_ERROR,
+                                                  "(%s) processMessage - failed to write WAV file: %s\n",
+                                                  m_sessionId.c_str(), m_playWav.path().c_str());
+                            }
                         }
+                        m_resampleSegment = segment;
+                        m_resampleOpen = !segmentEnds;
                     } else {
                         switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_WARNING,
                                           "(%s) processMessage - unsupported audio format, only raw audio is supported\n",
@@ -532,7 +1061,7 @@ public:
                                       "(%s) processMessage - skipped file creation: jsonAudio=%s, fileType=%s\n",
                                       m_sessionId.c_str(),
                                       jsonAudio ? "valid" : "NULL",
-                                      fileType.empty() ? "EMPTY" : fileType.c_str());
+                                      *fileType ? fileType : "EMPTY");
                 }
 
                 if(jsonFile) {
@@ -542,8 +1071,8 @@ public:
                                       "(%s) processMessage - firing EVENT_PLAY: %s\n",
                                       m_sessionId.c_str(), jsonString);
                     
-                    m_notify(session, EVENT_PLAY, jsonString);
-                    message.assign(jsonString);
+                    notify(session, EVENT_PLAY, jsonString);
+                    played.assign(jsonString);
                     free(jsonString);
                     status = SWITCH_TRUE;
                 } else {
@@ -562,43 +1091,138 @@ public:
         return status;
     }
 
-    ~AudioStreamer()= default;
+    // graceful-shutdown: no reconnect from now on, wait for the server to close
+    void beginDrain() {
+        std::lock_guard<std::mutex> lk(m_reconnectMutex);
+        m_draining = true;
+        m_entry->state = STREAM_DRAINING;
+    }
+
+    bool isDrained() {
+        return !m_reconnecting && !isConnected();
+    }
+
+    ~AudioStreamer() {
+        if (m_reconnectThread.joinable()) m_reconnectThread.join();
+    }
 
     void disconnect() {
         switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "disconnecting...\n");
-        client.disconnect();
+        {
+            std::lock_guard<std::mutex> lk(m_reconnectMutex);
+            m_closing = true;
+            m_reconnectCond.notify_all();
+        }
+        if (m_reconnectThread.joinable()) m_reconnectThread.join();
+
+        std::unique_ptr<StreamTransport> transport;
+        std::string released;
+        {
+            std::lock_guard<std::recursive_mutex> guard(m_transportLock);
+            transport = std::move(m_transport);
+            released.swap(m_openUri);
+        }
+        if (transport) transport->close();
+        if (!released.empty()) endpoint_released(released);
     }
 
     bool isConnected() {
-        return client.isConnected();
+        std::lock_guard<std::recursive_mutex> guard(m_transportLock);
+        return m_transport && m_transport->isConnected();
+    }
+
+    // connected, or buffering uplink audio while reconnecting
+    bool isStreaming() {
+        return m_reconnecting || isConnected();
     }
 
     void writeBinary(uint8_t* buffer, size_t len) {
-        if(!this->isConnected()) return;
-        client.sendBinary(buffer, len);
+        std::lock_guard<std::recursive_mutex> guard(m_transportLock);
+        m_replay.append(buffer, len);
+        if(m_reconnecting || !m_transport || !m_transport->isConnected()) return;
+        m_transport->sendBinary(buffer, len);
+        m_counters->add(m_counters->uplinkBytes, len);
     }
 
     void writeText(const char* text) {
-        if(!this->isConnected()) return;
-        client.sendMessage(text, strlen(text));
+        std::lock_guard<std::recursive_mutex> guard(m_transportLock);
+        if(!m_transport || !m_transport->isConnected()) return;
+        m_transport->sendText(text, strlen(text));
+    }
+
+    void setPaused(bool paused) {
+        m_entry->paused = paused;
+    }
+
+    const StreamProfile& settings() const {
+        return m_settings;
+    }
+
+    // no session events after this returns, see SessionLink
+    void detachSession() {
+        m_session.detach();
     }
 
     void deleteFiles() {
-        if(m_playFile >0) {
-            for (const auto &fileName: m_Files) {
-                remove(fileName.c_str());
-            }
+        if (m_playWav.isOpen()) {
+            m_playWav.close();
+            remove(m_playWav.path().c_str());
+        }
+        for (const auto& fileName : m_playFiles) {
+            remove(fileName.c_str());
         }
     }
 
 private:
     std::string m_sessionId;
+    SessionLink m_session;
     responseHandler_t m_notify;
-    WebSocketClient client;
-    bool m_suppress_log;
-    const char* m_extra_headers;
-    int m_playFile;
-    std::unordered_set<std::string> m_Files;
+    bool m_eventBus;
+    std::shared_ptr<StreamEntry> m_entry;
+    std::shared_ptr<StreamCounters> m_counters;
+    switch_time_t m_created;
+    std::atomic<switch_time_t> m_firstOpen{0};
+    std::atomic<bool> m_messageSeen{false};
+    StreamProfile m_settings;
+    std::recursive_mutex m_transportLock;   // guards m_transport and the replay state
+    std::unique_ptr<StreamTransport> m_transport;
+    std::atomic<uint32_t> m_generation{0};
+    std::atomic<uint32_t> m_openGeneration{0};
+    std::atomic<uint32_t> m_failedGeneration{0};
+    std::vector<std::string> m_endpoints;
+    EndpointPolicy m_policy;
+    std::chrono::steady_clock::time_point m_setupDeadline;
+    int m_setupTimeoutMs = 0;
+    std::string m_uri;          // endpoint of m_transport
+    std::string m_openUri;      // counted as an active stream of that endpoint
+    WavWriter m_playWav;                // every played chunk, appended, see processMessage
+    bool m_playWavFailed = false;
+    int m_playFile = 0;                 // per chunk files when play-file-per-chunk is set
+    std::vector<std::string> m_playFiles;
+    ScratchArena m_scratch;             // downlink message buffers, see processMessage
+    CachedResampler m_playResampler;    // TTS -> call rate
+    CachedResampler m_fileResampler;    // TTS -> 8000 Hz for the saved files
+    std::string m_resampleSegment;      // whose audio the resamplers hold the end of
+    bool m_resampleOpen = false;        // its last chunk has not come yet
+    std::string m_initialMetadata;
+
+    int m_reconnectAttempts = 0;
+    int m_reconnects = 0;
+    int m_failovers = 0;
+    size_t m_bytesPerMs = 0;
+    std::atomic<bool> m_wasOpen{false};
+    std::atomic<bool> m_reconnecting{false};
+    std::atomic<bool> m_failingOver{false};
+    std::atomic<bool> m_closing{false};
+    std::atomic<bool> m_draining{false};
+    bool m_attemptFailed = false;
+    std::thread m_reconnectThread;
+    std::mutex m_reconnectMutex;
+    std::condition_variable m_reconnectCond;
+    ReplayBuffer m_replay;
+    uint64_t m_dropOffset = 0;
+    uint64_t m_acked = 0;
+    bool m_ackSeen = false;
 };
 
 
@@ -611,9 +1235,7 @@ namespace {
 
     switch_status_t stream_data_init(private_t *tech_pvt, switch_core_session_t *session, char *wsUri,
                                      uint32_t sampling, int desiredSampling, int channels, char *metadata, responseHandler_t responseHandler,
-                                     int deflate, int heart_beat, bool suppressLog, int rtp_packets, const char* extra_headers,
-                                     bool no_reconnect, const char *tls_cafile, const char *tls_keyfile,
-                                     const char *tls_certfile, bool tls_disable_hostname_validation)
+                                     const StreamProfile& settings)
     {
         int err; //speex
 
@@ -622,21 +1244,21 @@ namespace {
         memset(tech_pvt, 0, sizeof(private_t));
 
         strncpy(tech_pvt->sessionId, switch_core_session_get_uuid(session), MAX_SESSION_ID);
-        strncpy(tech_pvt->ws_uri, wsUri, MAX_WS_URI);
         tech_pvt->sampling = desiredSampling;
         tech_pvt->responseHandler = responseHandler;
-        tech_pvt->rtp_packets = rtp_packets;
+        tech_pvt->rtp_packets = settings->rtpPackets;
         tech_pvt->channels = channels;
         tech_pvt->audio_paused = 0;
-
-        if (metadata) strncpy(tech_pvt->initialMetadata, metadata, MAX_METADATA_LEN);
+        tech_pvt->event_bus = settings->eventBus;
 
         //size_t buflen = (FRAME_SIZE_8000 * desiredSampling / 8000 * channels * 1000 / RTP_PERIOD * BUFFERED_SEC);
-        const size_t buflen = (FRAME_SIZE_8000 * desiredSampling / 8000 * channels * rtp_packets);
+        const size_t buflen = (FRAME_SIZE_8000 * desiredSampling / 8000 * channels * tech_pvt->rtp_packets);
+
+        auto entry = registry_add(tech_pvt->sessionId);
+        tech_pvt->pCounters = entry->counters.get();
 
-        auto* as = new AudioStreamer(tech_pvt->sessionId, wsUri, responseHandler, deflate, heart_beat,
-                                        suppressLog, extra_headers, no_reconnect,
-                                        tls_cafile, tls_keyfile, tls_certfile, tls_disable_hostname_validation);
+        auto* as = new AudioStreamer(session, tech_pvt->sessionId, wsUri, responseHandler, settings,
+                                        metadata, desiredSampling, channels, entry);
 
         tech_pvt->pAudioStreamer = static_cast<void *>(as);
 
@@ -648,37 +1270,11 @@ namespace {
             return SWITCH_STATUS_FALSE;
         }
         
-        // 初始化播放缓冲区（10秒缓冲，用于流式播放，防止突发音频丢失）
-        const size_t play_buflen = desiredSampling * channels * sizeof(int16_t) * 10;
-        if (switch_buffer_create(pool, &tech_pvt->play_buffer, play_buflen) != SWITCH_STATUS_SUCCESS) {
-            switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_ERROR,
-                "%s: Error creating play buffer.\n", tech_pvt->sessionId);
-            return SWITCH_STATUS_FALSE;
-        }
-        
-        // 初始化播放互斥锁
+        // 初始化播放互斥锁；播放缓冲区在首段音频到达时才创建（最多缓冲 PLAYBACK_MAX_SEC 秒）
         switch_mutex_init(&tech_pvt->play_mutex, SWITCH_MUTEX_NESTED, pool);
         
         // 默认启用流式播放
         tech_pvt->stream_play_enabled = 1;
-        tech_pvt->play_thread_running = 0;
-
-        tech_pvt->write_frame_data = (uint8_t*)switch_core_session_alloc(session, SWITCH_RECOMMENDED_BUFFER_SIZE);
-        if (!tech_pvt->write_frame_data) {
-            switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_ERROR,
-                "%s: Failed to allocate write frame buffer.\n", tech_pvt->sessionId);
-            return SWITCH_STATUS_FALSE;
-        }
-        memset(&tech_pvt->write_frame, 0, sizeof(tech_pvt->write_frame));
-        tech_pvt->write_frame.data = tech_pvt->write_frame_data;
-        tech_pvt->write_frame.buflen = SWITCH_RECOMMENDED_BUFFER_SIZE;
-        tech_pvt->write_frame.rate = desiredSampling;
-        tech_pvt->write_frame.channels = channels;
-        
-        switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_INFO,
-            "(%s) Stream play enabled with buffer size: %zu bytes (%.2f seconds)\n",
-            tech_pvt->sessionId, play_buflen, 
-            (double)play_buflen / (desiredSampling * channels * sizeof(int16_t)));
 
 
         if (desiredSampling != sampling) {
@@ -693,6 +1289,44 @@ namespace {
             switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_DEBUG, "(%s) no resampling needed for this call\n", tech_pvt->sessionId);
         }
 
+        if (!settings->recordFile.empty()) {
+            switch_channel_t *channel = switch_core_session_get_channel(session);
+            char *path = switch_channel_expand_variables(channel, settings->recordFile.c_str());
+            tech_pvt->pRecorder = recorder_open(tech_pvt->sessionId, path, desiredSampling);
+            if (tech_pvt->pRecorder) {
+                switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_INFO, "(%s) recording the call to %s\n", tech_pvt->sessionId, path);
+            } else {
+                // the stream goes on without it
+                switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_ERROR, "(%s) cannot create recording %s\n", tech_pvt->sessionId, path);
+            }
+            if (path != settings->recordFile.c_str()) free(path);
+        }
+
+        if (settings->catchupMs > 0) {
+            if (channels == 1) {
+                tech_pvt->pStretch = new TimeStretch(desiredSampling, settings->catchupMs, settings->catchupSpeedup,
+                                                     settings->catchupSlowdown);
+            } else {
+                switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_WARNING,
+                                  "(%s) playback catch-up only works on mono streams, left off\n", tech_pvt->sessionId);
+            }
+        }
+
+        if (settings->echoCancel) {
+            // at the stream rate, the one the played audio is at
+            tech_pvt->pEcho = new EchoCanceller(desiredSampling, settings->echoTailMs, settings->echoDelayMs);
+        }
+
+        if (settings->bargeIn != BARGE_IN_OFF) {
+            tech_pvt->pBargeIn = new BargeInDetector(desiredSampling, settings->bargeInLevel, settings->bargeInMs);
+            tech_pvt->barge_in_gain = settings->bargeIn == BARGE_IN_DUCK ? (float) pow(10.0, -settings->bargeInDuckDb / 20.0) : 0;
+        }
+
+        if (settings->comfortNoise) {
+            tech_pvt->pComfort = new ComfortNoise(desiredSampling, channels, settings->comfortNoiseLevel,
+                                                  settings->comfortNoiseHangoverMs);
+        }
+
         switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_DEBUG, "(%s) stream_data_init\n", tech_pvt->sessionId);
 
         return SWITCH_STATUS_SUCCESS;
@@ -700,6 +1334,22 @@ namespace {
 
     void destroy_tech_pvt(private_t* tech_pvt) {
         switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_INFO, "%s destroy_tech_pvt\n", tech_pvt->sessionId);
+
+        registry_remove(tech_pvt->sessionId);
+        tech_pvt->pCounters = nullptr;
+
+        if (tech_pvt->pRecorder) {
+            recorder_close(static_cast<CallRecorder *>(tech_pvt->pRecorder));
+            tech_pvt->pRecorder = nullptr;
+        }
+        if (tech_pvt->pEcho) {
+            delete static_cast<EchoCanceller *>(tech_pvt->pEcho);
+            tech_pvt->pEcho = nullptr;
+        }
+        if (tech_pvt->pBargeIn) {
+            delete static_cast<BargeInDetector *>(tech_pvt->pBargeIn);
+            tech_pvt->pBargeIn = nullptr;
+        }
         
         if (tech_pvt->resampler) {
             speex_resampler_destroy(tech_pvt->resampler);
@@ -713,9 +1363,17 @@ namespace {
             switch_mutex_destroy(tech_pvt->play_mutex);
             tech_pvt->play_mutex = nullptr;
         }
-        if (tech_pvt->play_buffer) {
-            switch_buffer_destroy(&tech_pvt->play_buffer);
-            tech_pvt->play_buffer = nullptr;
+        if (tech_pvt->pPlayback) {
+            delete static_cast<PlaybackQueue *>(tech_pvt->pPlayback);
+            tech_pvt->pPlayback = nullptr;
+        }
+        if (tech_pvt->pStretch) {
+            delete static_cast<TimeStretch *>(tech_pvt->pStretch);
+            tech_pvt->pStretch = nullptr;
+        }
+        if (tech_pvt->pComfort) {
+            delete static_cast<ComfortNoise *>(tech_pvt->pComfort);
+            tech_pvt->pComfort = nullptr;
         }
         if (tech_pvt->pAudioStreamer) {
             auto* as = (AudioStreamer *) tech_pvt->pAudioStreamer;
@@ -729,10 +1387,49 @@ namespace {
         aStreamer.reset((AudioStreamer *)tech_pvt->pAudioStreamer);
         tech_pvt->pAudioStreamer = nullptr;
 
-        std::thread t([aStreamer]{
+        reaper_submit(tech_pvt->sessionId, [aStreamer]{
             aStreamer->disconnect();
         });
-        t.detach();
+    }
+
+    // 本地打断：播放中主叫开口，立即暂停或压低播放，由服务端决定 resumeAudio 还是 cancelAudio
+    void detect_barge_in(private_t* tech_pvt, AudioStreamer* streamer, const int16_t* samples, size_t frames) {
+        auto *detector = static_cast<BargeInDetector *>(tech_pvt->pBargeIn);
+        if (!detector->feed(samples, frames, tech_pvt->channels)) return;
+
+        const switch_time_t now = switch_micro_time_now();
+        const size_t bytesPerSec = tech_pvt->sampling * tech_pvt->channels * sizeof(int16_t);
+        cJSON* segments = cJSON_CreateArray();
+        switch_mutex_lock(tech_pvt->play_mutex);
+        auto *playback = static_cast<PlaybackQueue *>(tech_pvt->pPlayback);
+        auto *stretch = static_cast<TimeStretch *>(tech_pvt->pStretch);
+        const bool playing = playback && (playback->inuse() > 0 || (stretch && stretch->held() > 0));
+        const bool barge = playing && !tech_pvt->barged_in;
+        if (barge) {
+            tech_pvt->barged_in = 1;
+            playback->list(segments, bytesPerSec);
+        }
+        switch_mutex_unlock(tech_pvt->play_mutex);
+        if (!barge) {
+            cJSON_Delete(segments);
+            return;
+        }
+
+        auto *counters = static_cast<StreamCounters *>(tech_pvt->pCounters);
+        counters->add(counters->bargeIns);
+        cJSON* root = cJSON_CreateObject();
+        cJSON_AddStringToObject(root, "type", "bargeIn");
+        // when the caller started talking, in ms since the epoch
+        cJSON_AddNumberToObject(root, "timestamp", (double) ((now - (switch_time_t) detector->speechMs() * 1000) / 1000));
+        cJSON_AddNumberToObject(root, "speechMs", detector->speechMs());
+        cJSON_AddStringToObject(root, "action", tech_pvt->barge_in_gain > 0 ? "duck" : "pause");
+        cJSON_AddItemToObject(root, "segments", segments);
+        char* text = cJSON_PrintUnformatted(root);
+        streamer->writeText(text);
+        free(text);
+        cJSON_Delete(root);
+        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_INFO, "(%s) caller barged in, playback %s\n", tech_pvt->sessionId,
+                          tech_pvt->barge_in_gain > 0 ? "ducked" : "paused");
     }
 
 }
@@ -750,13 +1447,6 @@ extern "C" {
             return;
         }
         
-        if (!tech_pvt->play_buffer) {
-            switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_WARNING,
-                              "(%s) stream_play_frame: play_buffer is NULL\n",
-                              tech_pvt->sessionId);
-            return;
-        }
-        
         if (!tech_pvt->stream_play_enabled) {
             switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_DEBUG,
                               "(%s) stream_play_frame: stream_play_enabled is 0\n",
@@ -775,7 +1465,12 @@ extern "C" {
         // 从 media bug 获取写方向的替换帧（播放给线路的音频）
         switch_frame_t *out_frame = switch_core_media_bug_get_write_replace_frame(bug);
         if (!out_frame) {
-            out_frame = &tech_pvt->write_frame;
+            if (!tech_pvt->write_frame) {
+                tech_pvt->write_frame = (switch_frame_t *) switch_core_session_alloc(session, sizeof(switch_frame_t));
+                tech_pvt->write_frame->data = switch_core_session_alloc(session, SWITCH_RECOMMENDED_BUFFER_SIZE);
+                tech_pvt->write_frame->buflen = SWITCH_RECOMMENDED_BUFFER_SIZE;
+            }
+            out_frame = tech_pvt->write_frame;
         }
         if (!out_frame->data || !out_frame->buflen) {
             switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_DEBUG,
@@ -794,25 +1489,53 @@ extern "C" {
         }
 
         bool injected = false;
+        bool noise = false;            // 缓冲区空时填充的舒适噪声
+        auto *counters = static_cast<StreamCounters *>(tech_pvt->pCounters);
+        const size_t frame_bytes = tech_pvt->channels * sizeof(int16_t);
 
         switch_mutex_lock(tech_pvt->play_mutex);
-        size_t inuse = switch_buffer_inuse(tech_pvt->play_buffer);
-
-        if (inuse > 0) {
-            size_t read_size = target_bytes;
-            if (inuse < read_size) {
-                read_size = inuse;
+        auto *playback = static_cast<PlaybackQueue *>(tech_pvt->pPlayback);
+        auto *stretch = static_cast<TimeStretch *>(tech_pvt->pStretch);
+        auto *comfort = static_cast<ComfortNoise *>(tech_pvt->pComfort);
+        // 变速时已从队列取出、尚未播放的部分也算在内
+        const size_t held = stretch ? stretch->held() * sizeof(int16_t) : 0;
+        size_t inuse = playback ? playback->inuse() + held : 0;
+        const double bytes_per_ms = tech_pvt->sampling * tech_pvt->channels * sizeof(int16_t) / 1000.0;
+
+        // 打断后暂停：队列保留，直到服务端 resumeAudio 或 cancelAudio
+        const bool held_back = tech_pvt->barged_in && tech_pvt->barge_in_gain == 0;
+
+        if (inuse > 0 && !held_back) {
+            size_t read_size;
+            if (stretch) {
+                // 积压超过目标时加速播放，将近耗尽时放慢，音调不变
+                const double speed = stretch->speed(inuse / bytes_per_ms);
+                read_size = stretch->render(*playback, (int16_t *) out_frame->data, target_bytes / sizeof(int16_t), speed)
+                            * sizeof(int16_t);
+            } else {
+                read_size = playback->read((uint8_t*)out_frame->data, target_bytes);
             }
-
-            switch_buffer_read(tech_pvt->play_buffer, out_frame->data, read_size);
             injected = true;
 
-            if (read_size < target_bytes) {
+            if (tech_pvt->barged_in) {
+                // 打断后压低音量
+                auto *samples = (int16_t *) out_frame->data;
+                for (size_t i = 0; i < read_size / sizeof(int16_t); i++) {
+                    samples[i] = (int16_t) (samples[i] * tech_pvt->barge_in_gain);
+                }
+            }
+            if (comfort) {
+                // 首尾淡入淡出，不足一帧的部分用舒适噪声补齐
+                const bool last = playback->inuse() == 0 && !(stretch && stretch->held());
+                comfort->audio((int16_t *) out_frame->data, read_size / frame_bytes, target_bytes / frame_bytes, last);
+            } else if (read_size < target_bytes) {
                 memset((uint8_t*)out_frame->data + read_size, 0, target_bytes - read_size);
             }
+            if (read_size < target_bytes && counters) counters->add(counters->underruns);
+            if (counters) counters->add(counters->playFrames);
 
             out_frame->datalen = target_bytes;
-            out_frame->samples = target_bytes / (tech_pvt->channels * sizeof(int16_t));
+            out_frame->samples = target_bytes / frame_bytes;
             out_frame->rate = tech_pvt->sampling;
             out_frame->channels = tech_pvt->channels;
 
@@ -824,12 +1547,41 @@ extern "C" {
                               out_frame->samples,
                               out_frame->rate,
                               out_frame->channels,
-                              (double)switch_buffer_inuse(tech_pvt->play_buffer) /
-                              (tech_pvt->sampling * tech_pvt->channels * sizeof(int16_t)) * 1000.0);
+                              (playback->inuse() + (stretch ? stretch->held() * sizeof(int16_t) : 0)) / bytes_per_ms);
+        } else if (comfort && comfort->gap((int16_t *) out_frame->data, target_bytes / frame_bytes)) {
+            // 段内短暂断流：在 hangover 内以舒适噪声代替静音或原始音频
+            noise = true;
+            out_frame->datalen = target_bytes;
+            out_frame->samples = target_bytes / frame_bytes;
+            out_frame->rate = tech_pvt->sampling;
+            out_frame->channels = tech_pvt->channels;
         }
         switch_mutex_unlock(tech_pvt->play_mutex);
 
-        if (!injected) {
+        if (counters) {
+            // 一段播放开始：记录从主叫最后说话到首帧注入的时延（每轮一次）
+            if (injected && !counters->playing && tech_pvt->last_voice > tech_pvt->turn_voice) {
+                latency_record(LATENCY_TURN, counters->endpoint(), switch_micro_time_now() - tech_pvt->last_voice);
+                tech_pvt->turn_voice = tech_pvt->last_voice;
+            }
+            // 播放中途缓冲区耗尽（打断暂停不算）
+            if (counters->playing && !injected && !held_back) counters->add(counters->underruns);
+            counters->playing = injected;
+        }
+
+        if (tech_pvt->pRecorder) {
+            // 录音右声道：注入的音频（含舒适噪声），未注入时为静音
+            recorder_feed(static_cast<CallRecorder *>(tech_pvt->pRecorder), RECORD_BOT,
+                          injected || noise ? (const int16_t *) out_frame->data : nullptr,
+                          target_bytes / (tech_pvt->channels * sizeof(int16_t)), tech_pvt->channels, switch_micro_time_now());
+        }
+        if (tech_pvt->pEcho) {
+            // 回声消除的参考信号
+            static_cast<EchoCanceller *>(tech_pvt->pEcho)->playback(injected || noise ? (const int16_t *) out_frame->data : nullptr,
+                    target_bytes / (tech_pvt->channels * sizeof(int16_t)), tech_pvt->channels, switch_micro_time_now());
+        }
+
+        if (!injected && !noise) {
             // 不调用 set_write_replace_frame，保持原始音频
             switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_DEBUG,
                               "(%s) stream_play_frame: buffer empty, passthrough\n",
@@ -841,7 +1593,125 @@ extern "C" {
         switch_core_media_bug_set_write_replace_frame(bug, out_frame);
     }
     
-    int validate_ws_uri(const char* url, char* wsUri) {
+    void stream_module_init() {
+        config_load();
+        metrics_start();
+    }
+
+    void stream_module_shutdown() {
+        metrics_shutdown();
+        reaper_shutdown();
+        recorder_shutdown();
+        event_loop_shutdown();
+        ws_pool_shutdown();
+        tls_cache_shutdown();
+    }
+
+    char* stream_stats(void) {
+        cJSON* root = cJSON_CreateObject();
+        reaper_stats(root);
+        event_loop_stats(root);
+        subscribers_stats(root);
+        registry_stats(root);
+        playback_pool_stats(root);
+        recorder_stats(root);
+        config_stats(root);
+        latency_stats(root);
+        endpoint_stats(root);
+        char* json = cJSON_PrintUnformatted(root);
+        cJSON_Delete(root);
+        return json;
+    }
+
+    char* stream_session_stats(switch_core_session_t *session) {
+        switch_channel_t *channel = switch_core_session_get_channel(session);
+        auto *bug = (switch_media_bug_t*) switch_channel_get_private(channel, MY_BUG_NAME);
+        if (!bug) return nullptr;
+        auto* tech_pvt = (private_t*) switch_core_media_bug_get_user_data(bug);
+        auto* counters = static_cast<StreamCounters *>(tech_pvt->pCounters);
+        if (!counters) return nullptr;
+
+        cJSON* root = cJSON_CreateObject();
+        cJSON_AddStringToObject(root, "uuid", tech_pvt->sessionId);
+        counters_json(*counters, root);
+        double play_ms = 0;
+        cJSON* segments = cJSON_CreateArray();
+        if (tech_pvt->play_mutex) {
+            switch_mutex_lock(tech_pvt->play_mutex);
+            auto *playback = static_cast<PlaybackQueue *>(tech_pvt->pPlayback);
+            if (playback) {
+                const size_t bytesPerSec = tech_pvt->sampling * tech_pvt->channels * sizeof(int16_t);
+                play_ms = (double) playback->inuse() / bytesPerSec * 1000.0;
+                playback->list(segments, bytesPerSec);
+            }
+            switch_mutex_unlock(tech_pvt->play_mutex);
+        }
+        cJSON_AddNumberToObject(root, "playBufferMs", play_ms);
+        cJSON_AddItemToObject(root, "playQueue", segments);
+        if (tech_pvt->pEcho) static_cast<EchoCanceller *>(tech_pvt->pEcho)->stats(root);
+        char* json = cJSON_PrintUnformatted(root);
+        cJSON_Delete(root);
+        return json;
+    }
+
+    char* stream_latency(int reset) {
+        cJSON* root = cJSON_CreateObject();
+        latency_stats(root);
+        if (reset) latency_reset();
+        char* json = cJSON_PrintUnformatted(root);
+        cJSON_Delete(root);
+        return json;
+    }
+
+    switch_status_t stream_session_migrate(switch_core_session_t *session, const char* wsUri) {
+        switch_channel_t *channel = switch_core_session_get_channel(session);
+        auto *bug = (switch_media_bug_t*) switch_channel_get_private(channel, MY_BUG_NAME);
+        if (!bug) return SWITCH_STATUS_FALSE;
+        auto *tech_pvt = (private_t*) switch_core_media_bug_get_user_data(bug);
+        if (!tech_pvt) return SWITCH_STATUS_FALSE;
+
+        switch_status_t status = SWITCH_STATUS_FALSE;
+        switch_mutex_lock(tech_pvt->mutex);
+        auto *pAudioStreamer = static_cast<AudioStreamer *>(tech_pvt->pAudioStreamer);
+        if (pAudioStreamer && !tech_pvt->draining && pAudioStreamer->migrate(endpoint_split(wsUri))) {
+            status = SWITCH_STATUS_SUCCESS;
+        }
+        switch_mutex_unlock(tech_pvt->mutex);
+        return status;
+    }
+
+    int stream_session_foreach(const char* endpoint, stream_session_fn fn, void* arg) {
+        int done = 0;
+        for (const auto& uuid : registry_find(endpoint ? endpoint : "")) {
+            switch_core_session_t* session = switch_core_session_locate(uuid.c_str());
+            if (!session) continue;
+            if (fn(session, arg) == SWITCH_STATUS_SUCCESS) done++;
+            switch_core_session_rwunlock(session);
+        }
+        return done;
+    }
+
+    int stream_config_reload(void) {
+        return config_load();
+    }
+
+    char* stream_list(void) {
+        return registry_list();
+    }
+
+    char* stream_metrics() {
+        return strdup(metrics_render().c_str());
+    }
+
+    char* stream_pool_status() {
+        return ws_pool_status();
+    }
+
+    char* stream_tls_status() {
+        return tls_cache_status();
+    }
+
+    static int validate_single_ws_uri(const char* url) {
         const char* scheme = nullptr;
         const char* hostStart = nullptr;
         const char* hostEnd = nullptr;
@@ -883,8 +1753,46 @@ extern "C" {
             }
         }
 
+        return 1;
+    }
+
+    // A url, a comma separated list of urls, group:<name> for the list held by the
+    // global variable stream_endpoint_group_<name>, or profile:<name> for the endpoint
+    // of that stream profile
+    int validate_ws_uri(const char* url, char* wsUri) {
+        std::string list(url);
+        if (strncmp(url, "profile:", 8) == 0) {
+            StreamProfile profile = config_profile(url + 8);
+            if (!profile || profile->endpoints.empty()) {
+                switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "stream profile %s has no endpoint\n", url + 8);
+                return 0;
+            }
+            return validate_ws_uri(profile->endpoints.c_str(), wsUri);
+        }
+        if (strncmp(url, "group:", 6) == 0) {
+            std::string var("stream_endpoint_group_");
+            var.append(url + 6);
+            char* value = switch_core_get_variable_dup(var.c_str());
+            if (!value) {
+                switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "endpoint group %s is not defined\n", url + 6);
+                return 0;
+            }
+            list = value;
+            free(value);
+        }
+
+        std::vector<std::string> endpoints = endpoint_split(list);
+        if (endpoints.empty() || list.size() >= MAX_WS_URI) {
+            return 0;
+        }
+        for (const auto& endpoint : endpoints) {
+            if (!validate_single_ws_uri(endpoint.c_str())) {
+                return 0;
+            }
+        }
+
         // Copy valid URI to wsUri
-        std::strncpy(wsUri, url, MAX_WS_URI);
+        std::strncpy(wsUri, list.c_str(), MAX_WS_URI);
         return 1;
     }
 
@@ -936,6 +1844,100 @@ extern "C" {
         return SWITCH_STATUS_SUCCESS;
     }
 
+    switch_status_t stream_session_graceful_shutdown(switch_core_session_t *session, char* text) {
+        switch_channel_t *channel = switch_core_session_get_channel(session);
+        auto *bug = (switch_media_bug_t*) switch_channel_get_private(channel, MY_BUG_NAME);
+        if (!bug) {
+            switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_ERROR, "stream_session_graceful_shutdown failed because no bug\n");
+            return SWITCH_STATUS_FALSE;
+        }
+        auto *tech_pvt = (private_t*) switch_core_media_bug_get_user_data(bug);
+
+        if (!tech_pvt || tech_pvt->draining) return SWITCH_STATUS_FALSE;
+
+        switch_mutex_lock(tech_pvt->mutex);
+        auto *pAudioStreamer = static_cast<AudioStreamer *>(tech_pvt->pAudioStreamer);
+        if (!pAudioStreamer) {
+            switch_mutex_unlock(tech_pvt->mutex);
+            return SWITCH_STATUS_FALSE;
+        }
+        // read when draining starts, it may be set after the stream was
+        int timeout_ms = pAudioStreamer->settings()->drainTimeoutMs;
+        const char* timeout = switch_channel_get_variable(channel, "STREAM_DRAIN_TIMEOUT_MS");
+        if (timeout && atoi(timeout) > 0) {
+            timeout_ms = atoi(timeout);
+        }
+
+        // what stream_frame batched but did not send yet
+        switch_size_t inuse = switch_buffer_inuse(tech_pvt->sbuffer);
+        if (inuse > 0) {
+            std::vector<uint8_t> tmp(inuse);
+            switch_buffer_read(tech_pvt->sbuffer, tmp.data(), inuse);
+            switch_buffer_zero(tech_pvt->sbuffer);
+            pAudioStreamer->writeBinary(tmp.data(), inuse);
+        }
+        if (text) pAudioStreamer->writeText(text);
+        pAudioStreamer->beginDrain();
+
+        tech_pvt->drain_flushed = inuse;
+        tech_pvt->drain_timeout_ms = timeout_ms;
+        tech_pvt->drain_start = switch_micro_time_now();
+        tech_pvt->draining = 1;
+        switch_mutex_unlock(tech_pvt->mutex);
+
+        switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_INFO, "(%s) draining, flushed %u bytes, waiting up to %d ms for the server\n",
+                          tech_pvt->sessionId, (unsigned) inuse, timeout_ms);
+        return SWITCH_STATUS_SUCCESS;
+    }
+
+    // Called for every read frame while draining. The bug is closed once the server closed
+    // the connection (or the timeout passed) and the queued playback went out. The playback
+    // gets as long again as the timeout to finish.
+    switch_bool_t stream_drain_check(switch_media_bug_t *bug) {
+        auto *tech_pvt = (private_t *) switch_core_media_bug_get_user_data(bug);
+        switch_core_session_t *session = switch_core_media_bug_get_session(bug);
+        if (!tech_pvt) return SWITCH_FALSE;
+
+        const int64_t elapsed_ms = (switch_micro_time_now() - tech_pvt->drain_start) / 1000;
+        bool server_closed = true;
+        bool playback_empty = true;
+
+        if (switch_mutex_trylock(tech_pvt->mutex) != SWITCH_STATUS_SUCCESS) return SWITCH_TRUE;
+        auto *pAudioStreamer = static_cast<AudioStreamer *>(tech_pvt->pAudioStreamer);
+        if (pAudioStreamer) server_closed = pAudioStreamer->isDrained();
+        if (tech_pvt->play_mutex) {
+            switch_mutex_lock(tech_pvt->play_mutex);
+            auto *playback = static_cast<PlaybackQueue *>(tech_pvt->pPlayback);
+            auto *stretch = static_cast<TimeStretch *>(tech_pvt->pStretch);
+            playback_empty = (!playback || playback->inuse() == 0) && (!stretch || stretch->held() == 0);
+            switch_mutex_unlock(tech_pvt->play_mutex);
+        }
+        switch_mutex_unlock(tech_pvt->mutex);
+
+        const bool timed_out = elapsed_ms >= tech_pvt->drain_timeout_ms;
+        if (!(server_closed || timed_out) || !(playback_empty || elapsed_ms >= 2 * tech_pvt->drain_timeout_ms)) {
+            return SWITCH_TRUE;
+        }
+
+        switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_INFO, "(%s) drained in %lld ms%s\n",
+                          tech_pvt->sessionId, (long long) elapsed_ms, server_closed ? "" : ", server did not close");
+
+        cJSON *root = cJSON_CreateObject();
+        cJSON_AddStringToObject(root, "status", "drained");
+        cJSON_AddNumberToObject(root, "drainMs", elapsed_ms);
+        cJSON_AddNumberToObject(root, "flushedBytes", tech_pvt->drain_flushed);
+        cJSON_AddItemToObject(root, "serverClosed", cJSON_CreateBool(server_closed));
+        cJSON_AddItemToObject(root, "playbackComplete", cJSON_CreateBool(playback_empty));
+        char *json_str = cJSON_PrintUnformatted(root);
+        deliver_event(session, tech_pvt->sessionId, tech_pvt->responseHandler, tech_pvt->event_bus, EVENT_DRAINED, json_str,
+                      strlen(json_str));
+        cJSON_Delete(root);
+        switch_safe_free(json_str);
+
+        tech_pvt->close_requested = 1;
+        return SWITCH_FALSE;
+    }
+
     switch_status_t stream_session_pauseresume(switch_core_session_t *session, int pause) {
         switch_channel_t *channel = switch_core_session_get_channel(session);
         auto *bug = (switch_media_bug_t*) switch_channel_get_private(channel, MY_BUG_NAME);
@@ -949,6 +1951,7 @@ extern "C" {
 
         switch_core_media_bug_flush(bug);
         tech_pvt->audio_paused = pause;
+        if (tech_pvt->pAudioStreamer) static_cast<AudioStreamer *>(tech_pvt->pAudioStreamer)->setPaused(pause);
         return SWITCH_STATUS_SUCCESS;
     }
 
@@ -959,61 +1962,20 @@ extern "C" {
                                         int sampling,
                                         int channels,
                                         char* metadata,
+                                        const char* profile,
                                         void **ppUserData)
     {
-        int deflate, heart_beat;
-        bool suppressLog = false;
-        const char* buffer_size;
-        const char* extra_headers;
-        int rtp_packets = 1; //20ms burst
-        bool no_reconnect = false;
-        const char* tls_cafile = NULL;;
-        const char* tls_keyfile = NULL;;
-        const char* tls_certfile = NULL;;
-        bool tls_disable_hostname_validation = false;
-
         switch_channel_t *channel = switch_core_session_get_channel(session);
 
-        if (switch_channel_var_true(channel, "STREAM_MESSAGE_DEFLATE")) {
-            deflate = 1;
-        }
-
-        if (switch_channel_var_true(channel, "STREAM_SUPPRESS_LOG")) {
-            suppressLog = true;
-        }
-
-        if (switch_channel_var_true(channel, "STREAM_NO_RECONNECT")) {
-            no_reconnect = true;
-        }
-
-        tls_cafile = switch_channel_get_variable(channel, "STREAM_TLS_CA_FILE");
-        tls_keyfile = switch_channel_get_variable(channel, "STREAM_TLS_KEY_FILE");
-        tls_certfile = switch_channel_get_variable(channel, "STREAM_TLS_CERT_FILE");
-
-        if (switch_channel_var_true(channel, "STREAM_TLS_DISABLE_HOSTNAME_VALIDATION")) {
-            tls_disable_hostname_validation = true;
-        }
-
-        const char* heartBeat = switch_channel_get_variable(channel, "STREAM_HEART_BEAT");
-        if (heartBeat) {
-            char *endptr;
-            long value = strtol(heartBeat, &endptr, 10);
-            if (*endptr == '\0' && value <= INT_MAX && value >= INT_MIN) {
-                heart_beat = (int) value;
-            }
-        }
-
-        if ((buffer_size = switch_channel_get_variable(channel, "STREAM_BUFFER_SIZE"))) {
-            int bSize = atoi(buffer_size);
-            if(bSize % 20 != 0) {
-                switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_WARNING, "%s: Buffer size of %s is not a multiple of 20ms. Using default 20ms.\n",
-                                  switch_channel_get_name(channel), buffer_size);
-            } else if(bSize >= 20){
-                rtp_packets = bSize/20;
-            }
+        // profile:<name> in the url, or the STREAM_PROFILE variable, or the default one
+        if (zstr(profile)) profile = switch_channel_get_variable(channel, "STREAM_PROFILE");
+        StreamProfile settings = config_profile(profile);
+        if (!settings) {
+            switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_ERROR, "stream profile %s is not defined\n", profile);
+            return SWITCH_STATUS_FALSE;
         }
-
-        extra_headers = switch_channel_get_variable(channel, "STREAM_EXTRA_HEADERS");
+        settings = config_apply_channel(settings, session);
+        if (!sampling) sampling = settings->sampling;
 
         // allocate per-session tech_pvt
         auto* tech_pvt = (private_t *) switch_core_session_alloc(session, sizeof(private_t));
@@ -1022,8 +1984,8 @@ extern "C" {
             switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_ERROR, "error allocating memory!\n");
             return SWITCH_STATUS_FALSE;
         }
-        if (SWITCH_STATUS_SUCCESS != stream_data_init(tech_pvt, session, wsUri, samples_per_second, sampling, channels, metadata, responseHandler, deflate, heart_beat,
-                                                        suppressLog, rtp_packets, extra_headers, no_reconnect, tls_cafile, tls_keyfile, tls_certfile, tls_disable_hostname_validation)) {
+        if (SWITCH_STATUS_SUCCESS != stream_data_init(tech_pvt, session, wsUri, samples_per_second, sampling, channels, metadata,
+                                                        responseHandler, settings)) {
             destroy_tech_pvt(tech_pvt);
             return SWITCH_STATUS_FALSE;
         }
@@ -1035,7 +1997,8 @@ extern "C" {
 
     switch_bool_t stream_frame(switch_media_bug_t *bug) {
         auto *tech_pvt = (private_t *)switch_core_media_bug_get_user_data(bug);
-        if (!tech_pvt || tech_pvt->audio_paused) return SWITCH_TRUE;
+        if (!tech_pvt || tech_pvt->audio_paused || !tech_pvt->pCounters) return SWITCH_TRUE;
+        auto *counters = static_cast<StreamCounters *>(tech_pvt->pCounters);
         /*
         auto flush_sbuffer = [&]() {
             switch_size_t inuse = switch_buffer_inuse(tech_pvt->sbuffer);
@@ -1055,8 +2018,9 @@ extern "C" {
             }
 
             auto *pAudioStreamer = static_cast<AudioStreamer *>(tech_pvt->pAudioStreamer);
+            auto *echo = static_cast<EchoCanceller *>(tech_pvt->pEcho);
 
-            if (!pAudioStreamer->isConnected()) {
+            if (!pAudioStreamer->isStreaming()) {
                 switch_mutex_unlock(tech_pvt->mutex);
                 return SWITCH_TRUE;
             }
@@ -1071,12 +2035,30 @@ extern "C" {
 
                 while (switch_core_media_bug_read(bug, &frame, SWITCH_TRUE) == SWITCH_STATUS_SUCCESS) {
                     if (frame.datalen) {
+                        counters->add(counters->uplinkFrames);
+                        if (echo) {
+                            const switch_time_t echoStart = switch_micro_time_now();
+                            echo->capture((int16_t *) frame.data, frame.datalen / (tech_pvt->channels * sizeof(int16_t)),
+                                          tech_pvt->channels, echoStart);
+                            counters->add(counters->echoUsec, switch_micro_time_now() - echoStart);
+                        }
+                        if (tech_pvt->pBargeIn) {
+                            detect_barge_in(tech_pvt, pAudioStreamer, (const int16_t *) frame.data,
+                                            frame.datalen / (tech_pvt->channels * sizeof(int16_t)));
+                        }
+                        if (frame_has_voice(frame)) tech_pvt->last_voice = switch_micro_time_now();
+                        if (tech_pvt->pRecorder) {
+                            recorder_feed(static_cast<CallRecorder *>(tech_pvt->pRecorder), RECORD_CALLER, (const int16_t *) frame.data,
+                                          frame.datalen / (tech_pvt->channels * sizeof(int16_t)), tech_pvt->channels, switch_micro_time_now());
+                        }
                         if (1 == tech_pvt->rtp_packets) {
                             pAudioStreamer->writeBinary((uint8_t *) frame.data, frame.datalen);
                             continue;
                         }
                         if (available >= frame.datalen) {
                             switch_buffer_write(tech_pvt->sbuffer, static_cast<uint8_t *>(frame.data), frame.datalen);
+                        } else {
+                            counters->add(counters->uplinkDrops);
                         }
                         if (0 == switch_buffer_freespace(tech_pvt->sbuffer)) {
                             switch_size_t inuse = switch_buffer_inuse(tech_pvt->sbuffer);
@@ -1100,6 +2082,9 @@ extern "C" {
 
                 while (switch_core_media_bug_read(bug, &frame, SWITCH_TRUE) == SWITCH_STATUS_SUCCESS) {
                     if(frame.datalen) {
+                        counters->add(counters->uplinkFrames);
+                        if (frame_has_voice(frame)) tech_pvt->last_voice = switch_micro_time_now();
+                        const switch_time_t resampleStart = switch_micro_time_now();
                         spx_uint32_t in_len = frame.samples;
                         spx_uint32_t out_len = (available / (tech_pvt->channels * sizeof(spx_int16_t)));
                         spx_int16_t out[available / sizeof(spx_int16_t)];
@@ -1118,15 +2103,30 @@ extern "C" {
                                             &out[0],
                                             &out_len);
                         }
+                        counters->add(counters->resampleUsec, switch_micro_time_now() - resampleStart);
 
                         if(out_len > 0) {
                             const size_t bytes_written = out_len * tech_pvt->channels * sizeof(spx_int16_t);
+                            if (echo) {
+                                // the played audio is at the stream rate, so the echo is removed after resampling
+                                const switch_time_t echoStart = switch_micro_time_now();
+                                echo->capture(out, out_len, tech_pvt->channels, echoStart);
+                                counters->add(counters->echoUsec, switch_micro_time_now() - echoStart);
+                            }
+                            if (tech_pvt->pBargeIn) detect_barge_in(tech_pvt, pAudioStreamer, out, out_len);
+                            if (tech_pvt->pRecorder) {
+                                // after resampling, so both sides of the recording are at the stream rate
+                                recorder_feed(static_cast<CallRecorder *>(tech_pvt->pRecorder), RECORD_CALLER, out, out_len,
+                                              tech_pvt->channels, switch_micro_time_now());
+                            }
                             if (tech_pvt->rtp_packets == 1) { //20ms packet
                                 pAudioStreamer->writeBinary((uint8_t *) out, bytes_written);
                                 continue;
                             }
                             if (bytes_written <= available) {
                                 switch_buffer_write(tech_pvt->sbuffer, (const uint8_t *)out, bytes_written);
+                            } else {
+                                counters->add(counters->uplinkDrops);
                             }
                         }
 
@@ -1144,6 +2144,8 @@ extern "C" {
             }
             
             switch_mutex_unlock(tech_pvt->mutex);
+        } else {
+            counters->add(counters->trylockMisses);
         }
 
         return SWITCH_TRUE;
@@ -1158,6 +2160,10 @@ extern "C" {
             char sessionId[MAX_SESSION_ID];
             strcpy(sessionId, tech_pvt->sessionId);
 
+            // before taking the mutex, a callback in flight may still need the session
+            auto* linked = (AudioStreamer *) tech_pvt->pAudioStreamer;
+            if (linked) linked->detachSession();
+
             switch_mutex_lock(tech_pvt->mutex);
             switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_DEBUG, "(%s) stream_session_cleanup\n", sessionId);
 
@@ -9,8 +9,24 @@ switch_status_t is_valid_utf8(const char *str);
 switch_status_t stream_session_send_text(switch_core_session_t *session, char* text);
 switch_status_t stream_session_pauseresume(switch_core_session_t *session, int pause);
 switch_status_t stream_session_init(switch_core_session_t *session, responseHandler_t responseHandler,
-    uint32_t samples_per_second, char *wsUri, int sampling, int channels, char* metadata, void **ppUserData);
+    uint32_t samples_per_second, char *wsUri, int sampling, int channels, char* metadata, const char* profile, void **ppUserData);
 switch_bool_t stream_frame(switch_media_bug_t *bug);
 switch_status_t stream_session_cleanup(switch_core_session_t *session, char* text, int channelIsClosing);
+switch_status_t stream_session_graceful_shutdown(switch_core_session_t *session, char* text);
+switch_bool_t stream_drain_check(switch_media_bug_t *bug);
+void stream_module_init(void);
+void stream_module_shutdown(void);
+char* stream_pool_status(void);
+char* stream_tls_status(void);
+char* stream_stats(void);
+char* stream_session_stats(switch_core_session_t *session);
+char* stream_latency(int reset);
+char* stream_metrics(void);
+// re-reads audio_stream.conf.xml, returns the number of profiles or -1 when it could not be read
+int stream_config_reload(void);
+switch_status_t stream_session_migrate(switch_core_session_t *session, const char* wsUri);
+// calls fn for every active stream on the endpoint (all when NULL), returns how many succeeded
+int stream_session_foreach(const char* endpoint, stream_session_fn fn, void* arg);
+char* stream_list(void);
 
 #endif //AUDIO_STREAMER_GLUE_H
@@ -244,6 +244,29 @@ std::string base64_decode(std::string const& s, bool remove_linebreaks) {
    return decode(s, remove_linebreaks);
 }
 
+size_t base64_decode(char const* s, size_t len, unsigned char* out) {
+ //
+ // Same chunks and padding rules as decode(), without the string
+ //
+    size_t n = 0;
+    for (size_t pos = 0; pos < len; pos += 4) {
+       if (pos + 1 >= len) throw std::runtime_error("Input is not valid base64-encoded data.");
+
+       unsigned int pos_of_char_1 = pos_of_char(s[pos+1]);
+       out[n++] = static_cast<unsigned char>((pos_of_char(s[pos+0]) << 2) + ((pos_of_char_1 & 0x30) >> 4));
+
+       if (pos + 2 < len && s[pos+2] != '=' && s[pos+2] != '.') {
+          unsigned int pos_of_char_2 = pos_of_char(s[pos+2]);
+          out[n++] = static_cast<unsigned char>(((pos_of_char_1 & 0x0f) << 4) + ((pos_of_char_2 & 0x3c) >> 2));
+
+          if (pos + 3 < len && s[pos+3] != '=' && s[pos+3] != '.') {
+             out[n++] = static_cast<unsigned char>(((pos_of_char_2 & 0x03) << 6) + pos_of_char(s[pos+3]));
+          }
+       }
+    }
+    return n;
+}
+
 std::string base64_encode(std::string const& s, bool url) {
    return encode(s, url);
 }
@@ -19,6 +19,12 @@ std::string base64_encode_mime(std::string const& s);
 std::string base64_decode(std::string const& s, bool remove_linebreaks = false);
 std::string base64_encode(unsigned char const*, size_t len, bool url = false);
 
+//
+// Added for mod_audio_stream: decodes into a caller supplied buffer of at least
+// len / 4 * 3 + 3 bytes instead of a new string. Returns the decoded size.
+//
+size_t base64_decode(char const* s, size_t len, unsigned char* out);
+
 #if __cplusplus >= 201703L
 //
 // Interface with std::string_view rather than const std::string&
@@ -1,28 +1,29 @@
-// 独立的 PCM 到 G.711 A-law WAV 转换工具
+// 独立的 PCM WAV 批量转换工具：G.711 A-law / μ-law 或 16-bit PCM
+//
+// 输入文件以 mmap 只读映射，按文件分发给线程池并行解码、重采样、编码，
+// 每个输出文件（头部 + 数据）在内存中拼好后一次写出。
 #include <iostream>
-#include <fstream>
 #include <vector>
+#include <string>
+#include <thread>
+#include <atomic>
+#include <algorithm>
+#include <mutex>
+#include <chrono>
 #include <cstdint>
 #include <cstring>
+#include <cstdlib>
 #include <cmath>
+#include <cerrno>
+#include <strings.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <getopt.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <speex/speex_resampler.h>
-
-// 小端序写入辅助函数
-inline void write_le16(std::ofstream& file, uint16_t value) {
-    uint8_t bytes[2];
-    bytes[0] = value & 0xFF;
-    bytes[1] = (value >> 8) & 0xFF;
-    file.write((char*)bytes, 2);
-}
-
-inline void write_le32(std::ofstream& file, uint32_t value) {
-    uint8_t bytes[4];
-    bytes[0] = value & 0xFF;
-    bytes[1] = (value >> 8) & 0xFF;
-    bytes[2] = (value >> 16) & 0xFF;
-    bytes[3] = (value >> 24) & 0xFF;
-    file.write((char*)bytes, 4);
-}
+#include "stream_wav.h"
 
 // G.711 A-law 编码 - 标准 ITU-T G.711 实现
 static const int16_t seg_aend[8] = {0x1F, 0x3F, 0x7F, 0xFF, 0x1FF, 0x3FF, 0x7FF, 0xFFF};
@@ -57,7 +58,7 @@ uint8_t linear_to_alaw(int16_t pcm_val) {
     if (pcm_val > 0x7FFF) {
         pcm_val = 0x7FFF;
     }
-    
+
     pcm_val = pcm_val >> 3;
 
     // 查找段号
@@ -77,244 +78,517 @@ uint8_t linear_to_alaw(int16_t pcm_val) {
     }
 }
 
-// 读取 WAV 文件头
-struct WavHeader {
-    char riff[4];
-    uint32_t fileSize;
-    char wave[4];
-    char fmt[4];
-    uint32_t fmtSize;
+// G.711 μ-law 编码 - 14-bit 输入，段号查找与 A-law 相同
+static const int16_t seg_uend[8] = {0x3F, 0x7F, 0xFF, 0x1FF, 0x3FF, 0x7FF, 0xFFF, 0x1FFF};
+
+// 将 16-bit 线性 PCM 转换为 8-bit μ-law
+uint8_t linear_to_ulaw(int16_t pcm_val) {
+    int val = pcm_val >> 2;
+    int16_t mask;
+
+    // 获取符号位
+    if (val < 0) {
+        val = -val;
+        mask = 0x7F;
+    } else {
+        mask = 0xFF;
+    }
+    if (val > 8159) {   // 限幅
+        val = 8159;
+    }
+    val += 0x84 >> 2;   // 偏置
+
+    int16_t seg = search((int16_t) val, seg_uend, 8);
+    if (seg >= 8) {
+        return (uint8_t)(0x7F ^ mask);
+    }
+    return (uint8_t) (((seg << 4) | ((val >> (seg + 1)) & 0x0F)) ^ mask);
+}
+
+// 所有 16-bit 输入的编码结果，启动时计算一次，之后每个样本查表
+static uint8_t alaw_table[65536];
+static uint8_t ulaw_table[65536];
+
+struct Target {
+    const char* name;
+    WavFormat format;
+    int bitsPerSample;
+    const uint8_t* table;   // 8-bit 编码查找表，PCM16 为 nullptr
+};
+
+static const Target targets[] = {
+    {"alaw",  WAV_ALAW,  8,  alaw_table},
+    {"ulaw",  WAV_MULAW, 8,  ulaw_table},
+    {"pcm16", WAV_PCM,   16, nullptr},
+};
+
+static uint16_t get_le16(const uint8_t* p) {
+    return (uint16_t) (p[0] | (p[1] << 8));
+}
+
+static uint32_t get_le32(const uint8_t* p) {
+    return (uint32_t) p[0] | ((uint32_t) p[1] << 8) | ((uint32_t) p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+// 输入 WAV 的格式与 data 块（指向映射内存）
+struct WavInput {
     uint16_t audioFormat;
     uint16_t numChannels;
     uint32_t sampleRate;
-    uint32_t byteRate;
-    uint16_t blockAlign;
     uint16_t bitsPerSample;
+    const uint8_t* data;
+    size_t dataSize;
 };
 
-int main(int argc, char* argv[]) {
-    if (argc != 3) {
-        std::cerr << "用法: " << argv[0] << " <输入PCM WAV文件> <输出A-law WAV文件>" << std::endl;
-        std::cerr << "示例: " << argv[0] << " input.wav output_alaw.wav" << std::endl;
-        return 1;
+// 解析 RIFF 块，返回错误信息，成功返回 nullptr
+static const char* parse_wav(const uint8_t* p, size_t size, WavInput& in) {
+    if (size < 12 || memcmp(p, "RIFF", 4) != 0 || memcmp(p + 8, "WAVE", 4) != 0) {
+        return "不是有效的 WAV 文件";
     }
+    bool haveFmt = false;
+    size_t pos = 12;
+    while (pos + 8 <= size) {
+        const uint8_t* chunk = p + pos;
+        uint32_t chunkSize = get_le32(chunk + 4);
+        pos += 8;
+        if (memcmp(chunk, "fmt ", 4) == 0) {
+            if (chunkSize < 16 || pos + 16 > size) return "fmt 块不完整";
+            in.audioFormat = get_le16(p + pos);
+            in.numChannels = get_le16(p + pos + 2);
+            in.sampleRate = get_le32(p + pos + 4);
+            in.bitsPerSample = get_le16(p + pos + 14);
+            // WAVE_FORMAT_EXTENSIBLE：实际格式在子格式 GUID 的前两个字节
+            if (in.audioFormat == 0xFFFE && chunkSize >= 40 && pos + 26 <= size) {
+                in.audioFormat = get_le16(p + pos + 24);
+            }
+            haveFmt = true;
+        } else if (memcmp(chunk, "data", 4) == 0) {
+            if (!haveFmt) return "data 块前没有 fmt 块";
+            in.data = chunk + 8;
+            // 边录边写的文件大小可能未回填（0xFFFFFFFF），以文件实际长度为准
+            in.dataSize = std::min((size_t) chunkSize, size - pos);
+            return nullptr;
+        }
+        pos += chunkSize + (chunkSize & 1);
+    }
+    return "找不到 data 块";
+}
 
-    const char* inputFile = argv[1];
-    const char* outputFile = argv[2];
-
-    // 打开输入文件
-    std::ifstream inFile(inputFile, std::ios::binary);
-    if (!inFile) {
-        std::cerr << "错误: 无法打开输入文件 " << inputFile << std::endl;
-        return 1;
+// 整个映射的输入文件，析构时解除映射
+class MappedFile {
+public:
+    explicit MappedFile(const std::string& path) {
+        int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) return;
+        struct stat st;
+        if (fstat(fd, &st) == 0 && st.st_size > 0) {
+            void* addr = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (addr != MAP_FAILED) {
+                madvise(addr, st.st_size, MADV_SEQUENTIAL);
+                m_data = static_cast<const uint8_t*>(addr);
+                m_size = st.st_size;
+            }
+        }
+        close(fd);
     }
+    ~MappedFile() {
+        if (m_data) munmap(const_cast<uint8_t*>(m_data), m_size);
+    }
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
 
-    // 读取 WAV 头
-    WavHeader header;
-    inFile.read(reinterpret_cast<char*>(&header), sizeof(WavHeader));
+    const uint8_t* data() const { return m_data; }
+    size_t size() const { return m_size; }
 
-    // 验证文件格式
-    if (std::strncmp(header.riff, "RIFF", 4) != 0 || 
-        std::strncmp(header.wave, "WAVE", 4) != 0) {
-        std::cerr << "错误: 不是有效的 WAV 文件" << std::endl;
-        return 1;
-    }
+private:
+    const uint8_t* m_data = nullptr;
+    size_t m_size = 0;
+};
 
-    if (header.audioFormat != 1) {
-        std::cerr << "错误: 输入文件必须是 PCM 格式 (format=1)" << std::endl;
-        return 1;
-    }
+struct Job {
+    std::string input;
+    std::string output;
+};
 
-    if (header.bitsPerSample != 16 && header.bitsPerSample != 32) {
-        std::cerr << "错误: 输入文件必须是 16-bit 或 32-bit PCM" << std::endl;
-        return 1;
+struct Totals {
+    std::atomic<uint64_t> converted{0};
+    std::atomic<uint64_t> failed{0};
+    std::atomic<uint64_t> inputBytes{0};
+    std::atomic<uint64_t> outputBytes{0};
+    std::atomic<uint64_t> audioMs{0};
+};
+
+static std::mutex g_print;
+
+// 每个工作线程一个，缓冲区和重采样器在文件之间复用
+class Converter {
+public:
+    Converter(const Target& target, uint32_t outputRate, int quality, bool verbose)
+        : m_target(target), m_outputRate(outputRate), m_quality(quality), m_verbose(verbose) {}
+
+    ~Converter() {
+        if (m_resampler) speex_resampler_destroy(m_resampler);
     }
 
-    std::cout << "输入文件信息:" << std::endl;
-    std::cout << "  采样率: " << header.sampleRate << " Hz" << std::endl;
-    std::cout << "  声道数: " << header.numChannels << std::endl;
-    std::cout << "  位深度: " << header.bitsPerSample << " bit" << std::endl;
-
-    // 查找 data chunk
-    char chunkId[4];
-    uint32_t chunkSize;
-    while (inFile.read(chunkId, 4)) {
-        inFile.read(reinterpret_cast<char*>(&chunkSize), 4);
-        if (std::strncmp(chunkId, "data", 4) == 0) {
-            break;
+    bool convert(const Job& job, Totals& totals) {
+        // 输出覆盖输入会截断正在映射的文件
+        struct stat inStat, outStat;
+        if (stat(job.input.c_str(), &inStat) == 0 && stat(job.output.c_str(), &outStat) == 0 &&
+            inStat.st_dev == outStat.st_dev && inStat.st_ino == outStat.st_ino) {
+            return fail(job, "输出与输入是同一个文件");
+        }
+        MappedFile file(job.input);
+        if (!file.data()) return fail(job, "无法打开输入文件");
+
+        WavInput in;
+        const char* error = parse_wav(file.data(), file.size(), in);
+        if (error) return fail(job, error);
+        if (in.numChannels == 0 || in.sampleRate == 0) return fail(job, "声道数或采样率为 0");
+
+        // 读取 PCM 数据并转换为 16-bit
+        if (in.audioFormat == 1 && in.bitsPerSample == 16) {
+            m_pcm.resize(in.dataSize / 2);
+            memcpy(m_pcm.data(), in.data, m_pcm.size() * 2);
+        } else if ((in.audioFormat == 1 || in.audioFormat == 3) && in.bitsPerSample == 32) {
+            decode32(in);
+        } else {
+            return fail(job, "输入文件必须是 16-bit 或 32-bit PCM");
         }
-        inFile.seekg(chunkSize, std::ios::cur);
-    }
 
-    // 读取 PCM 数据并转换为 16-bit
-    std::vector<int16_t> pcmData;
-    
-    if (header.bitsPerSample == 32) {
-        // 32-bit 数据：支持 Float32 和 Int32
-        std::vector<uint8_t> rawData(chunkSize);
-        inFile.read(reinterpret_cast<char*>(rawData.data()), chunkSize);
-        inFile.close();
-        
-        size_t numSamples = chunkSize / sizeof(float);
-        std::cout << "读取了 " << numSamples << " 个 32-bit 样本" << std::endl;
-        
-        // 检测是 Float32 还是 Int32
-        const float* floatData = reinterpret_cast<const float*>(rawData.data());
-        const int32_t* int32Data = reinterpret_cast<const int32_t*>(rawData.data());
-        
-        bool isFloat32 = false;
-        if (numSamples > 0) {
-            float firstSample = floatData[0];
-            // Float32 PCM 范围通常在 [-1.0, 1.0]
-            if (firstSample >= -1.5f && firstSample <= 1.5f && std::abs(firstSample) < 32768.0f) {
-                isFloat32 = true;
+        // 重采样到目标采样率（如果需要）
+        const std::vector<int16_t>* samples = &m_pcm;
+        if (in.sampleRate != m_outputRate) {
+            if (!resample(in)) return fail(job, "无法初始化重采样器");
+            samples = &m_resampled;
+        }
+
+        // 头部和编码后的数据放在同一个缓冲区，一次写出
+        const size_t bytesPerSample = m_target.bitsPerSample / 8;
+        const uint64_t dataSize = (uint64_t) samples->size() * bytesPerSample;
+        if (dataSize > 0xFFFFFFFFu - WAV_HEADER_MAX) return fail(job, "输出超过 4 GB");
+        m_out.resize(WAV_HEADER_MAX + dataSize);
+        const uint32_t headerSize = wav_header(m_out.data(), m_target.format, m_outputRate, in.numChannels,
+                                               m_target.bitsPerSample, (uint32_t) dataSize);
+        uint8_t* out = m_out.data() + headerSize;
+        if (m_target.table) {
+            for (size_t i = 0; i < samples->size(); i++) {
+                out[i] = m_target.table[(uint16_t) (*samples)[i]];
             }
+        } else {
+            memcpy(out, samples->data(), dataSize);
+        }
+        const size_t total = headerSize + dataSize;
+        if (!write_file(job.output, m_out.data(), total)) return fail(job, strerror(errno));
+
+        const uint64_t frames = samples->size() / in.numChannels;
+        totals.converted++;
+        totals.inputBytes += file.size();
+        totals.outputBytes += total;
+        totals.audioMs += frames * 1000 / m_outputRate;
+        if (m_verbose) {
+            std::lock_guard<std::mutex> guard(g_print);
+            std::cout << job.input << " -> " << job.output << " (" << in.sampleRate << " Hz, " << in.numChannels
+                      << " 声道, " << (double) frames / m_outputRate << " 秒)" << std::endl;
+        }
+        return true;
+    }
+
+private:
+    // 32-bit 数据：支持 Float32 和 Int32
+    void decode32(const WavInput& in) {
+        const size_t numSamples = in.dataSize / 4;
+        m_pcm.resize(numSamples);
+
+        bool isFloat32 = in.audioFormat == 3;
+        if (!isFloat32 && numSamples > 0) {
+            // 有些 TTS 把 Float32 标成 PCM：首样本在 [-1.5, 1.5] 内按 Float32 处理
+            float firstSample;
+            memcpy(&firstSample, in.data, 4);
+            isFloat32 = firstSample >= -1.5f && firstSample <= 1.5f;
         }
-        
-        pcmData.resize(numSamples);
-        
-        if (isFloat32) {
-            std::cout << "检测到 Float32 格式，转换到 16-bit..." << std::endl;
-            for (size_t i = 0; i < numSamples; i++) {
-                float sample = floatData[i];
+
+        for (size_t i = 0; i < numSamples; i++) {
+            if (isFloat32) {
+                float sample;
+                memcpy(&sample, in.data + i * 4, 4);
                 // 限幅到 [-1.0, 1.0]
                 if (sample > 1.0f) sample = 1.0f;
                 if (sample < -1.0f) sample = -1.0f;
-                // 转换为 16-bit
-                pcmData[i] = static_cast<int16_t>(sample * 32767.0f);
-            }
-        } else {
-            std::cout << "检测到 Int32 格式，转换到 16-bit..." << std::endl;
-            for (size_t i = 0; i < numSamples; i++) {
+                m_pcm[i] = static_cast<int16_t>(sample * 32767.0f);
+            } else {
                 // Int32 转 16-bit：右移 16 位
-                pcmData[i] = static_cast<int16_t>(int32Data[i] >> 16);
+                m_pcm[i] = static_cast<int16_t>((int32_t) get_le32(in.data + i * 4) >> 16);
             }
         }
-        
-        std::cout << "转换完成: " << pcmData.size() << " 个 16-bit 样本" << std::endl;
-    } else {
-        // 16-bit PCM: 直接读取
-        pcmData.resize(chunkSize / sizeof(int16_t));
-        inFile.read(reinterpret_cast<char*>(pcmData.data()), chunkSize);
-        inFile.close();
-        
-        std::cout << "读取了 " << pcmData.size() << " 个 16-bit 样本" << std::endl;
     }
 
-    // 重采样到 8000 Hz（如果需要）
-    std::vector<int16_t> resampledData;
-    uint32_t outputSampleRate = 8000;
-    
-    if (header.sampleRate != outputSampleRate) {
-        std::cout << "重采样: " << header.sampleRate << " Hz -> " << outputSampleRate << " Hz" << std::endl;
-        
-        int err;
-        SpeexResamplerState* resampler = speex_resampler_init(
-            header.numChannels,
-            header.sampleRate,
-            outputSampleRate,
-            10,  // 质量等级 (0-10, 10最高)
-            &err
-        );
-        
-        if (err != 0 || !resampler) {
-            std::cerr << "错误: 无法初始化重采样器, 错误码: " << err << std::endl;
-            return 1;
+    bool resample(const WavInput& in) {
+        // 同样声道数和采样率的下一个文件直接复用重采样器
+        if (m_resampler && (m_resamplerChannels != in.numChannels || m_resamplerRate != in.sampleRate)) {
+            speex_resampler_destroy(m_resampler);
+            m_resampler = nullptr;
         }
-        
+        if (m_resampler) {
+            speex_resampler_reset_mem(m_resampler);
+        } else {
+            int err;
+            m_resampler = speex_resampler_init(in.numChannels, in.sampleRate, m_outputRate, m_quality, &err);
+            if (err != 0 || !m_resampler) {
+                m_resampler = nullptr;
+                return false;
+            }
+            m_resamplerChannels = in.numChannels;
+            m_resamplerRate = in.sampleRate;
+        }
+
         // 计算输出样本数（防止溢出：使用 uint64_t 进行中间计算）
-        uint32_t inputSamples = pcmData.size() / header.numChannels;
-        uint32_t outputSamples = (uint32_t)(((uint64_t)inputSamples * outputSampleRate + header.sampleRate - 1) / header.sampleRate);
-        
-        resampledData.resize(outputSamples * header.numChannels);
-        
-        if (header.numChannels == 1) {
-            // 单声道
-            spx_uint32_t in_len = inputSamples;
-            spx_uint32_t out_len = outputSamples;
-            
-            speex_resampler_process_int(
-                resampler,
-                0,
-                pcmData.data(),
-                &in_len,
-                resampledData.data(),
-                &out_len
-            );
-            
-            resampledData.resize(out_len);
-            std::cout << "重采样完成: " << in_len << " -> " << out_len << " 样本" << std::endl;
+        spx_uint32_t in_len = m_pcm.size() / in.numChannels;
+        spx_uint32_t out_len = (spx_uint32_t) (((uint64_t) in_len * m_outputRate + in.sampleRate - 1) / in.sampleRate);
+        m_resampled.resize((size_t) out_len * in.numChannels);
+        if (in.numChannels == 1) {
+            speex_resampler_process_int(m_resampler, 0, m_pcm.data(), &in_len, m_resampled.data(), &out_len);
         } else {
-            // 多声道交错
-            spx_uint32_t in_len = inputSamples;
-            spx_uint32_t out_len = outputSamples;
-            
-            speex_resampler_process_interleaved_int(
-                resampler,
-                pcmData.data(),
-                &in_len,
-                resampledData.data(),
-                &out_len
-            );
-            
-            resampledData.resize(out_len * header.numChannels);
-            std::cout << "重采样完成: " << in_len << " -> " << out_len << " 样本/声道" << std::endl;
+            speex_resampler_process_interleaved_int(m_resampler, m_pcm.data(), &in_len, m_resampled.data(), &out_len);
+        }
+        m_resampled.resize((size_t) out_len * in.numChannels);
+        return true;
+    }
+
+    static bool write_file(const std::string& path, const uint8_t* data, size_t len) {
+        int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd < 0) return false;
+        while (len > 0) {
+            ssize_t n = write(fd, data, len);
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                int saved = errno;
+                close(fd);
+                errno = saved;
+                return false;
+            }
+            data += n;
+            len -= n;
+        }
+        return close(fd) == 0;
+    }
+
+    bool fail(const Job& job, const char* error) {
+        std::lock_guard<std::mutex> guard(g_print);
+        std::cerr << "错误: " << job.input << ": " << error << std::endl;
+        return false;
+    }
+
+    const Target& m_target;
+    const uint32_t m_outputRate;
+    const int m_quality;
+    const bool m_verbose;
+    std::vector<int16_t> m_pcm;
+    std::vector<int16_t> m_resampled;
+    std::vector<uint8_t> m_out;
+    SpeexResamplerState* m_resampler = nullptr;
+    uint16_t m_resamplerChannels = 0;
+    uint32_t m_resamplerRate = 0;
+};
+
+static bool is_directory(const std::string& path) {
+    struct stat st;
+    return stat(path.c_str(), &st) == 0 && S_ISDIR(st.st_mode);
+}
+
+static bool has_wav_suffix(const std::string& name) {
+    return name.size() > 4 && strcasecmp(name.c_str() + name.size() - 4, ".wav") == 0;
+}
+
+// mkdir -p
+static bool make_dirs(const std::string& path) {
+    for (size_t pos = path.find('/', 1); ; pos = path.find('/', pos + 1)) {
+        const std::string dir = path.substr(0, pos);
+        if (mkdir(dir.c_str(), 0755) != 0 && errno != EEXIST) return false;
+        if (pos == std::string::npos) return true;
+    }
+}
+
+// 目录下（含子目录）所有 .wav 文件，输出保持相对路径
+static void scan_directory(const std::string& root, const std::string& relative, const std::string& outputDir,
+                           std::vector<Job>& jobs) {
+    const std::string path = relative.empty() ? root : root + "/" + relative;
+    DIR* dir = opendir(path.c_str());
+    if (!dir) {
+        std::cerr << "错误: 无法打开目录 " << path << std::endl;
+        return;
+    }
+    std::vector<std::string> names;
+    while (struct dirent* entry = readdir(dir)) {
+        if (entry->d_name[0] != '.') names.push_back(entry->d_name);
+    }
+    closedir(dir);
+
+    for (const auto& name : names) {
+        const std::string child = relative.empty() ? name : relative + "/" + name;
+        if (is_directory(root + "/" + child)) {
+            scan_directory(root, child, outputDir, jobs);
+        } else if (has_wav_suffix(name)) {
+            jobs.push_back({root + "/" + child, outputDir + "/" + child});
         }
-        
-        speex_resampler_destroy(resampler);
+    }
+}
+
+static void add_input(const std::string& input, const std::string& outputDir, std::vector<Job>& jobs) {
+    if (is_directory(input)) {
+        std::string root = input;
+        while (root.size() > 1 && root.back() == '/') root.pop_back();
+        scan_directory(root, "", outputDir, jobs);
     } else {
-        std::cout << "采样率已经是 8000 Hz，无需重采样" << std::endl;
-        resampledData = pcmData;
+        const size_t slash = input.rfind('/');
+        jobs.push_back({input, outputDir + "/" + (slash == std::string::npos ? input : input.substr(slash + 1))});
     }
+}
 
-    // 转换为 A-law
-    std::vector<uint8_t> alawData(resampledData.size());
-    for (size_t i = 0; i < resampledData.size(); i++) {
-        alawData[i] = linear_to_alaw(resampledData[i]);
+// @list：每行一个文件或目录，忽略空行和 # 开头的行
+static bool add_list(const std::string& listFile, const std::string& outputDir, std::vector<Job>& jobs) {
+    MappedFile file(listFile);
+    if (!file.data()) return access(listFile.c_str(), R_OK) == 0;  // 空列表
+    const char* p = reinterpret_cast<const char*>(file.data());
+    const char* end = p + file.size();
+    while (p < end) {
+        const char* eol = static_cast<const char*>(memchr(p, '\n', end - p));
+        if (!eol) eol = end;
+        std::string line(p, eol);
+        while (!line.empty() && (line.back() == '\r' || line.back() == ' ' || line.back() == '\t')) line.pop_back();
+        if (!line.empty() && line[0] != '#') add_input(line, outputDir, jobs);
+        p = eol + 1;
+    }
+    return true;
+}
+
+static void usage(const char* prog) {
+    std::cerr << "用法: " << prog << " [选项] -o <输出目录> <WAV文件|目录|@列表文件>..." << std::endl;
+    std::cerr << "      " << prog << " <输入PCM WAV文件> <输出WAV文件>" << std::endl;
+    std::cerr << "选项:" << std::endl;
+    std::cerr << "  -f alaw|ulaw|pcm16  输出格式 (默认 alaw)" << std::endl;
+    std::cerr << "  -r <Hz>             输出采样率 (默认 8000)" << std::endl;
+    std::cerr << "  -q <0-10>           重采样质量 (默认 10)" << std::endl;
+    std::cerr << "  -j <N>              线程数 (默认 CPU 核数)" << std::endl;
+    std::cerr << "  -o <目录>           输出目录，目录输入保持其中的相对路径" << std::endl;
+    std::cerr << "  -v                  逐个文件输出" << std::endl;
+    std::cerr << "示例: " << prog << " -f ulaw -j 8 -o /var/prompts/ulaw /var/prompts/src" << std::endl;
+}
+
+int main(int argc, char* argv[]) {
+    const Target* target = &targets[0];
+    uint32_t outputRate = 8000;
+    int quality = 10;
+    unsigned threads = std::thread::hardware_concurrency();
+    std::string outputDir;
+    bool verbose = false;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "f:r:q:j:o:vh")) != -1) {
+        switch (opt) {
+            case 'f':
+                target = nullptr;
+                for (const auto& candidate : targets) {
+                    if (strcmp(candidate.name, optarg) == 0) target = &candidate;
+                }
+                if (!target) {
+                    std::cerr << "错误: 未知的输出格式 " << optarg << std::endl;
+                    return 1;
+                }
+                break;
+            case 'r':
+                outputRate = (uint32_t) atoi(optarg);
+                break;
+            case 'q':
+                quality = atoi(optarg);
+                break;
+            case 'j':
+                threads = (unsigned) atoi(optarg);
+                break;
+            case 'o':
+                outputDir = optarg;
+                break;
+            case 'v':
+                verbose = true;
+                break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+    if (outputRate == 0 || quality < 0 || quality > 10) {
+        usage(argv[0]);
+        return 1;
     }
+    if (threads == 0) threads = 1;
 
-    // 写入 A-law WAV 文件
-    std::ofstream outFile(outputFile, std::ios::binary);
-    if (!outFile) {
-        std::cerr << "错误: 无法创建输出文件 " << outputFile << std::endl;
+    std::vector<Job> jobs;
+    const int positional = argc - optind;
+    if (outputDir.empty() && positional == 2 && !is_directory(argv[optind]) && !is_directory(argv[optind + 1])) {
+        // 原有的单文件用法：输入 输出
+        jobs.push_back({argv[optind], argv[optind + 1]});
+        verbose = true;
+    } else {
+        if (outputDir.empty() || positional < 1) {
+            usage(argv[0]);
+            return 1;
+        }
+        while (outputDir.size() > 1 && outputDir.back() == '/') outputDir.pop_back();
+        for (int i = optind; i < argc; i++) {
+            if (argv[i][0] == '@') {
+                if (!add_list(argv[i] + 1, outputDir, jobs)) {
+                    std::cerr << "错误: 无法读取列表文件 " << argv[i] + 1 << std::endl;
+                    return 1;
+                }
+            } else {
+                add_input(argv[i], outputDir, jobs);
+            }
+        }
+        // 输出目录（含子目录）在开始转换前建好
+        std::string lastDir;
+        for (const auto& job : jobs) {
+            const std::string dir = job.output.substr(0, job.output.rfind('/'));
+            if (dir == lastDir || dir.empty()) continue;
+            if (!make_dirs(dir)) {
+                std::cerr << "错误: 无法创建输出目录 " << dir << ": " << strerror(errno) << std::endl;
+                return 1;
+            }
+            lastDir = dir;
+        }
+    }
+    if (jobs.empty()) {
+        std::cerr << "没有找到 WAV 文件" << std::endl;
         return 1;
     }
 
-    uint32_t dataSize = alawData.size();
-    uint32_t fileSize = 38 + dataSize;  // 使用 fmt size=18 时，总大小为 38+dataSize
-    uint16_t bitsPerSample = 8;
-    uint32_t byteRate = outputSampleRate * header.numChannels * bitsPerSample / 8;
-    uint16_t blockAlign = header.numChannels * bitsPerSample / 8;
-
-    // RIFF header (小端序)
-    outFile.write("RIFF", 4);
-    write_le32(outFile, fileSize);
-    outFile.write("WAVE", 4);
-
-    // fmt chunk (小端序) - 使用标准建议的 size=18
-    outFile.write("fmt ", 4);
-    write_le32(outFile, 18);  // fmtSize: 标准建议为 18
-    write_le16(outFile, 6);   // audioFormat: G.711 A-law
-    write_le16(outFile, header.numChannels);
-    write_le32(outFile, outputSampleRate);
-    write_le32(outFile, byteRate);
-    write_le16(outFile, blockAlign);
-    write_le16(outFile, bitsPerSample);
-    write_le16(outFile, 0);   // cbSize: 扩展字段大小为 0
-
-    // data chunk (小端序)
-    outFile.write("data", 4);
-    write_le32(outFile, dataSize);
-    outFile.write(reinterpret_cast<char*>(alawData.data()), dataSize);
-
-    outFile.close();
-
-    std::cout << "成功创建 G.711 A-law WAV 文件: " << outputFile << std::endl;
-    std::cout << "  格式: G.711 A-law" << std::endl;
-    std::cout << "  采样率: " << outputSampleRate << " Hz" << std::endl;
-    std::cout << "  声道数: " << header.numChannels << std::endl;
-    std::cout << "  位深度: 8 bit" << std::endl;
-    std::cout << "  文件大小: " << (fileSize + 8) << " 字节" << std::endl;
-
-    return 0;
+    for (int i = 0; i < 65536; i++) {
+        alaw_table[i] = linear_to_alaw((int16_t) i);
+        ulaw_table[i] = linear_to_ulaw((int16_t) i);
+    }
+
+    // 工作线程按顺序领取下一个文件
+    Totals totals;
+    std::atomic<size_t> next{0};
+    if (threads > jobs.size()) threads = jobs.size();
+    const auto start = std::chrono::steady_clock::now();
+    std::vector<std::thread> workers;
+    for (unsigned i = 0; i < threads; i++) {
+        workers.emplace_back([&]() {
+            Converter converter(*target, outputRate, quality, verbose);
+            for (size_t n = next++; n < jobs.size(); n = next++) {
+                if (!converter.convert(jobs[n], totals)) totals.failed++;
+            }
+        });
+    }
+    for (auto& worker : workers) worker.join();
+    const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    const double inputMB = totals.inputBytes / 1048576.0;
+    std::cout << "转换完成: " << totals.converted << " 个文件 (" << target->name << ", " << outputRate << " Hz), 失败 "
+              << totals.failed << ", " << threads << " 线程" << std::endl;
+    std::cout << "  音频: " << totals.audioMs / 1000.0 << " 秒, 输入 " << inputMB << " MB, 输出 "
+              << totals.outputBytes / 1048576.0 << " MB" << std::endl;
+    std::cout << "  用时: " << seconds << " 秒, " << inputMB / seconds << " MB/s, "
+              << totals.converted / seconds << " 文件/秒, " << totals.audioMs / 1000.0 / seconds << " 倍实时" << std::endl;
+
+    return totals.failed ? 1 : 0;
 }
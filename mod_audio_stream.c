@@ -44,6 +44,10 @@ static switch_bool_t capture_callback(switch_media_bug_t *bug, void *user_data,
             if (tech_pvt->close_requested) {
                 return SWITCH_FALSE;
             }
+            if (tech_pvt->draining) {
+                /* graceful-shutdown: uplink stopped, close once drained */
+                return stream_drain_check(bug);
+            }
             /* 上行：采集线路音频并推送到 WebSocket */
             stream_frame(bug);
             return SWITCH_TRUE;
@@ -75,7 +79,8 @@ static switch_status_t start_capture(switch_core_session_t *session,
                                      switch_media_bug_flag_t flags,
                                      char* wsUri,
                                      int sampling,
-                                     char* metadata)
+                                     char* metadata,
+                                     const char* profile)
 {
     switch_channel_t *channel = switch_core_session_get_channel(session);
     switch_media_bug_t *bug;
@@ -99,7 +104,7 @@ static switch_status_t start_capture(switch_core_session_t *session,
 
     switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_DEBUG, "calling stream_session_init.\n");
     if (SWITCH_STATUS_FALSE == stream_session_init(session, responseHandler, read_codec->implementation->actual_samples_per_second,
-                                                 wsUri, sampling, channels, metadata, &pUserData)) {
+                                                 wsUri, sampling, channels, metadata, profile, &pUserData)) {
         switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_ERROR, "Error initializing mod_audio_stream session.\n");
         return SWITCH_STATUS_FALSE;
     }
@@ -141,6 +146,21 @@ static switch_status_t do_stop(switch_core_session_t *session, char* text)
     return status;
 }
 
+static switch_status_t do_graceful_shutdown(switch_core_session_t *session, char* text)
+{
+    switch_status_t status = SWITCH_STATUS_SUCCESS;
+
+    if (text) {
+        switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_INFO, "mod_audio_stream: graceful-shutdown w/ final text %s\n", text);
+    }
+    else {
+        switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_INFO, "mod_audio_stream: graceful-shutdown\n");
+    }
+    status = stream_session_graceful_shutdown(session, text);
+
+    return status;
+}
+
 static switch_status_t do_pauseresume(switch_core_session_t *session, int pause)
 {
     switch_status_t status = SWITCH_STATUS_SUCCESS;
@@ -166,7 +186,7 @@ static switch_status_t send_text(switch_core_session_t *session, char* text) {
     return status;
 }
 
-#define STREAM_API_SYNTAX "<uuid> [start | stop | send_text | pause | resume | graceful-shutdown ] [wss-url | path] [mono | mixed | stereo] [8000 | 16000] [metadata]"
+#define STREAM_API_SYNTAX "list | <uuid> [start | stop | send_text | pause | resume | graceful-shutdown | stats ] [wss-url | path] [mono | mixed | stereo] [8000 | 16000] [metadata]"
 SWITCH_STANDARD_API(stream_function)
 {
     char *mycmd = NULL, *argv[6] = { 0 };
@@ -180,6 +200,17 @@ SWITCH_STANDARD_API(stream_function)
     assert(cmd);
     switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_DEBUG, "mod_audio_stream cmd: %s\n", cmd ? cmd : "");
 
+    if (argc == 1 && !strcasecmp(argv[0], "list")) {
+        char *json = stream_list();
+        if (json) {
+            stream->write_function(stream, "%s\n", json);
+            free(json);
+        } else {
+            stream->write_function(stream, "-ERR Operation Failed\n");
+        }
+        goto done;
+    }
+
     if (zstr(cmd) || argc < 2 || (0 == strcmp(argv[1], "start") && argc < 4)) {
         switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_ERROR, "Error with command %s %s %s.\n", cmd, argv[0], argv[1]);
         stream->write_function(stream, "-USAGE: %s\n", STREAM_API_SYNTAX);
@@ -195,6 +226,24 @@ SWITCH_STANDARD_API(stream_function)
                     goto done;
                 }
                 status = do_stop(lsession, argc > 2 ? argv[2] : NULL);
+            } else if (!strcasecmp(argv[1], "graceful-shutdown")) {
+                if(argc > 2 && (is_valid_utf8(argv[2]) != SWITCH_STATUS_SUCCESS)) {
+                    switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_ERROR,
+                                      "%s contains invalid utf8 characters\n", argv[2]);
+                    switch_core_session_rwunlock(lsession);
+                    goto done;
+                }
+                status = do_graceful_shutdown(lsession, argc > 2 ? argv[2] : NULL);
+            } else if (!strcasecmp(argv[1], "stats")) {
+                char *json = stream_session_stats(lsession);
+                switch_core_session_rwunlock(lsession);
+                if (json) {
+                    stream->write_function(stream, "%s\n", json);
+                    free(json);
+                } else {
+                    stream->write_function(stream, "-ERR no audio stream on %s\n", argv[0]);
+                }
+                goto done;
             } else if (!strcasecmp(argv[1], "pause")) {
                 status = do_pauseresume(lsession, 1);
             } else if (!strcasecmp(argv[1], "resume")) {
@@ -216,7 +265,8 @@ SWITCH_STANDARD_API(stream_function)
             } else if (!strcasecmp(argv[1], "start")) {
                 //switch_channel_t *channel = switch_core_session_get_channel(lsession);
                 char wsUri[MAX_WS_URI];
-                int sampling = 8000;
+                int sampling = 0; /* the profile's, 8000 unless configured */
+                const char *profile = strncmp(argv[2], "profile:", 8) ? NULL : argv[2] + 8;
                 switch_media_bug_flag_t flags = SMBF_READ_STREAM;
                 char *metadata = argc > 5 ? argv[5] : NULL;
                 if(metadata && (is_valid_utf8(argv[2]) != SWITCH_STATUS_SUCCESS)) {
@@ -252,7 +302,7 @@ SWITCH_STANDARD_API(stream_function)
                     switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_ERROR,
                                       "invalid sample rate: %s\n", argv[4]);
                 } else {
-                    status = start_capture(lsession, flags, wsUri, sampling, metadata);
+                    status = start_capture(lsession, flags, wsUri, sampling, metadata, profile);
                 }
             } else {
                 switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_ERROR,
@@ -276,6 +326,142 @@ done:
     return SWITCH_STATUS_SUCCESS;
 }
 
+SWITCH_STANDARD_API(stream_pool_function)
+{
+    char *json = stream_pool_status();
+    if (json) {
+        stream->write_function(stream, "%s\n", json);
+        free(json);
+    } else {
+        stream->write_function(stream, "-ERR Operation Failed\n");
+    }
+    return SWITCH_STATUS_SUCCESS;
+}
+
+SWITCH_STANDARD_API(stream_tls_function)
+{
+    char *json = stream_tls_status();
+    if (json) {
+        stream->write_function(stream, "%s\n", json);
+        free(json);
+    } else {
+        stream->write_function(stream, "-ERR Operation Failed\n");
+    }
+    return SWITCH_STATUS_SUCCESS;
+}
+
+SWITCH_STANDARD_API(stream_stats_function)
+{
+    char *json = stream_stats();
+    if (json) {
+        stream->write_function(stream, "%s\n", json);
+        free(json);
+    } else {
+        stream->write_function(stream, "-ERR Operation Failed\n");
+    }
+    return SWITCH_STATUS_SUCCESS;
+}
+
+SWITCH_STANDARD_API(stream_latency_function)
+{
+    int reset = !zstr(cmd) && !strcasecmp(cmd, "reset");
+    char *json = stream_latency(reset);
+    if (json) {
+        stream->write_function(stream, "%s\n", json);
+        free(json);
+    } else {
+        stream->write_function(stream, "-ERR Operation Failed\n");
+    }
+    return SWITCH_STATUS_SUCCESS;
+}
+
+SWITCH_STANDARD_API(stream_metrics_function)
+{
+    char *text = stream_metrics();
+    if (text) {
+        stream->write_function(stream, "%s", text);
+        free(text);
+    } else {
+        stream->write_function(stream, "-ERR Operation Failed\n");
+    }
+    return SWITCH_STATUS_SUCCESS;
+}
+
+SWITCH_STANDARD_API(stream_reload_function)
+{
+    int profiles = stream_config_reload();
+    if (profiles >= 0) {
+        stream->write_function(stream, "+OK %d profiles\n", profiles);
+    } else {
+        stream->write_function(stream, "-ERR audio_stream.conf could not be read\n");
+    }
+    return SWITCH_STATUS_SUCCESS;
+}
+
+static switch_status_t bulk_pause(switch_core_session_t *session, void *arg)
+{
+    return do_pauseresume(session, 1);
+}
+
+static switch_status_t bulk_resume(switch_core_session_t *session, void *arg)
+{
+    return do_pauseresume(session, 0);
+}
+
+static switch_status_t bulk_stop(switch_core_session_t *session, void *arg)
+{
+    return do_stop(session, NULL);
+}
+
+static switch_status_t bulk_migrate(switch_core_session_t *session, void *arg)
+{
+    return stream_session_migrate(session, (const char *) arg);
+}
+
+#define STREAM_BULK_SYNTAX "<pause | resume | stop | migrate> <endpoint | all> [wss-url]"
+SWITCH_STANDARD_API(stream_bulk_function)
+{
+    char *mycmd = NULL, *argv[4] = { 0 };
+    int argc = 0;
+    char wsUri[MAX_WS_URI];
+    stream_session_fn fn = NULL;
+    void *arg = NULL;
+    const char *endpoint;
+
+    if (!zstr(cmd) && (mycmd = strdup(cmd))) {
+        argc = switch_separate_string(mycmd, ' ', argv, (sizeof(argv) / sizeof(argv[0])));
+    }
+    if (argc < 2) {
+        stream->write_function(stream, "-USAGE: %s\n", STREAM_BULK_SYNTAX);
+        goto done;
+    }
+
+    if (!strcasecmp(argv[0], "pause")) {
+        fn = bulk_pause;
+    } else if (!strcasecmp(argv[0], "resume")) {
+        fn = bulk_resume;
+    } else if (!strcasecmp(argv[0], "stop")) {
+        fn = bulk_stop;
+    } else if (!strcasecmp(argv[0], "migrate")) {
+        if (argc < 3 || !validate_ws_uri(argv[2], &wsUri[0])) {
+            stream->write_function(stream, "-ERR migrate requires a valid websocket uri\n");
+            goto done;
+        }
+        fn = bulk_migrate;
+        arg = wsUri;
+    } else {
+        stream->write_function(stream, "-USAGE: %s\n", STREAM_BULK_SYNTAX);
+        goto done;
+    }
+
+    endpoint = strcasecmp(argv[1], "all") ? argv[1] : NULL;
+    stream->write_function(stream, "+OK %d streams\n", stream_session_foreach(endpoint, fn, arg));
+
+done:
+    switch_safe_free(mycmd);
+    return SWITCH_STATUS_SUCCESS;
+}
+
 SWITCH_MODULE_LOAD_FUNCTION(mod_audio_stream_load)
 {
     switch_api_interface_t *api_interface;
@@ -289,18 +475,31 @@ SWITCH_MODULE_LOAD_FUNCTION(mod_audio_stream_load)
     if (switch_event_reserve_subclass(EVENT_JSON) != SWITCH_STATUS_SUCCESS ||
         switch_event_reserve_subclass(EVENT_CONNECT) != SWITCH_STATUS_SUCCESS ||
         switch_event_reserve_subclass(EVENT_ERROR) != SWITCH_STATUS_SUCCESS ||
-        switch_event_reserve_subclass(EVENT_DISCONNECT) != SWITCH_STATUS_SUCCESS) {
+        switch_event_reserve_subclass(EVENT_DISCONNECT) != SWITCH_STATUS_SUCCESS ||
+        switch_event_reserve_subclass(EVENT_DRAINED) != SWITCH_STATUS_SUCCESS) {
         switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "Couldn't register an event subclass for mod_audio_stream API.\n");
         return SWITCH_STATUS_TERM;
     }
     SWITCH_ADD_API(api_interface, "uuid_audio_stream", "audio_stream API", stream_function, STREAM_API_SYNTAX);
+    SWITCH_ADD_API(api_interface, "audio_stream_pool", "audio_stream warm connection pool", stream_pool_function, "");
+    SWITCH_ADD_API(api_interface, "audio_stream_tls", "audio_stream TLS handshake stats", stream_tls_function, "");
+    SWITCH_ADD_API(api_interface, "audio_stream_stats", "audio_stream module stats", stream_stats_function, "");
+    SWITCH_ADD_API(api_interface, "audio_stream_latency", "audio_stream latency histograms", stream_latency_function, "[reset]");
+    SWITCH_ADD_API(api_interface, "audio_stream_bulk", "audio_stream operation on many streams", stream_bulk_function, STREAM_BULK_SYNTAX);
+    SWITCH_ADD_API(api_interface, "audio_stream_metrics", "audio_stream metrics in Prometheus text format", stream_metrics_function, "");
+    SWITCH_ADD_API(api_interface, "audio_stream_reload", "audio_stream reload profiles", stream_reload_function, "");
     switch_console_set_complete("add uuid_audio_stream ::console::list_uuid start wss-url metadata");
     switch_console_set_complete("add uuid_audio_stream ::console::list_uuid start wss-url");
     switch_console_set_complete("add uuid_audio_stream ::console::list_uuid stop");
+    switch_console_set_complete("add uuid_audio_stream ::console::list_uuid graceful-shutdown");
+    switch_console_set_complete("add uuid_audio_stream list");
+    switch_console_set_complete("add uuid_audio_stream ::console::list_uuid stats");
     switch_console_set_complete("add uuid_audio_stream ::console::list_uuid pause");
     switch_console_set_complete("add uuid_audio_stream ::console::list_uuid resume");
     switch_console_set_complete("add uuid_audio_stream ::console::list_uuid send_text");
 
+    stream_module_init();
+
     switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_NOTICE, "mod_audio_stream API successfully loaded\n");
 
     /* indicate that the module should continue to be loaded */
@@ -312,10 +511,13 @@ SWITCH_MODULE_LOAD_FUNCTION(mod_audio_stream_load)
   Macro expands to: switch_status_t mod_audio_stream_shutdown() */
 SWITCH_MODULE_SHUTDOWN_FUNCTION(mod_audio_stream_shutdown)
 {
+    stream_module_shutdown();
+
     switch_event_free_subclass(EVENT_JSON);
     switch_event_free_subclass(EVENT_CONNECT);
     switch_event_free_subclass(EVENT_DISCONNECT);
     switch_event_free_subclass(EVENT_ERROR);
+    switch_event_free_subclass(EVENT_DRAINED);
 
     return SWITCH_STATUS_SUCCESS;
 }
@@ -14,35 +14,50 @@
 #define EVENT_ERROR             "mod_audio_stream::error"
 #define EVENT_JSON              "mod_audio_stream::json"
 #define EVENT_PLAY              "mod_audio_stream::play"
+#define EVENT_DRAINED           "mod_audio_stream::drained"
 
 typedef void (*responseHandler_t)(switch_core_session_t* session, const char* eventName, const char* json);
+typedef switch_status_t (*stream_session_fn)(switch_core_session_t *session, void *arg);
 
+/*
+ * Per call state, allocated from the session pool. What the media bug callbacks touch on
+ * every frame comes first; playback storage is only allocated once there is audio to play.
+ */
 struct private_data {
+    /* 上行：每 20ms 的读回调 */
     switch_mutex_t *mutex;
-    char sessionId[MAX_SESSION_ID];
-    SpeexResamplerState *resampler;
-    responseHandler_t responseHandler;
     void *pAudioStreamer;
-    char ws_uri[MAX_WS_URI];
-    int sampling;
-    int channels;
-    int audio_paused:1;
-    int close_requested:1;
-    char initialMetadata[8192];
+    void *pCounters;                   // StreamCounters, see stream_counters.h
+    void *pRecorder;                   // CallRecorder, see stream_recorder.h, null when not recording
+    void *pEcho;                       // EchoCanceller, see stream_echo.h, null when off
+    void *pBargeIn;                    // BargeInDetector, see stream_bargein.h, null when off
+    SpeexResamplerState *resampler;
     switch_buffer_t *sbuffer;
+    switch_time_t last_voice;          // last uplink frame with caller speech
     int rtp_packets;
-    
-    // 流式播放支持
-    switch_buffer_t *play_buffer;      // 播放缓冲区
+    int sampling;
+    int channels;
+    unsigned int audio_paused:1;
+    unsigned int close_requested:1;
+    unsigned int draining:1;           // graceful-shutdown in progress
+    unsigned int event_bus:1;          // fire the events on the FreeSWITCH event bus
+    unsigned int stream_play_enabled:1; // 启用流式播放
+    unsigned int barged_in:1;          // 本地检测到打断，等服务端 resumeAudio 或 cancelAudio
+
+    /* 下行：流式播放 */
     switch_mutex_t *play_mutex;        // 播放互斥锁
-    int stream_play_enabled:1;         // 启用流式播放
-    switch_frame_t write_frame;        // WRITE_REPLACE 输出帧
-    uint8_t *write_frame_data;         // WRITE_REPLACE 帧缓冲
-    uint64_t play_frame_count;         // 播放帧计数器（用于速率控制）
-    
-    // 播放线程支持
-    switch_thread_t *play_thread;      // 播放线程
-    int play_thread_running:1;         // 播放线程运行标志
+    void *pPlayback;                   // PlaybackQueue, see stream_playback.h, created with the first audio
+    void *pStretch;                    // TimeStretch, see stream_stretch.h, null when catch-up is off
+    void *pComfort;                    // ComfortNoise, see stream_comfort.h, null when off
+    switch_frame_t *write_frame;       // 仅当 media bug 没有替换帧时分配
+    switch_time_t turn_voice;          // last_voice already measured for turn latency
+    float barge_in_gain;               // 打断后的播放增益，0 为暂停
+
+    responseHandler_t responseHandler;
+    switch_time_t drain_start;
+    switch_size_t drain_flushed;       // uplink bytes flushed when the drain started
+    int drain_timeout_ms;
+    char sessionId[MAX_SESSION_ID];
 };
 
 typedef struct private_data private_t;
@@ -0,0 +1,55 @@
+#include <cmath>
+#include <strings.h>
+#include "stream_bargein.h"
+
+#define BARGE_IN_SNR_DB         (10.0)  // above the noise floor for speech
+#define BARGE_IN_FLOOR_RISE_DB  (2.0)   // per second, how fast the floor follows louder noise
+#define BARGE_IN_HANG_MS        (200)   // gap that ends a burst
+
+bool barge_in_mode(const char* name, BargeInMode& mode) {
+    if (!strcasecmp(name, "off") || !strcasecmp(name, "false")) mode = BARGE_IN_OFF;
+    else if (!strcasecmp(name, "pause")) mode = BARGE_IN_PAUSE;
+    else if (!strcasecmp(name, "duck")) mode = BARGE_IN_DUCK;
+    else return false;
+    return true;
+}
+
+BargeInDetector::BargeInDetector(int rate, int levelDb, int minMs)
+    : m_rate(rate), m_level(levelDb), m_minMs(minMs), m_floor(levelDb - BARGE_IN_SNR_DB) {}
+
+bool BargeInDetector::feed(const int16_t* samples, size_t frames, int channels) {
+    if (!frames) return false;
+    double energy = 0;
+    for (size_t i = 0; i < frames; i++) {
+        const double s = samples[i * channels];
+        energy += s * s;
+    }
+    const double db = 10 * log10(energy / frames / (32768.0 * 32768.0) + 1e-10);
+    const int ms = (int) (frames * 1000 / m_rate);
+
+    // a line already noisier than the level when the stream starts is its floor from the
+    // first frame, rather than after the slow rise
+    if (!m_primed) {
+        m_primed = true;
+        if (db > m_floor) m_floor = db;
+    }
+    if (db < m_floor) m_floor = db;
+    else m_floor += BARGE_IN_FLOOR_RISE_DB * ms / 1000;
+
+    if (db > m_level && db > m_floor + BARGE_IN_SNR_DB) {
+        m_voicedMs += ms;
+        m_burstMs += m_gapMs + ms;
+        m_gapMs = 0;
+    } else if (m_burstMs) {
+        m_gapMs += ms;
+        if (m_gapMs >= BARGE_IN_HANG_MS) {
+            m_voicedMs = 0;
+            m_burstMs = 0;
+            m_gapMs = 0;
+            m_reported = false;
+        }
+    }
+    if (m_reported || m_voicedMs < m_minMs) return false;
+    m_reported = true;
+    return true;
+}
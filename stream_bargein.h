@@ -0,0 +1,48 @@
+#ifndef STREAM_BARGEIN_H
+#define STREAM_BARGEIN_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Caller speech detection on the uplink, so playback can stop the moment the caller talks
+ * over it instead of after the server has recognised it and cancelled the audio.
+ *
+ * A frame is speech when its level is above the configured one and well above the noise
+ * floor, which starts at the first frame, follows the quietest frames down at once and
+ * creeps up otherwise. A burst of speech that lasts long enough is reported once; short
+ * gaps within it are bridged.
+ */
+
+enum BargeInMode {
+    BARGE_IN_OFF,
+    BARGE_IN_PAUSE,                 // stop playing, keep the queue
+    BARGE_IN_DUCK                   // keep playing, quieter
+};
+
+// off, pause or duck, false for anything else
+bool barge_in_mode(const char* name, BargeInMode& mode);
+
+class BargeInDetector {
+public:
+    BargeInDetector(int rate, int levelDb, int minMs);
+
+    // looks at the first of channels interleaved channels; true when a burst of speech
+    // has just reached minMs of speech
+    bool feed(const int16_t* samples, size_t frames, int channels);
+    // how long the current burst has lasted, gaps included
+    int speechMs() const { return m_burstMs; }
+
+private:
+    const int m_rate;
+    const double m_level;
+    const int m_minMs;
+    double m_floor;                 // dBFS
+    bool m_primed = false;          // the first frame was seen
+    int m_voicedMs = 0;             // speech frames in the current burst
+    int m_burstMs = 0;              // from its first to its last speech frame
+    int m_gapMs = 0;                // since the last speech frame of the burst
+    bool m_reported = false;
+};
+
+#endif //STREAM_BARGEIN_H
@@ -0,0 +1,703 @@
+// Offline benchmarks of the downlink and playback path, run against the module's own
+// sources with synthetic audio; see README. Each prints its measurements and fails when
+// one is off from what the feature promises.
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cstdint>
+#include <cmath>
+#include <algorithm>
+#include <string>
+#include <vector>
+#include <memory>
+#include <fstream>
+#include <iterator>
+#include <chrono>
+#include <new>
+#include <getopt.h>
+#include "mod_audio_stream.h"
+#include "base64.h"
+#include "stream_playback.h"
+#include "stream_scratch.h"
+#include "stream_stretch.h"
+#include "stream_echo.h"
+#include "stream_bargein.h"
+#include "stream_comfort.h"
+
+#define BENCH_FRAME_MS          (20)
+#define BENCH_CATCHUP_MS        (400)   // catch-up settings the stretch bench runs with
+#define BENCH_CATCHUP_SPEEDUP   (25)
+#define BENCH_CATCHUP_SLOWDOWN  (10)
+#define BENCH_ECHO_DELAY_MS     (180)   // playback to echo on the synthetic echo path
+#define BENCH_ECHO_TAIL_MS      (128)
+#define BENCH_MIN_ERLE_DB       (10)    // echo removed once converged, at least
+#define BENCH_COMFORT_LEVEL     (-60)   // comfort noise settings the comfort bench runs with
+#define BENCH_COMFORT_HANGOVER  (300)
+#define BENCH_BARGE_IN_LATE_MS  (120)   // detection allowed after the speech it needs, for syllable dips
+
+// every heap allocation of the process, to count the ones made per downlink message
+static uint64_t g_allocs = 0;
+
+void* operator new(size_t size) {
+    g_allocs++;
+    if (void* p = malloc(size ? size : 1)) return p;
+    throw std::bad_alloc();
+}
+
+void* operator new[](size_t size) {
+    return operator new(size);
+}
+
+void operator delete(void* p) noexcept {
+    free(p);
+}
+
+void operator delete[](void* p) noexcept {
+    free(p);
+}
+
+struct Options {
+    int rate = 8000;                // call rate
+    int ttsRate = 24000;            // downlink audio rate
+    int bargeInLevel = -35;         // as STREAM_BARGE_IN_LEVEL
+    int bargeInMs = 160;            // as STREAM_BARGE_IN_MS
+    std::string sample;             // recorded caller audio for the bargein bench, 16-bit PCM WAV
+};
+
+namespace {
+
+    double elapsed_usec(std::chrono::steady_clock::time_point since) {
+        return std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - since).count();
+    }
+
+    // a voice-like test signal: a 150 Hz buzz with its first harmonics and a syllable rate envelope
+    void voice(int16_t* out, size_t samples, int rate, uint64_t& n, double level) {
+        for (size_t i = 0; i < samples; i++, n++) {
+            const double t = (double) n / rate;
+            const double env = 0.55 + 0.45 * sin(2 * M_PI * 4 * t);
+            double v = 0;
+            for (int h = 1; h <= 4; h++) v += sin(2 * M_PI * 150 * h * t) / h;
+            out[i] = (int16_t) (level * env * v / 2);
+        }
+    }
+
+    /*
+     * alloc: processMessage's buffers for a stream of downlink messages, 20 to 200 ms of
+     * audio each in segments of 20 messages: decode, resample to the call rate and to 8 kHz
+     * for the play file, A-law buffer, then into the playback queue, played out down to 200 ms.
+     * Once the arena has seen the largest message no message should allocate; the queue
+     * allocates a list node per new segment only.
+     */
+    bool bench_alloc(const Options& opt) {
+        const int messages = 2000;
+        const int perSegment = 20;
+        const int warmup = perSegment + 1;     // the first segment and the reset that grows the arena for it
+        const size_t backlog = (size_t) opt.rate * sizeof(int16_t) / 5;   // 200 ms left queued, as when playing
+
+        std::vector<std::string> encoded;
+        uint64_t n = 0;
+        for (int ms = 20; ms <= 200; ms += 20) {
+            std::vector<int16_t> pcm((size_t) opt.ttsRate * ms / 1000);
+            voice(pcm.data(), pcm.size(), opt.ttsRate, n, 8000);
+            encoded.push_back(base64_encode((const unsigned char*) pcm.data(), pcm.size() * sizeof(int16_t)));
+        }
+
+        ScratchArena arena;
+        CachedResampler playResampler, fileResampler;
+        PlaybackQueue queue((size_t) opt.rate * sizeof(int16_t) * 10);
+        std::vector<uint8_t> frame((size_t) opt.rate * sizeof(int16_t) * BENCH_FRAME_MS / 1000);
+        uint64_t arenaAllocs = 0, queueAllocs = 0;
+        double usec = 0;
+        int segments = 0;
+
+        for (int msg = 0; msg < messages; msg++) {
+            const std::string& text = encoded[msg % encoded.size()];
+            const bool segmentEnds = msg % perSegment == perSegment - 1;
+            char segment[16];
+            snprintf(segment, sizeof(segment), "s%d", msg / perSegment);
+
+            const uint64_t before = g_allocs;
+            const auto start = std::chrono::steady_clock::now();
+            arena.reset();
+            uint8_t* raw = arena.alloc<uint8_t>(text.size() / 4 * 3 + 3);
+            const size_t samples = base64_decode(text.data(), text.size(), raw) / sizeof(int16_t);
+            const int16_t* pcm = reinterpret_cast<const int16_t*>(raw);
+
+            int err;
+            playResampler.get(opt.ttsRate, opt.rate, &err);
+            size_t room = ((uint64_t) samples * opt.rate + opt.ttsRate - 1) / opt.ttsRate;
+            size_t tail = segmentEnds ? playResampler.tail() : 0;
+            int16_t* played = arena.alloc<int16_t>(room + tail);
+            size_t playedCount = playResampler.process(pcm, samples, played, room);
+            if (segmentEnds) playedCount += playResampler.flush(played + playedCount, tail);
+
+            fileResampler.get(opt.ttsRate, 8000, &err);
+            room = ((uint64_t) samples * 8000 + opt.ttsRate - 1) / opt.ttsRate;
+            tail = segmentEnds ? fileResampler.tail() : 0;
+            int16_t* saved = arena.alloc<int16_t>(room + tail);
+            size_t savedCount = fileResampler.process(pcm, samples, saved, room);
+            if (segmentEnds) savedCount += fileResampler.flush(saved + savedCount, tail);
+            uint8_t* alaw = arena.alloc<uint8_t>(savedCount);
+            for (size_t i = 0; i < savedCount; i++) alaw[i] = (uint8_t) (saved[i] >> 8);
+            usec += elapsed_usec(start);
+            const uint64_t decoded = g_allocs;
+
+            if (!queue.queued(segment)) segments += msg >= warmup;
+            queue.write(segment, 0, false, (const uint8_t*) played, playedCount * sizeof(int16_t));
+            while (queue.inuse() > backlog) queue.read(frame.data(), frame.size());
+
+            if (msg >= warmup) {
+                arenaAllocs += decoded - before;
+                queueAllocs += g_allocs - decoded;
+            }
+        }
+
+        const int counted = messages - warmup;
+        printf("alloc: %d messages of 20-200 ms at %d Hz to %d Hz, after the first %d\n", counted, opt.ttsRate, opt.rate, warmup);
+        printf("  decode, resample, encode: %llu allocations, %.2f per message, %.1f us per message\n",
+               (unsigned long long) arenaAllocs, (double) arenaAllocs / counted, usec / messages);
+        printf("  playback queue:           %llu allocations over %d segments, %.2f per segment\n",
+               (unsigned long long) queueAllocs, segments, segments ? (double) queueAllocs / segments : 0.0);
+        printf("  arena capacity:           %zu bytes\n", arena.capacity());
+        return arenaAllocs == 0;
+    }
+
+    // frequency of a sine from its zero crossings
+    double zero_crossing_hz(const std::vector<int16_t>& samples, int rate) {
+        size_t crossings = 0;
+        for (size_t i = 1; i < samples.size(); i++) crossings += (samples[i - 1] < 0) != (samples[i] < 0);
+        return crossings / 2.0 * rate / samples.size();
+    }
+
+    // the call's playback: frames rendered from the queue, plain or through TimeStretch
+    struct Playout {
+        Playout(int rate, bool catchup)
+            : rate(rate), queue((size_t) rate * sizeof(int16_t) * 120),
+              stretch(catchup ? new TimeStretch(rate, BENCH_CATCHUP_MS, BENCH_CATCHUP_SPEEDUP, BENCH_CATCHUP_SLOWDOWN) : nullptr),
+              frame((size_t) rate * BENCH_FRAME_MS / 1000) {}
+
+        double backlogMs() const {
+            return (queue.inuse() / sizeof(int16_t) + (stretch ? stretch->held() : 0)) * 1000.0 / rate;
+        }
+
+        // one frame, as stream_play_frame plays it; false on an underrun while playing
+        bool play() {
+            const double backlog = backlogMs();
+            if (backlog == 0) return true;
+            speed = stretch ? stretch->speed(backlog) : 1;
+            size_t got = stretch ? stretch->render(queue, frame.data(), frame.size(), speed)
+                                 : queue.read((uint8_t*) frame.data(), frame.size() * sizeof(int16_t)) / sizeof(int16_t);
+            return got == frame.size();
+        }
+
+        int rate;
+        PlaybackQueue queue;
+        std::unique_ptr<TimeStretch> stretch;
+        std::vector<int16_t> frame;
+        double speed = 1;
+    };
+
+    struct Backlog {
+        double sum = 0;
+        double max = 0;
+        int frames = 0;
+        int underruns = 0;
+
+        // an underrun is only counted while the audio is meant to be continuous
+        void add(double ms, bool played, bool continuous) {
+            if (ms > 0) {
+                sum += ms;
+                frames++;
+            }
+            if (ms > max) max = ms;
+            underruns += !played && continuous;
+        }
+        double mean() const { return frames ? sum / frames : 0; }
+    };
+
+    /*
+     * stretch: playback backlog over time with and without catch-up, for TTS arriving in
+     * bursts (3 s of audio every 5 s) and faster than real time (1 s every 0.9 s). Catch-up
+     * should keep the backlog lower without more underruns, play untouched at normal speed,
+     * and keep the pitch when speeding up.
+     */
+    bool bench_stretch(const Options& opt) {
+        const int rate = opt.rate;
+        const size_t frame = (size_t) rate * BENCH_FRAME_MS / 1000;
+        const int framesPerSec = 1000 / BENCH_FRAME_MS;
+        bool ok = true;
+
+        struct Arrival {
+            const char* name;
+            int seconds;
+            int everyMs;            // a chunk arrives
+            int chunkMs;            // of this much audio
+            int untilMs;
+        };
+        const Arrival arrivals[] = {
+            {"bursts of 3 s every 5 s", 30, 5000, 3000, 25000},
+            {"1 s every 0.9 s", 60, 900, 1000, 60000},
+        };
+        for (const auto& arrival : arrivals) {
+            Playout plain(rate, false), catchup(rate, true);
+            Backlog plainStats, catchupStats;
+            std::vector<int16_t> chunk((size_t) rate * arrival.chunkMs / 1000);
+            uint64_t n = 0;
+            voice(chunk.data(), chunk.size(), rate, n, 8000);
+
+            printf("stretch: %s, backlog in ms, catch-up from %d ms\n", arrival.name, BENCH_CATCHUP_MS);
+            printf("   t(s)    plain  catch-up  speed\n");
+            const int step = arrival.seconds > 30 ? 5 : 1;
+            for (int f = 0; f < arrival.seconds * framesPerSec; f++) {
+                const int ms = f * BENCH_FRAME_MS;
+                if (ms < arrival.untilMs && ms % arrival.everyMs < BENCH_FRAME_MS) {
+                    for (Playout* p : {&plain, &catchup}) {
+                        p->queue.write("", 0, false, (const uint8_t*) chunk.data(), chunk.size() * sizeof(int16_t));
+                    }
+                }
+                const double plainMs = plain.backlogMs(), catchupMs = catchup.backlogMs();
+                // the end of a burst is the end of an utterance, not an underrun
+                const bool continuous = arrival.everyMs <= arrival.chunkMs && ms < arrival.untilMs;
+                plainStats.add(plainMs, plain.play(), continuous);
+                catchupStats.add(catchupMs, catchup.play(), continuous);
+                if (f % (framesPerSec * step) == 0) {
+                    printf("  %5d  %7.0f  %8.0f  x%.2f\n", ms / 1000, plainMs, catchupMs, catchup.speed);
+                }
+            }
+            printf("  mean backlog %.0f ms plain, %.0f ms catch-up; max %.0f / %.0f ms; underrun frames %d / %d\n",
+                   plainStats.mean(), catchupStats.mean(), plainStats.max, catchupStats.max,
+                   plainStats.underruns, catchupStats.underruns);
+            ok = ok && catchupStats.mean() < plainStats.mean() && catchupStats.underruns <= plainStats.underruns;
+        }
+
+        // at normal speed the audio comes out as it went in
+        {
+            Playout catchup(rate, true);
+            std::vector<int16_t> in((size_t) rate * 2), out;
+            uint64_t n = 0;
+            voice(in.data(), in.size(), rate, n, 8000);
+            catchup.queue.write("", 0, false, (const uint8_t*) in.data(), in.size() * sizeof(int16_t));
+            std::vector<int16_t> f(frame);
+            while (size_t got = catchup.stretch->render(catchup.queue, f.data(), frame, 1.0)) {
+                out.insert(out.end(), f.begin(), f.begin() + got);
+            }
+            const bool exact = out == in;
+            printf("  speed 1: %s\n", exact ? "bit exact" : "CHANGED");
+            ok = ok && exact;
+        }
+
+        // a 220 Hz tone played at the highest speed keeps its pitch and takes more input
+        {
+            Playout catchup(rate, true);
+            std::vector<int16_t> in((size_t) rate * 10), out;
+            for (size_t i = 0; i < in.size(); i++) in[i] = (int16_t) (8000 * sin(2 * M_PI * 220 * i / rate));
+            catchup.queue.write("", 0, false, (const uint8_t*) in.data(), in.size() * sizeof(int16_t));
+            const double speed = 1 + BENCH_CATCHUP_SPEEDUP / 100.0;
+            std::vector<int16_t> f(frame);
+            for (int i = 0; i < 5 * framesPerSec; i++) {
+                size_t got = catchup.stretch->render(catchup.queue, f.data(), frame, speed);
+                out.insert(out.end(), f.begin(), f.begin() + got);
+            }
+            const double consumed = (in.size() - catchup.backlogMs() * rate / 1000) / rate;
+            const double hz = zero_crossing_hz(out, rate);
+            printf("  x%.2f: 5 s played from %.2f s of input, 220 Hz tone came out at %.1f Hz\n", speed, consumed, hz);
+            ok = ok && fabs(hz - 220) < 220 * 0.02 && consumed > 5 * (1 + (speed - 1) / 2);
+        }
+        return ok;
+    }
+
+    // small deterministic noise, for the near end's line noise and the echo path's taps
+    struct Noise {
+        uint32_t seed = 1;
+        double next() {
+            seed = seed * 1664525u + 1013904223u;
+            return (seed >> 8) / (double) (1u << 24) * 2 - 1;
+        }
+    };
+
+    /*
+     * echo: ERLE, the echo removed from the uplink, on a synthetic echo path. The bot talks
+     * in 3 s turns with 1 s pauses; its audio comes back BENCH_ECHO_DELAY_MS later through a
+     * 20 ms decaying impulse response 10 dB down, over line noise, and the caller talks over
+     * it from 8 to 10 s. ERLE is taken over the frames with echo and no caller speech, per
+     * second and over the second half, with the delay configured and estimated.
+     */
+    bool bench_echo(const Options& opt) {
+        const int rate = opt.rate;
+        const size_t frame = (size_t) rate * BENCH_FRAME_MS / 1000;
+        const int seconds = 20;
+        const size_t total = (size_t) rate * seconds;
+        const size_t delay = (size_t) rate * BENCH_ECHO_DELAY_MS / 1000;
+        bool ok = true;
+
+        // the buzz alone is periodic enough to be predicted from itself, the bot gets some
+        // breath noise too
+        Noise noise;
+        std::vector<int16_t> bot(total), caller(total, 0);
+        uint64_t n = 0;
+        voice(bot.data(), total, rate, n, 10000);
+        for (size_t i = 0; i < total; i++) {
+            if (i % (rate * 4) >= (size_t) rate * 3) bot[i] = 0;
+            else bot[i] += (int16_t) (1500 * noise.next());
+        }
+        n = 0;
+        voice(caller.data() + rate * 8, rate * 2, rate, n, 6000);
+
+        std::vector<double> path((size_t) rate / 50);
+        double energy = 0;
+        for (size_t k = 0; k < path.size(); k++) {
+            path[k] = noise.next() * exp(-(double) k / (rate / 200));
+            energy += path[k] * path[k];
+        }
+        for (auto& tap : path) tap *= pow(10, -10 / 20.0) / sqrt(energy);
+
+        std::vector<double> echo(total, 0);
+        for (size_t i = delay; i < total; i++) {
+            double v = 0;
+            for (size_t k = 0; k < path.size() && k <= i - delay; k++) v += path[k] * bot[i - delay - k];
+            echo[i] = v;
+        }
+
+        for (int delayMs : {BENCH_ECHO_DELAY_MS - 20, -1}) {
+            EchoCanceller ec(rate, BENCH_ECHO_TAIL_MS, delayMs);
+            const switch_time_t start = switch_micro_time_now();
+            std::vector<int16_t> cap(frame);
+            double secEcho = 0, secLeft = 0, halfEcho = 0, halfLeft = 0, usec = 0;
+
+            printf("echo: %d ms echo path, %s, ERLE in dB\n", BENCH_ECHO_DELAY_MS,
+                   delayMs < 0 ? "delay estimated" : "delay set to 20 ms under it");
+            for (size_t f = 0; f * frame < total; f++) {
+                const size_t base = f * frame;
+                const switch_time_t when = start + (switch_time_t) (f + 1) * BENCH_FRAME_MS * 1000;
+                for (size_t i = 0; i < frame; i++) {
+                    const double v = caller[base + i] + echo[base + i] + 3 * noise.next();
+                    cap[i] = (int16_t) std::max(-32768.0, std::min(32767.0, v));
+                }
+                const auto cpu = std::chrono::steady_clock::now();
+                ec.playback(bot.data() + base, frame, 1, when);
+                ec.capture(cap.data(), frame, 1, when);
+                usec += elapsed_usec(cpu);
+
+                bool talking = false;
+                double e = 0, left = 0;
+                for (size_t i = 0; i < frame; i++) {
+                    talking = talking || caller[base + i] != 0;
+                    e += echo[base + i] * echo[base + i];
+                    left += (double) cap[i] * cap[i];
+                }
+                // frames with echo worth measuring, well above the line noise
+                if (!talking && e > frame * 100.0 * 100.0) {
+                    secEcho += e;
+                    secLeft += left;
+                    if (base >= total / 2) {
+                        halfEcho += e;
+                        halfLeft += left;
+                    }
+                }
+                if ((base + frame) % rate == 0) {
+                    if (secEcho > 0) printf("  %3zu s  %5.1f\n", base / rate, 10 * log10(secEcho / (secLeft + 1)));
+                    secEcho = secLeft = 0;
+                }
+            }
+            const double erle = 10 * log10(halfEcho / (halfLeft + 1));
+            cJSON* stats = cJSON_CreateObject();
+            ec.stats(stats);
+            char* json = cJSON_PrintUnformatted(stats);
+            printf("  second half %.1f dB, %.1f us per 20 ms frame (%.2f%% of a core), %s\n", erle,
+                   usec / (total / frame), usec / (total / frame) / (BENCH_FRAME_MS * 10), json);
+            free(json);
+            cJSON_Delete(stats);
+            ok = ok && erle >= BENCH_MIN_ERLE_DB;
+        }
+        return ok;
+    }
+
+    // the first channel of a 16-bit PCM WAV file, false when it is something else
+    bool read_wav(const std::string& path, std::vector<int16_t>& samples, int& rate) {
+        std::ifstream file(path, std::ifstream::binary);
+        const std::vector<uint8_t> data((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+        if (data.size() < 12 || memcmp(data.data(), "RIFF", 4) || memcmp(data.data() + 8, "WAVE", 4)) return false;
+        auto le16 = [&](size_t pos) { return (unsigned) (data[pos] | data[pos + 1] << 8); };
+        auto le32 = [&](size_t pos) { return (size_t) le16(pos) | (size_t) le16(pos + 2) << 16; };
+        unsigned channels = 0;
+        for (size_t pos = 12; pos + 8 <= data.size(); ) {
+            const size_t size = le32(pos + 4);
+            if (!memcmp(&data[pos], "fmt ", 4) && pos + 24 <= data.size()) {
+                if (le16(pos + 8) != 1 || le16(pos + 22) != 16) return false;
+                channels = le16(pos + 10);
+                rate = (int) le32(pos + 12);
+            } else if (!memcmp(&data[pos], "data", 4) && channels && rate > 0) {
+                // a file still being written has no size yet
+                const size_t frames = std::min(size, data.size() - pos - 8) / 2 / channels;
+                samples.resize(frames);
+                for (size_t i = 0; i < frames; i++) samples[i] = (int16_t) le16(pos + 8 + i * 2 * channels);
+                return true;
+            }
+            pos += 8 + size + (size & 1);
+        }
+        return false;
+    }
+
+    // a sine at dBFS with a 4 Hz syllable envelope, over line noise at noiseDb
+    void talk(std::vector<int16_t>& out, int rate, int ms, double db, double noiseDb, Noise& noise) {
+        const double amplitude = db > -200 ? 32768 * pow(10, db / 20) * sqrt(2.0) : 0;
+        const double floor = 32768 * pow(10, noiseDb / 20) * sqrt(3.0);
+        for (size_t i = 0, count = (size_t) rate * ms / 1000; i < count; i++) {
+            const size_t n = out.size();
+            const double v = amplitude * (0.6 + 0.4 * sin(2 * M_PI * 4 * n / rate)) * sin(2 * M_PI * 180 * n / rate)
+                             + floor * noise.next();
+            out.push_back((int16_t) std::max(-32768.0, std::min(32767.0, v)));
+        }
+    }
+
+    // ms from the start at which the detector fires, fed 20 ms frames
+    std::vector<int> barge_ins(const std::vector<int16_t>& samples, int rate, const Options& opt) {
+        BargeInDetector detector(rate, opt.bargeInLevel, opt.bargeInMs);
+        const size_t frame = (size_t) rate * BENCH_FRAME_MS / 1000;
+        std::vector<int> hits;
+        for (size_t pos = 0; pos + frame <= samples.size(); pos += frame) {
+            if (detector.feed(samples.data() + pos, frame, 1)) hits.push_back((int) ((pos + frame) * 1000 / rate));
+        }
+        return hits;
+    }
+
+    /*
+     * bargein: when the detector fires. With -f, on a recorded caller (16-bit PCM WAV, first
+     * channel), printing when it fired and the level per second to check the settings
+     * against; otherwise on synthetic cases that must fire within BENCH_BARGE_IN_LATE_MS of
+     * the speech it needs, or not at all.
+     */
+    bool bench_bargein(const Options& opt) {
+        if (!opt.sample.empty()) {
+            std::vector<int16_t> samples;
+            int rate = 0;
+            if (!read_wav(opt.sample, samples, rate)) {
+                fprintf(stderr, "%s: not a 16-bit PCM WAV file\n", opt.sample.c_str());
+                return false;
+            }
+            printf("bargein: %s, %.1f s at %d Hz, level %d dBFS for %d ms\n", opt.sample.c_str(),
+                   (double) samples.size() / rate, rate, opt.bargeInLevel, opt.bargeInMs);
+            printf("  level per second (dBFS):");
+            for (size_t pos = 0; pos < samples.size(); pos += rate) {
+                double energy = 0;
+                const size_t end = std::min(samples.size(), pos + rate);
+                for (size_t i = pos; i < end; i++) energy += (double) samples[i] * samples[i];
+                printf(" %.0f", 10 * log10(energy / (end - pos) / (32768.0 * 32768.0) + 1e-10));
+            }
+            printf("\n  fired at (ms):");
+            const std::vector<int> hits = barge_ins(samples, rate, opt);
+            for (int ms : hits) printf(" %d", ms);
+            printf("%s\n", hits.empty() ? " never" : "");
+            return true;
+        }
+
+        struct Part {
+            int ms;
+            double db;              // of the speech, -999 for none
+        };
+        struct Case {
+            const char* name;
+            std::vector<Part> parts;
+            double noiseDb;
+            int speechAt;           // ms, -1 when it must not fire
+        };
+        const double level = opt.bargeInLevel;
+        const int cough = std::max(BENCH_FRAME_MS, opt.bargeInMs - 60);
+        const Case cases[] = {
+            {"speech 10 dB over the level, quiet line", {{1000, -999}, {1500, level + 10}, {1000, -999}}, -65, 1000},
+            {"short coughs 15 dB over", {{1000, -999}, {cough, level + 15}, {500, -999}, {cough, level + 15}, {500, -999}}, -65, -1},
+            {"echo residue 7 dB under the level", {{1000, -999}, {3000, level - 7}}, -65, -1},
+            {"noise 5 dB over the level, then speech", {{4000, -999}, {1000, level + 20}}, level + 5, 4000},
+        };
+        const int rate = opt.rate;
+        bool ok = true;
+        printf("bargein: level %d dBFS for %d ms, fired at (ms)\n", opt.bargeInLevel, opt.bargeInMs);
+        for (const auto& c : cases) {
+            Noise noise;
+            std::vector<int16_t> samples;
+            for (const auto& part : c.parts) talk(samples, rate, part.ms, part.db, c.noiseDb, noise);
+            const std::vector<int> hits = barge_ins(samples, rate, opt);
+
+            bool right = c.speechAt < 0 ? hits.empty()
+                                        : hits.size() == 1 && hits[0] >= c.speechAt + opt.bargeInMs &&
+                                          hits[0] <= c.speechAt + opt.bargeInMs + BENCH_BARGE_IN_LATE_MS;
+            printf("  %-42s", c.name);
+            for (int ms : hits) printf(" %d", ms);
+            if (c.speechAt < 0) printf("%s, expected never\n", hits.empty() ? " never" : "");
+            else printf("%s, expected %d to %d\n", hits.empty() ? " never" : "", c.speechAt + opt.bargeInMs,
+                        c.speechAt + opt.bargeInMs + BENCH_BARGE_IN_LATE_MS);
+            ok = ok && right;
+        }
+        return ok;
+    }
+
+    /*
+     * comfort: the edges of played audio, with and without comfort noise, for a chunk
+     * arriving 90 ms late mid-utterance and an utterance cancelled while playing. The test
+     * signal is a 310 Hz tone; a click is a second difference above what the tone and the
+     * noise have of their own, which should never happen with comfort noise. The noise level
+     * is measured in the gaps.
+     */
+    bool bench_comfort(const Options& opt) {
+        const int rate = opt.rate;
+        const size_t frame = (size_t) rate * BENCH_FRAME_MS / 1000;
+        const double amplitude = 10000;
+        const double toneStep = amplitude * pow(2 * M_PI * 310 / rate, 2);
+        // the noise has its own, larger than the tone's at high rates
+        double noiseStep = 0;
+        {
+            ComfortNoise probe(rate, 1, BENCH_COMFORT_LEVEL, BENCH_COMFORT_HANGOVER);
+            std::vector<int16_t> f(frame, 0), noise;
+            probe.audio(f.data(), frame, frame, false);
+            while (probe.gap(f.data(), frame)) noise.insert(noise.end(), f.begin(), f.end());
+            for (size_t i = 2; i < noise.size(); i++) {
+                noiseStep = std::max(noiseStep, fabs((double) noise[i] - 2 * noise[i - 1] + noise[i - 2]));
+            }
+        }
+        const double click = 1.2 * (toneStep + noiseStep);
+        bool ok = true;
+
+        struct Event {
+            int frame;
+            int ms;                 // of audio arriving, -1 to cancel what is queued
+        };
+        struct Case {
+            const char* name;
+            std::vector<Event> events;
+            int frames;
+        };
+        const Case cases[] = {
+            {"late chunk, then the end", {{0, 510}, {30, 490}}, 100},
+            {"cancelled while playing", {{0, 1000}, {20, -1}}, 60},
+        };
+        printf("comfort: clicks are second differences over %.0f, the 310 Hz tone's own %.0f and the noise's %.0f\n",
+               click, toneStep, noiseStep);
+        for (const auto& c : cases) {
+            for (bool cn : {false, true}) {
+                PlaybackQueue queue((size_t) rate * sizeof(int16_t) * 10);
+                ComfortNoise comfort(rate, 1, BENCH_COMFORT_LEVEL, BENCH_COMFORT_HANGOVER);
+                std::vector<int16_t> line, f(frame);
+                uint64_t n = 0;
+                size_t next = 0;
+                int noiseFrames = 0;
+                double noiseEnergy = 0;
+                size_t noiseSamples = 0;
+
+                for (int i = 0; i < c.frames; i++) {
+                    for (; next < c.events.size() && c.events[next].frame == i; next++) {
+                        if (c.events[next].ms < 0) {
+                            queue.clear();
+                            continue;
+                        }
+                        std::vector<int16_t> audio((size_t) rate * c.events[next].ms / 1000);
+                        for (auto& s : audio) s = (int16_t) (amplitude * sin(2 * M_PI * 310 * n++ / rate));
+                        queue.write("a", 0, false, (const uint8_t*) audio.data(), audio.size() * sizeof(int16_t));
+                    }
+                    // as stream_play_frame: the call's own audio, silence here, when nothing replaces it
+                    std::fill(f.begin(), f.end(), 0);
+                    if (queue.inuse()) {
+                        const size_t got = queue.read((uint8_t*) f.data(), frame * sizeof(int16_t)) / sizeof(int16_t);
+                        if (cn) comfort.audio(f.data(), got, frame, queue.inuse() == 0);
+                    } else if (cn && comfort.gap(f.data(), frame)) {
+                        // the first frame of a gap fades in to it
+                        if (noiseFrames++) {
+                            for (int16_t s : f) noiseEnergy += (double) s * s;
+                            noiseSamples += frame;
+                        }
+                    }
+                    line.insert(line.end(), f.begin(), f.end());
+                }
+
+                int clicks = 0;
+                double maxStep = 0;
+                for (size_t i = 2; i < line.size(); i++) {
+                    const double d = fabs((double) line[i] - 2 * line[i - 1] + line[i - 2]);
+                    maxStep = std::max(maxStep, d);
+                    clicks += d > click;
+                }
+                printf("  %-28s %s: max second difference %5.0f, clicks %3d", c.name, cn ? "comfort" : "plain  ", maxStep, clicks);
+                if (noiseSamples) {
+                    const double db = 10 * log10(noiseEnergy / noiseSamples / (32768.0 * 32768.0));
+                    printf(", %d noise frames at %.1f dBFS", noiseFrames, db);
+                    ok = ok && fabs(db - BENCH_COMFORT_LEVEL) < 3;
+                }
+                printf("\n");
+                if (cn) ok = ok && clicks == 0 && noiseFrames * BENCH_FRAME_MS <= BENCH_COMFORT_HANGOVER * 2;
+            }
+        }
+        return ok;
+    }
+
+    struct Bench {
+        const char* name;
+        bool (*run)(const Options& opt);
+    };
+
+    const Bench benches[] = {
+        {"alloc", bench_alloc},
+        {"stretch", bench_stretch},
+        {"echo", bench_echo},
+        {"bargein", bench_bargein},
+        {"comfort", bench_comfort},
+    };
+}
+
+static void usage(const char* prog) {
+    fprintf(stderr, "usage: %s [-r call rate] [-t tts rate] [-l dBFS] [-m ms] [-f caller.wav] [bench...]\n", prog);
+    fprintf(stderr, "benches:");
+    for (const auto& bench : benches) fprintf(stderr, " %s", bench.name);
+    fprintf(stderr, ", all of them when none is given\n");
+}
+
+int main(int argc, char* argv[]) {
+    Options opt;
+    int c;
+    while ((c = getopt(argc, argv, "r:t:l:m:f:h")) != -1) {
+        switch (c) {
+            case 'r':
+                opt.rate = atoi(optarg);
+                break;
+            case 't':
+                opt.ttsRate = atoi(optarg);
+                break;
+            case 'l':
+                opt.bargeInLevel = atoi(optarg);
+                break;
+            case 'm':
+                opt.bargeInMs = atoi(optarg);
+                break;
+            case 'f':
+                opt.sample = optarg;
+                break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+    if (opt.rate <= 0 || opt.rate % 8000 != 0 || opt.ttsRate <= 0 || opt.bargeInMs <= 0) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    for (int i = optind; i < argc; i++) {
+        bool known = false;
+        for (const auto& bench : benches) known = known || !strcmp(argv[i], bench.name);
+        if (!known) {
+            fprintf(stderr, "no bench named %s\n", argv[i]);
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    int failed = 0;
+    for (const auto& bench : benches) {
+        bool wanted = optind == argc;
+        for (int i = optind; i < argc; i++) wanted = wanted || !strcmp(argv[i], bench.name);
+        if (!wanted) continue;
+        if (!bench.run(opt)) {
+            printf("%s: FAILED\n", bench.name);
+            failed++;
+        }
+    }
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,100 @@
+#include <cmath>
+#include <algorithm>
+#include "stream_comfort.h"
+
+#define COMFORT_LOWPASS     (0.5f)  // one pole, takes the hiss off white noise
+
+ComfortNoise::ComfortNoise(int rate, int channels, int levelDb, int hangoverMs)
+    : m_channels(std::min(channels, 2)), m_fade(rate / 200), m_hangover((size_t) hangoverMs * rate / 1000) {
+    // uniform noise has an RMS of 1/sqrt(3), the low pass keeps sqrt(a / (2 - a)) of it
+    const double rms = 32768.0 * pow(10.0, levelDb / 20.0);
+    m_amplitude = (float) (rms * sqrt(3.0) / sqrt(COMFORT_LOWPASS / (2 - COMFORT_LOWPASS)));
+}
+
+float ComfortNoise::next() {
+    m_seed ^= m_seed << 13;
+    m_seed ^= m_seed >> 17;
+    m_seed ^= m_seed << 5;
+    const float white = (int32_t) m_seed / 2147483648.0f;
+    m_lowpass += COMFORT_LOWPASS * (white - m_lowpass);
+    return m_lowpass * m_amplitude;
+}
+
+void ComfortNoise::noise(int16_t* out, size_t from, size_t to) {
+    for (size_t f = from; f < to; f++) {
+        const int16_t v = (int16_t) next();
+        for (int c = 0; c < m_channels; c++) out[f * m_channels + c] = v;
+    }
+}
+
+void ComfortNoise::audio(int16_t* out, size_t got, size_t frames, bool last) {
+    m_started = true;
+    if (m_inGap) {
+        const size_t n = std::min(m_fade, got);
+        for (size_t f = 0; f < n; f++) {
+            const float k = (float) f / n;
+            const float v = next();
+            for (int c = 0; c < m_channels; c++) {
+                int16_t& s = out[f * m_channels + c];
+                s = (int16_t) (s * k + v * (1 - k));
+            }
+        }
+    }
+
+    if (got < frames || last) {
+        const size_t n = std::min(m_fade, got);
+        for (size_t f = got - n; f < got; f++) {
+            const float k = (float) (got - f) / (n + 1);
+            const float v = next();
+            for (int c = 0; c < m_channels; c++) {
+                int16_t& s = out[f * m_channels + c];
+                s = (int16_t) (s * k + v * (1 - k));
+            }
+        }
+        noise(out, got, frames);
+        m_faded = true;
+        m_inGap = true;
+        m_gapFrames = frames - got;
+        return;
+    }
+    for (int c = 0; c < m_channels; c++) {
+        m_last[c] = out[(frames - 1) * m_channels + c];
+        m_slope[c] = frames > 1 ? m_last[c] - out[(frames - 2) * m_channels + c] : 0;
+    }
+    m_faded = false;
+    m_inGap = false;
+    m_gapFrames = 0;
+}
+
+bool ComfortNoise::gap(int16_t* out, size_t frames) {
+    m_inGap = true;
+    if (!m_started || m_gapFrames >= m_hangover) return false;
+
+    noise(out, 0, frames);
+    if (!m_faded) {
+        // the audio was cut without a fade: carry on from its last sample and slope, the
+        // slope decaying over 1 ms, and bring both down with a raised cosine so neither jumps,
+        // at the cut or where the fade ends
+        const size_t n = std::min(m_fade, frames);
+        const float tau = m_fade / 5.0f;
+        for (size_t f = 0; f < n; f++) {
+            const float t = f + 1.0f;
+            const float k = 0.5f + 0.5f * (float) cos(M_PI * t / (n + 1));
+            const float d = t * (float) exp(-t / tau);
+            for (int c = 0; c < m_channels; c++) {
+                int16_t& s = out[f * m_channels + c];
+                s = (int16_t) std::max(-32768.0f, std::min(32767.0f, s + (m_last[c] + m_slope[c] * d) * k));
+            }
+        }
+        m_faded = true;
+    }
+    if (m_gapFrames + frames >= m_hangover) {
+        // the last of it, down to nothing for the call's own audio
+        for (size_t f = 0; f < frames; f++) {
+            const float k = 1 - (float) (f + 1) / frames;
+            for (int c = 0; c < m_channels; c++) out[f * m_channels + c] = (int16_t) (out[f * m_channels + c] * k);
+        }
+    }
+    m_gapFrames += frames;
+    return true;
+}
@@ -0,0 +1,46 @@
+#ifndef STREAM_COMFORT_H
+#define STREAM_COMFORT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Smooths the edges of played audio: when the queue runs dry the frame is filled with low
+ * level noise rather than digital silence, for up to a hangover, so a late chunk of the same
+ * utterance joins in without the caller noticing the hole.
+ *
+ * Audio fades into the noise over 5 ms when the queue runs dry, and back out of it when
+ * audio comes again; audio cut short without warning (cancelled, paused) decays from its
+ * last sample and slope instead. At the end of the hangover the noise fades to nothing and
+ * the call's own audio takes over again.
+ */
+class ComfortNoise {
+public:
+    ComfortNoise(int rate, int channels, int levelDb, int hangoverMs);
+
+    // frames of interleaved audio are wanted in out, got of them were read; fades them in
+    // after a gap, and out into noise filling the rest when the queue ran dry or is empty
+    // now (last)
+    void audio(int16_t* out, size_t got, size_t frames, bool last);
+    // nothing to play: fills out with noise within the hangover, false once it is over
+    bool gap(int16_t* out, size_t frames);
+
+private:
+    float next();
+    void noise(int16_t* out, size_t from, size_t to);
+
+    const int m_channels;
+    const size_t m_fade;            // frames, 5 ms
+    const size_t m_hangover;        // frames
+    float m_amplitude;
+    uint32_t m_seed = 0x9e3779b9;
+    float m_lowpass = 0;
+    int16_t m_last[2] = {0, 0};     // last audio output per channel, for a cut
+    float m_slope[2] = {0, 0};      // and how it was moving
+    size_t m_gapFrames = 0;         // of noise since the audio stopped
+    bool m_started = false;         // anything played yet
+    bool m_faded = true;            // the audio before the gap faded out already
+    bool m_inGap = false;
+};
+
+#endif //STREAM_COMFORT_H
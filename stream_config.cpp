@@ -0,0 +1,360 @@
+#include <mutex>
+#include <unordered_map>
+#include <climits>
+#include <cstdlib>
+#include "mod_audio_stream.h"
+#include "stream_config.h"
+
+#define CONFIG_FILE     "audio_stream.conf"
+#define DEFAULT_PROFILE "default"
+
+namespace {
+
+    typedef std::unordered_map<std::string, StreamProfile> ProfileMap;
+
+    bool parse_int(const char* value, int& out) {
+        char* endptr;
+        long parsed = strtol(value, &endptr, 10);
+        if (endptr == value || *endptr != '\0' || parsed > INT_MAX || parsed < INT_MIN) return false;
+        out = (int) parsed;
+        return true;
+    }
+
+    bool parse_positive(const char* value, int& out) {
+        int parsed;
+        if (!parse_int(value, parsed) || parsed <= 0) return false;
+        out = parsed;
+        return true;
+    }
+
+    bool parse_non_negative(const char* value, int& out) {
+        int parsed;
+        if (!parse_int(value, parsed) || parsed < 0) return false;
+        out = parsed;
+        return true;
+    }
+
+    void set_header(StreamSettings& s, const char* name, const char* value) {
+        s.transport.headers.set(name, value);
+        s.transport.headerFields[name] = value;
+    }
+
+    // a JSON object of header names and values, added to the headers already set
+    bool parse_headers(StreamSettings& s, const char* value) {
+        cJSON* json = cJSON_Parse(value);
+        if (!json) return false;
+        for (cJSON* it = json->child; it; it = it->next) {
+            if (it->type == cJSON_String && it->valuestring != nullptr) {
+                set_header(s, it->string, it->valuestring);
+            }
+        }
+        cJSON_Delete(json);
+        if (!s.transport.extraHeaders.empty()) s.transport.extraHeaders.append("\n");
+        s.transport.extraHeaders.append(value);
+        return true;
+    }
+
+    /*
+     * Everything a profile param or a channel variable can set. Channel variables keep their
+     * historical names and meaning, so a variable only set to disable a feature (say
+     * STREAM_NO_RECONNECT=false) leaves the profile alone.
+     */
+    struct Option {
+        const char* param;          // in audio_stream.conf.xml, null when channel only
+        const char* variable;       // channel variable, null when profile only
+        bool (*apply)(StreamSettings& s, const char* value);
+    };
+
+    const Option options[] = {
+        {"endpoint", nullptr, [](StreamSettings& s, const char* v) {
+            if (!strncmp(v, "profile:", 8)) return false;
+            s.endpoints = v;
+            return true;
+        }},
+        {"sample-rate", nullptr, [](StreamSettings& s, const char* v) {
+            int rate;
+            if (!parse_positive(v, rate) || rate % 8000 != 0) return false;
+            s.sampling = rate;
+            return true;
+        }},
+        {"lb-policy", "STREAM_LB_POLICY", [](StreamSettings& s, const char* v) {
+            s.policy = endpoint_policy(v);
+            return true;
+        }},
+        {"message-deflate", "STREAM_MESSAGE_DEFLATE", [](StreamSettings& s, const char* v) {
+            s.transport.disableDeflate = switch_true(v);
+            return true;
+        }},
+        {"heart-beat", "STREAM_HEART_BEAT", [](StreamSettings& s, const char* v) {
+            return parse_int(v, s.transport.heartBeat);
+        }},
+        {"buffer-size", "STREAM_BUFFER_SIZE", [](StreamSettings& s, const char* v) {
+            int ms;
+            if (!parse_positive(v, ms) || ms % 20 != 0) return false;
+            s.rtpPackets = ms / 20;
+            return true;
+        }},
+        {"suppress-log", "STREAM_SUPPRESS_LOG", [](StreamSettings& s, const char* v) {
+            s.suppressLog = switch_true(v);
+            return true;
+        }},
+        {"extra-headers", "STREAM_EXTRA_HEADERS", parse_headers},
+        {"tls-ca-file", "STREAM_TLS_CA_FILE", [](StreamSettings& s, const char* v) {
+            s.transport.tls.caFile = v;
+            return true;
+        }},
+        {"tls-key-file", "STREAM_TLS_KEY_FILE", [](StreamSettings& s, const char* v) {
+            s.transport.tls.keyFile = v;
+            return true;
+        }},
+        {"tls-cert-file", "STREAM_TLS_CERT_FILE", [](StreamSettings& s, const char* v) {
+            s.transport.tls.certFile = v;
+            return true;
+        }},
+        {"tls-disable-hostname-validation", "STREAM_TLS_DISABLE_HOSTNAME_VALIDATION", [](StreamSettings& s, const char* v) {
+            s.transport.tls.disableHostnameValidation = switch_true(v);
+            return true;
+        }},
+        {"multiplex", "STREAM_MULTIPLEX", [](StreamSettings& s, const char* v) {
+            s.transport.multiplex = switch_true(v);
+            return true;
+        }},
+        {"multiplex-connections", "STREAM_MULTIPLEX_CONNECTIONS", [](StreamSettings& s, const char* v) {
+            return parse_positive(v, s.transport.muxConnections);
+        }},
+        {"multiplex-streams", "STREAM_MULTIPLEX_STREAMS", [](StreamSettings& s, const char* v) {
+            return parse_positive(v, s.transport.muxStreams);
+        }},
+        {"pool-size", "STREAM_POOL_SIZE", [](StreamSettings& s, const char* v) {
+            return parse_positive(v, s.transport.poolSize);
+        }},
+        {"event-loop", "STREAM_EVENT_LOOP", [](StreamSettings& s, const char* v) {
+            s.transport.eventLoop = switch_true(v);
+            return true;
+        }},
+        {"reconnect-attempts", "STREAM_RECONNECT_ATTEMPTS", [](StreamSettings& s, const char* v) {
+            return parse_non_negative(v, s.reconnectAttempts);
+        }},
+        // after the attempts, it wins over them
+        {nullptr, "STREAM_NO_RECONNECT", [](StreamSettings& s, const char* v) {
+            if (switch_true(v)) s.reconnectAttempts = 0;
+            return true;
+        }},
+        {"replay-buffer-ms", "STREAM_REPLAY_BUFFER_MS", [](StreamSettings& s, const char* v) {
+            return parse_non_negative(v, s.replayMs);
+        }},
+        {"setup-timeout-ms", "STREAM_SETUP_TIMEOUT_MS", [](StreamSettings& s, const char* v) {
+            return parse_positive(v, s.setupTimeoutMs);
+        }},
+        // STREAM_DRAIN_TIMEOUT_MS is read when the drain starts
+        {"drain-timeout-ms", nullptr, [](StreamSettings& s, const char* v) {
+            return parse_positive(v, s.drainTimeoutMs);
+        }},
+        {"event-bus", "STREAM_EVENT_BUS", [](StreamSettings& s, const char* v) {
+            s.eventBus = !switch_false(v);
+            return true;
+        }},
+        {"record-file", "STREAM_RECORD_FILE", [](StreamSettings& s, const char* v) {
+            s.recordFile = v;
+            return true;
+        }},
+        {"catchup-ms", "STREAM_CATCHUP_MS", [](StreamSettings& s, const char* v) {
+            return parse_non_negative(v, s.catchupMs);
+        }},
+        {"catchup-speedup", "STREAM_CATCHUP_SPEEDUP", [](StreamSettings& s, const char* v) {
+            int percent;
+            if (!parse_non_negative(v, percent) || percent > 50) return false;
+            s.catchupSpeedup = percent;
+            return true;
+        }},
+        {"catchup-slowdown", "STREAM_CATCHUP_SLOWDOWN", [](StreamSettings& s, const char* v) {
+            int percent;
+            if (!parse_non_negative(v, percent) || percent > 50) return false;
+            s.catchupSlowdown = percent;
+            return true;
+        }},
+        {"echo-cancel", "STREAM_ECHO_CANCEL", [](StreamSettings& s, const char* v) {
+            s.echoCancel = switch_true(v);
+            return true;
+        }},
+        {"echo-tail-ms", "STREAM_ECHO_TAIL_MS", [](StreamSettings& s, const char* v) {
+            int ms;
+            if (!parse_positive(v, ms) || ms > 1000) return false;
+            s.echoTailMs = ms;
+            return true;
+        }},
+        {"echo-delay-ms", "STREAM_ECHO_DELAY_MS", [](StreamSettings& s, const char* v) {
+            if (!strcasecmp(v, "auto")) {
+                s.echoDelayMs = -1;
+                return true;
+            }
+            int ms;
+            if (!parse_non_negative(v, ms) || ms > 1000) return false;
+            s.echoDelayMs = ms;
+            return true;
+        }},
+        {"barge-in", "STREAM_BARGE_IN", [](StreamSettings& s, const char* v) {
+            return barge_in_mode(v, s.bargeIn);
+        }},
+        {"barge-in-level", "STREAM_BARGE_IN_LEVEL", [](StreamSettings& s, const char* v) {
+            int db;
+            if (!parse_int(v, db) || db > 0 || db < -90) return false;
+            s.bargeInLevel = db;
+            return true;
+        }},
+        {"barge-in-ms", "STREAM_BARGE_IN_MS", [](StreamSettings& s, const char* v) {
+            return parse_positive(v, s.bargeInMs);
+        }},
+        {"barge-in-duck-db", "STREAM_BARGE_IN_DUCK_DB", [](StreamSettings& s, const char* v) {
+            int db;
+            if (!parse_positive(v, db) || db > 60) return false;
+            s.bargeInDuckDb = db;
+            return true;
+        }},
+        {"comfort-noise", "STREAM_COMFORT_NOISE", [](StreamSettings& s, const char* v) {
+            s.comfortNoise = switch_true(v);
+            return true;
+        }},
+        {"comfort-noise-level", "STREAM_COMFORT_NOISE_LEVEL", [](StreamSettings& s, const char* v) {
+            int db;
+            if (!parse_int(v, db) || db > -20 || db < -90) return false;
+            s.comfortNoiseLevel = db;
+            return true;
+        }},
+        {"comfort-noise-hangover-ms", "STREAM_COMFORT_NOISE_HANGOVER_MS", [](StreamSettings& s, const char* v) {
+            return parse_non_negative(v, s.comfortNoiseHangoverMs);
+        }},
+        {"play-file-per-chunk", "STREAM_PLAY_FILE_PER_CHUNK", [](StreamSettings& s, const char* v) {
+            s.playFilePerChunk = switch_true(v);
+            return true;
+        }},
+    };
+
+    StreamProfile parse_profile(switch_xml_t xprofile, const char* name) {
+        auto s = std::make_shared<StreamSettings>();
+        s->name = name;
+
+        for (switch_xml_t param = switch_xml_child(xprofile, "param"); param; param = switch_xml_next(param)) {
+            const char* var = switch_xml_attr_soft(param, "name");
+            const char* val = switch_xml_attr_soft(param, "value");
+            const Option* option = nullptr;
+            for (const auto& candidate : options) {
+                if (candidate.param && !strcasecmp(candidate.param, var)) {
+                    option = &candidate;
+                    break;
+                }
+            }
+            if (!option) {
+                switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "profile %s: unknown param %s\n", name, var);
+            } else if (!option->apply(*s, val)) {
+                switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "profile %s: ignoring invalid %s value %s\n",
+                                  name, var, val);
+            }
+        }
+
+        // <headers><header name="..." value="..."/></headers>, next to or instead of extra-headers
+        switch_xml_t xheaders = switch_xml_child(xprofile, "headers");
+        for (switch_xml_t header = xheaders ? switch_xml_child(xheaders, "header") : nullptr; header; header = switch_xml_next(header)) {
+            const char* hname = switch_xml_attr(header, "name");
+            const char* hvalue = switch_xml_attr_soft(header, "value");
+            if (zstr(hname)) continue;
+            set_header(*s, hname, hvalue);
+            s->transport.extraHeaders.append(hname).append(": ").append(hvalue).append("\n");
+        }
+        return s;
+    }
+
+    class ProfileTable {
+    public:
+        ProfileTable(): m_profiles(std::make_shared<ProfileMap>()), m_builtin(std::make_shared<StreamSettings>()) {
+            m_builtin->name = DEFAULT_PROFILE;
+        }
+
+        int load() {
+            switch_xml_t cfg, xml = switch_xml_open_cfg(CONFIG_FILE, &cfg, nullptr);
+            if (!xml) {
+                switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_INFO, "%s not found, using the built-in defaults\n", CONFIG_FILE);
+                return -1;
+            }
+
+            auto profiles = std::make_shared<ProfileMap>();
+            switch_xml_t xprofiles = switch_xml_child(cfg, "profiles");
+            for (switch_xml_t xprofile = xprofiles ? switch_xml_child(xprofiles, "profile") : nullptr; xprofile; xprofile = switch_xml_next(xprofile)) {
+                const char* name = switch_xml_attr(xprofile, "name");
+                if (zstr(name)) {
+                    switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "skipping a profile without a name\n");
+                    continue;
+                }
+                (*profiles)[name] = parse_profile(xprofile, name);
+            }
+            switch_xml_free(xml);
+
+            switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_INFO, "loaded %u stream profiles from %s\n",
+                              (unsigned) profiles->size(), CONFIG_FILE);
+            std::lock_guard<std::mutex> guard(m_lock);
+            m_profiles = profiles;
+            return (int) profiles->size();
+        }
+
+        StreamProfile find(const char* name) {
+            std::shared_ptr<const ProfileMap> profiles;
+            {
+                std::lock_guard<std::mutex> guard(m_lock);
+                profiles = m_profiles;
+            }
+            if (zstr(name)) name = DEFAULT_PROFILE;
+            auto it = profiles->find(name);
+            if (it != profiles->end()) return it->second;
+            if (!strcmp(name, DEFAULT_PROFILE)) return m_builtin;
+            return nullptr;
+        }
+
+        void stats(cJSON* root) {
+            std::lock_guard<std::mutex> guard(m_lock);
+            cJSON* names = cJSON_CreateArray();
+            for (const auto& it : *m_profiles) {
+                cJSON_AddItemToArray(names, cJSON_CreateString(it.first.c_str()));
+            }
+            cJSON_AddItemToObject(root, "profiles", names);
+        }
+
+    private:
+        std::mutex m_lock;
+        std::shared_ptr<const ProfileMap> m_profiles;
+        std::shared_ptr<StreamSettings> m_builtin;
+    };
+
+    ProfileTable& profile_table() {
+        static ProfileTable table;
+        return table;
+    }
+}
+
+int config_load() {
+    return profile_table().load();
+}
+
+StreamProfile config_profile(const char* name) {
+    return profile_table().find(name);
+}
+
+StreamProfile config_apply_channel(const StreamProfile& profile, switch_core_session_t* session) {
+    switch_channel_t* channel = switch_core_session_get_channel(session);
+    std::shared_ptr<StreamSettings> own;
+    for (const auto& option : options) {
+        if (!option.variable) continue;
+        const char* value = switch_channel_get_variable(channel, option.variable);
+        if (!value) continue;
+        if (!own) own = std::make_shared<StreamSettings>(*profile);
+        if (!option.apply(*own, value)) {
+            switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_WARNING, "%s: ignoring invalid %s value %s\n",
+                              switch_channel_get_name(channel), option.variable, value);
+        }
+    }
+    if (own) return own;
+    return profile;
+}
+
+void config_stats(cJSON* root) {
+    profile_table().stats(root);
+}
@@ -0,0 +1,66 @@
+#ifndef STREAM_CONFIG_H
+#define STREAM_CONFIG_H
+
+#include <memory>
+#include <string>
+#include <switch.h>
+#include <switch_json.h>
+#include "ws_transport.h"
+#include "ws_endpoints.h"
+#include "stream_bargein.h"
+
+/*
+ * Stream profiles from audio_stream.conf.xml, parsed when the module loads and on reload.
+ *
+ * A profile is immutable once loaded and shared by every call using it. A call starts from
+ * its profile and only gets a copy of its own when a channel variable overrides a value,
+ * so a call without overrides does no parsing at all.
+ */
+
+struct StreamSettings {
+    std::string name;
+    std::string endpoints;          // what profile:<name> streams to, may be empty
+    TransportConfig transport;      // all but the uri, headers already parsed
+    EndpointPolicy policy = ENDPOINT_LEAST_CONNECTIONS;
+    int sampling = 8000;            // when start does not give a rate
+    int rtpPackets = 1;             // 20 ms frames sent per message
+    bool suppressLog = false;
+    int reconnectAttempts = 0;      // a dropped connection ends the stream unless set
+    int replayMs = 1000;
+    int setupTimeoutMs = 10000;
+    int drainTimeoutMs = 5000;
+    bool eventBus = true;
+    std::string recordFile;         // stereo call recording, channel variables expanded, empty for none
+    int catchupMs = 0;              // playback backlog kept by playing faster or slower, 0 for off
+    int catchupSpeedup = 25;        // percent, at most
+    int catchupSlowdown = 10;       // percent, at most
+    bool echoCancel = false;
+    int echoTailMs = 128;           // echo path the filter covers
+    int echoDelayMs = -1;           // playback to echo, before the tail; -1 estimates it
+    BargeInMode bargeIn = BARGE_IN_OFF;
+    int bargeInLevel = -35;         // dBFS the caller's speech must reach
+    int bargeInMs = 160;            // speech needed before playback is stopped
+    int bargeInDuckDb = 20;         // how much quieter playback gets in duck mode
+    bool comfortNoise = false;
+    int comfortNoiseLevel = -60;    // dBFS
+    int comfortNoiseHangoverMs = 300; // longest playback gap filled with it
+    bool playFilePerChunk = false;  // EVENT_PLAY file per message instead of one per session
+};
+
+typedef std::shared_ptr<const StreamSettings> StreamProfile;
+
+// (re)reads audio_stream.conf.xml, returns the number of profiles or -1 when the file
+// cannot be opened, in which case the loaded profiles stay
+int config_load();
+
+// the named profile or nullptr, "default" when name is null or empty; without a default
+// profile in the file this is the built-in defaults
+StreamProfile config_profile(const char* name);
+
+// the profile with the STREAM_* channel variables applied
+StreamProfile config_apply_channel(const StreamProfile& profile, switch_core_session_t* session);
+
+// adds the loaded profile names to a JSON object
+void config_stats(cJSON* root);
+
+#endif //STREAM_CONFIG_H
@@ -0,0 +1,24 @@
+#include "mod_audio_stream.h"
+#include "stream_counters.h"
+#include "stream_metrics.h"
+
+void counters_json(StreamCounters& counters, cJSON* item) {
+#define STREAM_COUNTER_JSON(name, metric) cJSON_AddNumberToObject(item, #name, (double) counters.name.load(std::memory_order_relaxed));
+    STREAM_COUNTERS(STREAM_COUNTER_JSON)
+#undef STREAM_COUNTER_JSON
+    cJSON_AddStringToObject(item, "endpoint", counters.endpoint().c_str());
+}
+
+void counters_json(const CounterTotals& totals, cJSON* item) {
+#define STREAM_COUNTER_JSON(name, metric) cJSON_AddNumberToObject(item, #name, (double) totals.name);
+    STREAM_COUNTERS(STREAM_COUNTER_JSON)
+#undef STREAM_COUNTER_JSON
+}
+
+void counters_prometheus(const std::map<std::string, CounterTotals>& byEndpoint, std::string& out) {
+#define STREAM_COUNTER_PROMETHEUS(name, metric) \
+    metrics_family(out, metric "_total", "counter"); \
+    for (const auto& it : byEndpoint) metrics_sample(out, metric "_total", it.first, (double) it.second.name);
+    STREAM_COUNTERS(STREAM_COUNTER_PROMETHEUS)
+#undef STREAM_COUNTER_PROMETHEUS
+}
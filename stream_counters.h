@@ -0,0 +1,87 @@
+#ifndef STREAM_COUNTERS_H
+#define STREAM_COUNTERS_H
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <map>
+#include <stdint.h>
+#include <switch_json.h>
+
+/*
+ * Per session counters, updated without locks from the media thread (uplink, playback) and
+ * the websocket thread (messages). The stream registry keeps them for the lifetime of the
+ * media bug and adds them up by endpoint, see stream_registry.h.
+ */
+
+// name, metric name
+#define STREAM_COUNTERS(X) \
+    X(uplinkFrames,   "uplink_frames")            /* frames read from the media bug */ \
+    X(uplinkBytes,    "uplink_bytes")             /* audio bytes sent to the server */ \
+    X(trylockMisses,  "uplink_trylock_misses")    /* frames skipped because the session was busy */ \
+    X(uplinkDrops,    "uplink_dropped_frames")    /* frames dropped, no room in the send buffer */ \
+    X(messages,       "messages")                 /* messages received */ \
+    X(downlinkChunks, "downlink_chunks")          /* streamAudio messages */ \
+    X(downlinkBytes,  "downlink_bytes")           /* audio bytes queued for playback */ \
+    X(playFrames,     "playback_frames")          /* frames injected into the call */ \
+    X(underruns,      "playback_underruns")       /* playback ran out mid-stream */ \
+    X(overruns,       "playback_overruns")        /* audio dropped, play buffer full */ \
+    X(bargeIns,       "playback_barge_ins")       /* playback paused or ducked by the caller talking */ \
+    X(resampleUsec,   "resample_microseconds")    /* time spent resampling, both directions */ \
+    X(echoUsec,       "echo_cancel_microseconds") /* time spent removing the playback echo from the uplink */ \
+    X(connects,       "websocket_opens")          /* connections opened, including reconnects */ \
+    X(connectUsec,    "websocket_open_microseconds") /* time spent opening them, over connects gives the average */
+
+struct StreamCounters {
+#define STREAM_COUNTER_FIELD(name, metric) std::atomic<uint64_t> name{0};
+    STREAM_COUNTERS(STREAM_COUNTER_FIELD)
+#undef STREAM_COUNTER_FIELD
+
+    bool playing = false;   // media thread only, a frame was injected last time
+
+    void add(std::atomic<uint64_t>& counter, uint64_t n = 1) {
+        counter.fetch_add(n, std::memory_order_relaxed);
+    }
+
+    void setEndpoint(const std::string& uri) {
+        std::lock_guard<std::mutex> guard(m_lock);
+        m_endpoint = uri;
+    }
+
+    std::string endpoint() {
+        std::lock_guard<std::mutex> guard(m_lock);
+        return m_endpoint;
+    }
+
+private:
+    std::mutex m_lock;
+    std::string m_endpoint;
+};
+
+// a sum of counters, e.g. of the streams of one endpoint
+struct CounterTotals {
+#define STREAM_COUNTER_TOTAL(name, metric) uint64_t name = 0;
+    STREAM_COUNTERS(STREAM_COUNTER_TOTAL)
+#undef STREAM_COUNTER_TOTAL
+
+    void add(const StreamCounters& c) {
+#define STREAM_COUNTER_ADD(name, metric) name += c.name.load(std::memory_order_relaxed);
+        STREAM_COUNTERS(STREAM_COUNTER_ADD)
+#undef STREAM_COUNTER_ADD
+    }
+
+    void add(const CounterTotals& t) {
+#define STREAM_COUNTER_ADD(name, metric) name += t.name;
+        STREAM_COUNTERS(STREAM_COUNTER_ADD)
+#undef STREAM_COUNTER_ADD
+    }
+};
+
+// adds the counters of one session to a JSON object
+void counters_json(StreamCounters& counters, cJSON* item);
+void counters_json(const CounterTotals& totals, cJSON* item);
+// appends one family per counter in Prometheus text format
+void counters_prometheus(const std::map<std::string, CounterTotals>& byEndpoint, std::string& out);
+
+#endif //STREAM_COUNTERS_H
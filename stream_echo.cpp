@@ -0,0 +1,168 @@
+#include <cmath>
+#include <algorithm>
+#include "stream_echo.h"
+
+#define ECHO_HISTORY_MS         (2500)  // played audio kept, covers the estimate window and delay
+#define ECHO_GAP_MS             (100)   // a side further behind its time than this is padded
+#define ECHO_MAX_DELAY_MS       (500)   // longest delay estimate() looks for
+#define ECHO_WINDOW_MS          (1500)  // captured audio estimate() compares
+#define ECHO_ESTIMATE_MS        (1000)  // how often it does
+#define ECHO_MIN_CORRELATION    (0.5)   // envelope correlation needed to move the delay
+#define ECHO_SILENCE            (32)    // played samples under this do not echo
+
+EchoCanceller::EchoCanceller(int rate, int tailMs, int delayMs)
+    : m_rate(rate), m_block(rate / 100),
+      m_tail(std::max<size_t>(1, (tailMs * rate / 1000 + m_block - 1) / m_block) * m_block),
+      m_auto(delayMs < 0), m_delay(delayMs < 0 ? 0 : (size_t) delayMs * rate / 1000),
+      m_start(switch_micro_time_now()), m_ref((size_t) rate * ECHO_HISTORY_MS / 1000, 0),
+      m_in(m_block), m_play(m_block), m_out(m_block) {
+    m_echo = speex_echo_state_init(m_block, m_tail);
+    speex_echo_ctl(m_echo, SPEEX_ECHO_SET_SAMPLING_RATE, &rate);
+    // only the residual echo suppression, the caller's audio is otherwise left to the server
+    m_suppress = speex_preprocess_state_init(m_block, rate);
+    int off = 0;
+    speex_preprocess_ctl(m_suppress, SPEEX_PREPROCESS_SET_DENOISE, &off);
+    speex_preprocess_ctl(m_suppress, SPEEX_PREPROCESS_SET_ECHO_STATE, m_echo);
+}
+
+EchoCanceller::~EchoCanceller() {
+    speex_preprocess_state_destroy(m_suppress);
+    speex_echo_state_destroy(m_echo);
+}
+
+// where frames handed over at when go on a side that ends at end: right after it, unless
+// that side was not fed for a while
+uint64_t EchoCanceller::place(uint64_t end, size_t frames, switch_time_t when) const {
+    const int64_t pos = (when - m_start) * m_rate / 1000000 - (int64_t) frames;
+    if (pos > (int64_t) (end + m_rate * ECHO_GAP_MS / 1000)) return pos;
+    return end;
+}
+
+int16_t EchoCanceller::reference(uint64_t pos) const {
+    if (pos >= m_refEnd || m_refEnd - pos > m_ref.size()) return 0;
+    return m_ref[pos % m_ref.size()];
+}
+
+void EchoCanceller::playback(const int16_t* samples, size_t frames, int channels, switch_time_t when) {
+    std::lock_guard<std::mutex> guard(m_lock);
+    const uint64_t start = place(m_refEnd, frames, when);
+    for (uint64_t p = std::max(m_refEnd, start > m_ref.size() ? start - m_ref.size() : 0); p < start; p++) {
+        m_ref[p % m_ref.size()] = 0;
+    }
+    for (size_t i = 0; i < frames; i++) {
+        const int16_t s = samples ? samples[i * channels] : 0;
+        m_ref[(start + i) % m_ref.size()] = s;
+        if (s > ECHO_SILENCE || s < -ECHO_SILENCE) m_refActive = start + i + 1;
+    }
+    m_refEnd = start + frames;
+}
+
+void EchoCanceller::capture(int16_t* samples, size_t frames, int channels, switch_time_t when) {
+    std::lock_guard<std::mutex> guard(m_lock);
+    uint64_t pos = place(m_capEnd, frames, when);
+    const size_t window = ECHO_WINDOW_MS / 10;
+
+    size_t i = 0;
+    for (; i + m_block <= frames; i += m_block, pos += m_block) {
+        int16_t* x = samples + i * channels;
+        uint64_t level = 0;
+        for (size_t k = 0; k < m_block; k++) {
+            m_in[k] = x[k * channels];
+            level += m_in[k] < 0 ? -(int32_t) m_in[k] : m_in[k];
+        }
+        if (m_auto) {
+            m_capLevels.push_back({pos, (float) level / m_block});
+            if (m_capLevels.size() > window) m_capLevels.erase(m_capLevels.begin());
+            if (++m_sinceEstimate >= ECHO_ESTIMATE_MS / 10) {
+                m_sinceEstimate = 0;
+                estimate();
+            }
+        }
+
+        // nothing played recently enough to be heard in this block
+        if (!m_refActive || m_refActive + m_delay + m_tail <= pos) {
+            m_skipped++;
+            continue;
+        }
+        for (size_t k = 0; k < m_block; k++) {
+            m_play[k] = pos + k >= m_delay ? reference(pos + k - m_delay) : 0;
+        }
+        speex_echo_cancellation(m_echo, m_in.data(), m_play.data(), m_out.data());
+        speex_preprocess_run(m_suppress, m_out.data());
+        for (size_t k = 0; k < m_block; k++) x[k * channels] = m_out[k];
+        m_blocks++;
+    }
+    // a frame that is not a multiple of 10 ms leaves its end as it is
+    m_capEnd = pos + (frames - i);
+}
+
+// the lag, in blocks, at which the level of the played audio best follows the captured one;
+// the filter starts a quarter of its length before it, so the echo spread is covered
+void EchoCanceller::estimate() {
+    const size_t window = ECHO_WINDOW_MS / 10;
+    const size_t lags = ECHO_MAX_DELAY_MS / 10;
+    if (m_capLevels.size() < window) return;
+
+    double capMean = 0;
+    for (const auto& c : m_capLevels) capMean += c.level;
+    capMean /= window;
+
+    std::vector<float> ref(window);
+    double best = -1;
+    size_t bestLag = 0;
+    for (size_t lag = 0; lag <= lags; lag++) {
+        double refMean = 0;
+        for (size_t j = 0; j < window; j++) {
+            const uint64_t at = m_capLevels[j].pos;
+            uint64_t level = 0;
+            if (at >= lag * m_block) {
+                for (size_t k = 0; k < m_block; k++) {
+                    const int16_t s = reference(at - lag * m_block + k);
+                    level += s < 0 ? -(int32_t) s : s;
+                }
+            }
+            ref[j] = (float) level / m_block;
+            refMean += ref[j];
+        }
+        refMean /= window;
+
+        double cross = 0, capVar = 0, refVar = 0;
+        for (size_t j = 0; j < window; j++) {
+            const double c = m_capLevels[j].level - capMean;
+            const double r = ref[j] - refMean;
+            cross += c * r;
+            capVar += c * c;
+            refVar += r * r;
+        }
+        // nothing played, or nothing captured, in the window: no estimate
+        if (refVar < window || capVar < window) continue;
+        const double corr = cross / sqrt(capVar * refVar);
+        if (corr > best) {
+            best = corr;
+            bestLag = lag;
+        }
+    }
+    if (best < 0) return;
+    m_correlation = best;
+    if (best < ECHO_MIN_CORRELATION) return;
+
+    const size_t lag = bestLag * m_block;
+    const size_t delay = lag > m_tail / 4 ? lag - m_tail / 4 : 0;
+    if (delay + 2 * m_block < m_delay || delay > m_delay + 2 * m_block) {
+        m_delay = delay;
+        // the echo path the filter learned moved with it
+        speex_echo_state_reset(m_echo);
+    }
+}
+
+void EchoCanceller::stats(cJSON* root) {
+    std::lock_guard<std::mutex> guard(m_lock);
+    cJSON* echo = cJSON_CreateObject();
+    cJSON_AddNumberToObject(echo, "tailMs", m_tail * 1000 / m_rate);
+    cJSON_AddNumberToObject(echo, "delayMs", m_delay * 1000 / m_rate);
+    cJSON_AddItemToObject(echo, "estimated", cJSON_CreateBool(m_auto));
+    cJSON_AddNumberToObject(echo, "correlation", m_correlation);
+    cJSON_AddNumberToObject(echo, "blocks", m_blocks);
+    cJSON_AddNumberToObject(echo, "skipped", m_skipped);
+    cJSON_AddItemToObject(root, "echo", echo);
+}
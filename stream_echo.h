@@ -0,0 +1,73 @@
+#ifndef STREAM_ECHO_H
+#define STREAM_ECHO_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <mutex>
+#include <vector>
+#include <switch.h>
+#include <switch_json.h>
+#include <speex/speex_echo.h>
+#include <speex/speex_preprocess.h>
+
+/*
+ * Removes the audio we play to the caller from what we stream up, with the SpeexDSP echo
+ * canceller and its residual echo suppressor, in 10 ms blocks at the stream rate.
+ *
+ * The played frames are the reference. Both sides are placed on one timeline by the time
+ * they were handed to us, like the call recording; the reference is then read delayMs
+ * behind the captured audio, and the filter covers tailMs from there. With a delay of -1
+ * it is estimated every second from the 10 ms energy envelopes of the two sides, up to
+ * 500 ms. While nothing was played within the tail the uplink is left as it is.
+ */
+class EchoCanceller {
+public:
+    EchoCanceller(int rate, int tailMs, int delayMs);
+    ~EchoCanceller();
+
+    EchoCanceller(const EchoCanceller&) = delete;
+    EchoCanceller& operator=(const EchoCanceller&) = delete;
+
+    // the first of channels interleaved channels was played, silence when samples is null;
+    // when is the time the last sample was played
+    void playback(const int16_t* samples, size_t frames, int channels, switch_time_t when);
+    // removes the echo from the first of channels interleaved channels, in place
+    void capture(int16_t* samples, size_t frames, int channels, switch_time_t when);
+
+    // adds {tailMs, delayMs, estimated, correlation, blocks, skipped} to a JSON object
+    void stats(cJSON* root);
+
+private:
+    struct Level {
+        uint64_t pos;
+        float level;
+    };
+
+    uint64_t place(uint64_t end, size_t frames, switch_time_t when) const;
+    int16_t reference(uint64_t pos) const;
+    void estimate();
+
+    std::mutex m_lock;
+    SpeexEchoState* m_echo;
+    SpeexPreprocessState* m_suppress;
+    const int m_rate;
+    const size_t m_block;
+    const size_t m_tail;
+    const bool m_auto;
+    size_t m_delay;                     // samples
+    const switch_time_t m_start;
+
+    std::vector<int16_t> m_ref;         // played audio, sample at p in m_ref[p % size]
+    uint64_t m_refEnd = 0;
+    uint64_t m_refActive = 0;           // end of the last played audio that was not silence
+    uint64_t m_capEnd = 0;
+
+    std::vector<Level> m_capLevels;     // of the last captured blocks, for estimate()
+    std::vector<int16_t> m_in, m_play, m_out;
+    size_t m_sinceEstimate = 0;         // blocks
+    double m_correlation = 0;           // of the last estimate taken
+    uint64_t m_blocks = 0;
+    uint64_t m_skipped = 0;
+};
+
+#endif //STREAM_ECHO_H
@@ -0,0 +1,212 @@
+#include <atomic>
+#include <mutex>
+#include <map>
+#include <memory>
+#include "mod_audio_stream.h"
+#include "stream_latency.h"
+#include "stream_metrics.h"
+
+#define LATENCY_SUB_BITS   (4)
+#define LATENCY_SUB_COUNT  (1 << LATENCY_SUB_BITS)
+#define LATENCY_MAX_EXP    (40)     // ~12 days in microseconds, larger values are clamped
+#define LATENCY_BUCKETS    (LATENCY_SUB_COUNT + (LATENCY_MAX_EXP - LATENCY_SUB_BITS + 1) * LATENCY_SUB_COUNT)
+
+namespace {
+
+    const char* const metric_names[LATENCY_METRICS] = { "connect", "firstMessage", "turn" };
+    const char* const prometheus_names[LATENCY_METRICS] = {
+        "connect_latency_seconds", "first_message_latency_seconds", "turn_latency_seconds"
+    };
+    // Prometheus bucket bounds in seconds
+    const double prometheus_bounds[] = { 0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10 };
+
+    // smallest value counted in bucket i
+    uint64_t lower_bound(int i) {
+        if (i < LATENCY_SUB_COUNT) return (uint64_t) i;
+        const int exp = (i - LATENCY_SUB_COUNT) / LATENCY_SUB_COUNT + LATENCY_SUB_BITS;
+        const uint64_t sub = (uint64_t) ((i - LATENCY_SUB_COUNT) % LATENCY_SUB_COUNT);
+        return (LATENCY_SUB_COUNT + sub) << (exp - LATENCY_SUB_BITS);
+    }
+
+    int bucket_index(uint64_t value) {
+        if (value < LATENCY_SUB_COUNT) return (int) value;
+        int exp = 63 - __builtin_clzll(value);
+        if (exp > LATENCY_MAX_EXP) return LATENCY_BUCKETS - 1;
+        const int sub = (int) (value >> (exp - LATENCY_SUB_BITS)) & (LATENCY_SUB_COUNT - 1);
+        return LATENCY_SUB_COUNT + (exp - LATENCY_SUB_BITS) * LATENCY_SUB_COUNT + sub;
+    }
+
+    // a point in time copy, histograms of several endpoints merge into one
+    struct Snapshot {
+        uint64_t counts[LATENCY_BUCKETS] = {};
+        uint64_t total = 0;
+        uint64_t sum = 0;
+        uint64_t min = UINT64_MAX;
+        uint64_t max = 0;
+
+        // count, min, max, mean and percentiles in milliseconds
+        cJSON* summary() const {
+            cJSON* item = cJSON_CreateObject();
+            cJSON_AddNumberToObject(item, "count", (double) total);
+            if (!total) return item;
+
+            cJSON_AddNumberToObject(item, "minMs", min / 1000.0);
+            cJSON_AddNumberToObject(item, "maxMs", max / 1000.0);
+            cJSON_AddNumberToObject(item, "meanMs", (double) sum / total / 1000.0);
+
+            static const struct { const char* name; double q; } percentiles[] = {
+                {"p50Ms", 0.50}, {"p90Ms", 0.90}, {"p99Ms", 0.99}, {"p999Ms", 0.999}
+            };
+            for (const auto& p : percentiles) {
+                const uint64_t rank = (uint64_t) (p.q * (total - 1)) + 1;
+                uint64_t seen = 0;
+                int i = 0;
+                for (; i < LATENCY_BUCKETS - 1; i++) {
+                    seen += counts[i];
+                    if (seen >= rank) break;
+                }
+                // middle of the bucket, never past the largest value recorded
+                double value = (lower_bound(i) + lower_bound(i + 1) - 1) / 2.0;
+                if (value > max) value = max;
+                cJSON_AddNumberToObject(item, p.name, value / 1000.0);
+            }
+            return item;
+        }
+
+        // a bucket counts towards a bound when all its values are within it
+        void prometheus(std::string& out, const char* name, const std::string& endpoint) const {
+            const std::string bucket = std::string(name) + "_bucket";
+            uint64_t cumulative = 0;
+            int i = 0;
+            for (double bound : prometheus_bounds) {
+                const uint64_t usec = (uint64_t) (bound * 1000000);
+                for (; i < LATENCY_BUCKETS && lower_bound(i + 1) - 1 <= usec; i++) cumulative += counts[i];
+                char le[32];
+                switch_snprintf(le, sizeof(le), "%g", bound);
+                metrics_sample(out, bucket.c_str(), endpoint, (double) cumulative, le);
+            }
+            metrics_sample(out, bucket.c_str(), endpoint, (double) total, "+Inf");
+            metrics_sample(out, (std::string(name) + "_sum").c_str(), endpoint, sum / 1000000.0);
+            metrics_sample(out, (std::string(name) + "_count").c_str(), endpoint, (double) total);
+        }
+    };
+
+    class LatencyHistogram {
+    public:
+        void record(int64_t usec) {
+            uint64_t value = usec > 0 ? (uint64_t) usec : 0;
+            m_buckets[bucket_index(value)].fetch_add(1, std::memory_order_relaxed);
+            m_sum.fetch_add(value, std::memory_order_relaxed);
+            uint64_t seen = m_max.load(std::memory_order_relaxed);
+            while (value > seen && !m_max.compare_exchange_weak(seen, value, std::memory_order_relaxed)) {}
+            seen = m_min.load(std::memory_order_relaxed);
+            while (value < seen && !m_min.compare_exchange_weak(seen, value, std::memory_order_relaxed)) {}
+        }
+
+        void reset() {
+            for (auto& bucket : m_buckets) bucket.store(0, std::memory_order_relaxed);
+            m_sum = 0;
+            m_max = 0;
+            m_min = UINT64_MAX;
+        }
+
+        void addTo(Snapshot& snap) const {
+            for (int i = 0; i < LATENCY_BUCKETS; i++) {
+                const uint64_t n = m_buckets[i].load(std::memory_order_relaxed);
+                snap.counts[i] += n;
+                snap.total += n;
+            }
+            snap.sum += m_sum.load(std::memory_order_relaxed);
+            snap.min = std::min(snap.min, m_min.load(std::memory_order_relaxed));
+            snap.max = std::max(snap.max, m_max.load(std::memory_order_relaxed));
+        }
+
+    private:
+        std::atomic<uint64_t> m_buckets[LATENCY_BUCKETS] = {};
+        std::atomic<uint64_t> m_sum{0};
+        std::atomic<uint64_t> m_max{0};
+        std::atomic<uint64_t> m_min{UINT64_MAX};
+    };
+
+    struct EndpointLatency {
+        LatencyHistogram metrics[LATENCY_METRICS];
+    };
+
+    /*
+     * Histograms by endpoint. Entries are never removed (reset only zeroes them), so a
+     * histogram found under the lock can be recorded to after releasing it.
+     */
+    class LatencyTable {
+    public:
+        void record(LatencyMetric metric, const std::string& endpoint, int64_t usec) {
+            EndpointLatency* entry;
+            {
+                std::lock_guard<std::mutex> guard(m_lock);
+                auto& slot = m_endpoints[endpoint];
+                if (!slot) slot.reset(new EndpointLatency());
+                entry = slot.get();
+            }
+            entry->metrics[metric].record(usec);
+        }
+
+        void stats(cJSON* root) {
+            std::unique_ptr<Snapshot[]> snaps(new Snapshot[LATENCY_METRICS]);
+            {
+                std::lock_guard<std::mutex> guard(m_lock);
+                for (const auto& it : m_endpoints) {
+                    for (int i = 0; i < LATENCY_METRICS; i++) it.second->metrics[i].addTo(snaps[i]);
+                }
+            }
+            cJSON* item = cJSON_CreateObject();
+            for (int i = 0; i < LATENCY_METRICS; i++) {
+                cJSON_AddItemToObject(item, metric_names[i], snaps[i].summary());
+            }
+            cJSON_AddItemToObject(root, "latency", item);
+        }
+
+        void prometheus(std::string& out) {
+            std::lock_guard<std::mutex> guard(m_lock);
+            std::unique_ptr<Snapshot> snap(new Snapshot());
+            for (int i = 0; i < LATENCY_METRICS; i++) {
+                metrics_family(out, prometheus_names[i], "histogram");
+                for (const auto& it : m_endpoints) {
+                    *snap = Snapshot();
+                    it.second->metrics[i].addTo(*snap);
+                    snap->prometheus(out, prometheus_names[i], it.first);
+                }
+            }
+        }
+
+        void reset() {
+            std::lock_guard<std::mutex> guard(m_lock);
+            for (const auto& it : m_endpoints) {
+                for (int i = 0; i < LATENCY_METRICS; i++) it.second->metrics[i].reset();
+            }
+        }
+
+    private:
+        std::mutex m_lock;
+        std::map<std::string, std::unique_ptr<EndpointLatency>> m_endpoints;
+    };
+
+    LatencyTable& latency_table() {
+        static LatencyTable instance;
+        return instance;
+    }
+}
+
+void latency_record(LatencyMetric metric, const std::string& endpoint, int64_t usec) {
+    latency_table().record(metric, endpoint, usec);
+}
+
+void latency_stats(cJSON* root) {
+    latency_table().stats(root);
+}
+
+void latency_reset() {
+    latency_table().reset();
+}
+
+void latency_prometheus(std::string& out) {
+    latency_table().prometheus(out);
+}
@@ -0,0 +1,31 @@
+#ifndef STREAM_LATENCY_H
+#define STREAM_LATENCY_H
+
+#include <stdint.h>
+#include <string>
+#include <switch_json.h>
+
+/*
+ * Latency histograms by endpoint, in microseconds.
+ *
+ * Buckets are log-linear (HDR style): 16 linear sub-buckets per power of two, which keeps the
+ * relative error of a reported value under 1/16 from 1 us to hours. Recording only locks to
+ * find the endpoint's histograms, the buckets themselves are atomic.
+ */
+
+enum LatencyMetric {
+    LATENCY_CONNECT,            // start of the stream to its websocket being open
+    LATENCY_FIRST_MESSAGE,      // open to the first message from the server
+    LATENCY_TURN,               // last voiced uplink frame to the first injected playback frame
+    LATENCY_METRICS
+};
+
+void latency_record(LatencyMetric metric, const std::string& endpoint, int64_t usec);
+
+// adds the summaries of all endpoints together to a JSON object
+void latency_stats(cJSON* root);
+void latency_reset();
+// appends the histograms by endpoint in Prometheus text format
+void latency_prometheus(std::string& out);
+
+#endif //STREAM_LATENCY_H
@@ -0,0 +1,139 @@
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <chrono>
+#include <cstdio>
+#include "mod_audio_stream.h"
+#include "stream_metrics.h"
+#include "stream_registry.h"
+#include "stream_latency.h"
+#include "ws_endpoints.h"
+
+#define METRICS_PREFIX            "mod_audio_stream_"
+#define METRICS_DEFAULT_INTERVAL  (15)
+
+namespace {
+
+    void append_label(std::string& out, const char* label, const std::string& value) {
+        out += label;
+        out += "=\"";
+        for (char c : value) {
+            if (c == '\\' || c == '"') out += '\\';
+            if (c == '\n') {
+                out += "\\n";
+                continue;
+            }
+            out += c;
+        }
+        out += '"';
+    }
+
+    class MetricsWriter {
+    public:
+        void start() {
+            char* path = switch_core_get_variable_dup("audio_stream_metrics_file");
+            if (!path) return;
+            m_path = path;
+            free(path);
+
+            char* interval = switch_core_get_variable_dup("audio_stream_metrics_interval");
+            if (interval) {
+                if (atoi(interval) > 0) m_interval = atoi(interval);
+                free(interval);
+            }
+            switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_INFO, "writing metrics to %s every %d seconds\n",
+                              m_path.c_str(), m_interval);
+            m_thread = std::thread([this]() { run(); });
+        }
+
+        void shutdown() {
+            {
+                std::lock_guard<std::mutex> guard(m_lock);
+                m_stopping = true;
+                m_cond.notify_one();
+            }
+            if (m_thread.joinable()) m_thread.join();
+        }
+
+    private:
+        void run() {
+            std::unique_lock<std::mutex> guard(m_lock);
+            while (!m_stopping) {
+                guard.unlock();
+                write();
+                guard.lock();
+                m_cond.wait_for(guard, std::chrono::seconds(m_interval), [this]() { return m_stopping; });
+            }
+        }
+
+        void write() {
+            const std::string text = metrics_render();
+            const std::string tmp = m_path + ".tmp";
+            FILE* file = fopen(tmp.c_str(), "w");
+            bool ok = file && fwrite(text.data(), 1, text.size(), file) == text.size();
+            if (file && fclose(file) != 0) ok = false;
+            if (ok && rename(tmp.c_str(), m_path.c_str()) == 0) {
+                m_failing = false;
+                return;
+            }
+            // log once per failure streak
+            if (!m_failing) {
+                switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "failed to write metrics to %s\n", m_path.c_str());
+                m_failing = true;
+            }
+            remove(tmp.c_str());
+        }
+
+        std::string m_path;
+        int m_interval = METRICS_DEFAULT_INTERVAL;
+        bool m_failing = false;
+        std::mutex m_lock;
+        std::condition_variable m_cond;
+        std::thread m_thread;
+        bool m_stopping = false;
+    };
+
+    MetricsWriter& metrics_writer() {
+        static MetricsWriter writer;
+        return writer;
+    }
+}
+
+void metrics_family(std::string& out, const char* name, const char* type) {
+    out += "# TYPE " METRICS_PREFIX;
+    out += name;
+    out += ' ';
+    out += type;
+    out += '\n';
+}
+
+void metrics_sample(std::string& out, const char* name, const std::string& endpoint, double value, const char* le) {
+    char number[64];
+    out += METRICS_PREFIX;
+    out += name;
+    out += '{';
+    append_label(out, "endpoint", endpoint);
+    if (le) {
+        out += ',';
+        append_label(out, "le", le);
+    }
+    switch_snprintf(number, sizeof(number), "} %.15g\n", value);
+    out += number;
+}
+
+std::string metrics_render() {
+    std::string out;
+    out.reserve(16384);
+    endpoint_prometheus(out);
+    registry_prometheus(out);
+    latency_prometheus(out);
+    return out;
+}
+
+void metrics_start() {
+    metrics_writer().start();
+}
+
+void metrics_shutdown() {
+    metrics_writer().shutdown();
+}
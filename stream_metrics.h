@@ -0,0 +1,28 @@
+#ifndef STREAM_METRICS_H
+#define STREAM_METRICS_H
+
+#include <string>
+
+/*
+ * Module metrics in Prometheus text exposition format, for the audio_stream_metrics API and
+ * optionally written to a file on an interval for node_exporter's textfile collector:
+ *
+ *   <X-PRE-PROCESS cmd="set" data="audio_stream_metrics_file=/var/lib/node_exporter/audio_stream.prom"/>
+ *   <X-PRE-PROCESS cmd="set" data="audio_stream_metrics_interval=15"/>
+ *
+ * The file is replaced atomically (written aside, then renamed).
+ */
+
+// the "# TYPE" line of a family, names get the mod_audio_stream_ prefix
+void metrics_family(std::string& out, const char* name, const char* type);
+// one sample labelled by endpoint, le is added as a second label when given
+void metrics_sample(std::string& out, const char* name, const std::string& endpoint, double value,
+                    const char* le = nullptr);
+
+std::string metrics_render();
+
+// starts the file writer when audio_stream_metrics_file is set
+void metrics_start();
+void metrics_shutdown();
+
+#endif //STREAM_METRICS_H
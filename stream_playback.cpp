@@ -0,0 +1,212 @@
+#include <mutex>
+#include <cstring>
+#include <algorithm>
+#include "stream_playback.h"
+
+#define PLAYBACK_CHUNK_BYTES  (8192)    // 256 ms at 16 kHz mono
+#define PLAYBACK_POOL_RETAIN  (1024)    // idle chunks kept for reuse, the rest is freed
+
+struct PlaybackChunk {
+    PlaybackChunk* next;
+    uint8_t data[PLAYBACK_CHUNK_BYTES];
+};
+
+namespace {
+
+    class ChunkPool {
+    public:
+        PlaybackChunk* take() {
+            {
+                std::lock_guard<std::mutex> guard(m_lock);
+                m_inuse++;
+                if (m_free) {
+                    PlaybackChunk* chunk = m_free;
+                    m_free = chunk->next;
+                    m_idle--;
+                    chunk->next = nullptr;
+                    return chunk;
+                }
+                m_allocated++;
+            }
+            auto* chunk = new PlaybackChunk;
+            chunk->next = nullptr;
+            return chunk;
+        }
+
+        void give(PlaybackChunk* chunk) {
+            {
+                std::lock_guard<std::mutex> guard(m_lock);
+                m_inuse--;
+                if (m_idle < PLAYBACK_POOL_RETAIN) {
+                    chunk->next = m_free;
+                    m_free = chunk;
+                    m_idle++;
+                    return;
+                }
+                m_allocated--;
+            }
+            delete chunk;
+        }
+
+        void stats(cJSON* root) {
+            cJSON* pool = cJSON_CreateObject();
+            {
+                std::lock_guard<std::mutex> guard(m_lock);
+                cJSON_AddNumberToObject(pool, "chunkBytes", PLAYBACK_CHUNK_BYTES);
+                cJSON_AddNumberToObject(pool, "allocated", m_allocated);
+                cJSON_AddNumberToObject(pool, "inuse", m_inuse);
+                cJSON_AddNumberToObject(pool, "idle", m_idle);
+            }
+            cJSON_AddItemToObject(root, "playbackPool", pool);
+        }
+
+    private:
+        std::mutex m_lock;
+        PlaybackChunk* m_free = nullptr;
+        size_t m_allocated = 0;
+        size_t m_inuse = 0;
+        size_t m_idle = 0;
+    };
+
+    ChunkPool& chunk_pool() {
+        static ChunkPool pool;
+        return pool;
+    }
+}
+
+PlaybackBuffer::~PlaybackBuffer() {
+    clear();
+}
+
+bool PlaybackBuffer::write(const uint8_t* data, size_t len) {
+    if (len > freespace()) return false;
+    while (len) {
+        if (!m_tail || m_writePos == PLAYBACK_CHUNK_BYTES) {
+            PlaybackChunk* chunk = chunk_pool().take();
+            if (m_tail) m_tail->next = chunk;
+            else m_head = chunk;
+            m_tail = chunk;
+            m_writePos = 0;
+        }
+        const size_t n = std::min(len, (size_t) PLAYBACK_CHUNK_BYTES - m_writePos);
+        memcpy(m_tail->data + m_writePos, data, n);
+        m_writePos += n;
+        m_inuse += n;
+        data += n;
+        len -= n;
+    }
+    return true;
+}
+
+size_t PlaybackBuffer::read(uint8_t* out, size_t len) {
+    size_t done = 0;
+    while (done < len && m_inuse) {
+        const size_t end = m_head == m_tail ? m_writePos : PLAYBACK_CHUNK_BYTES;
+        const size_t n = std::min(len - done, end - m_readPos);
+        memcpy(out + done, m_head->data + m_readPos, n);
+        m_readPos += n;
+        m_inuse -= n;
+        done += n;
+        if (m_readPos == end) {
+            // played out, back to the pool
+            PlaybackChunk* chunk = m_head;
+            m_head = chunk->next;
+            if (!m_head) m_tail = nullptr;
+            m_readPos = 0;
+            chunk_pool().give(chunk);
+        }
+    }
+    return done;
+}
+
+void PlaybackBuffer::clear() {
+    while (m_head) {
+        PlaybackChunk* chunk = m_head;
+        m_head = chunk->next;
+        chunk_pool().give(chunk);
+    }
+    m_tail = nullptr;
+    m_readPos = m_writePos = 0;
+    m_inuse = 0;
+}
+
+void playback_pool_stats(cJSON* root) {
+    chunk_pool().stats(root);
+}
+
+bool PlaybackQueue::write(const std::string& id, int priority, bool interrupt, const uint8_t* data, size_t len) {
+    auto it = m_segments.begin();
+    while (it != m_segments.end() && it->id != id) ++it;
+    if (it == m_segments.end()) {
+        // interrupt only counts for the first chunk of a segment
+        if (interrupt && !m_segments.empty() && m_segments.front().played) {
+            // cut what is playing, which also makes room
+            m_inuse -= m_segments.front().audio.inuse();
+            m_segments.pop_front();
+        }
+        if (len > freespace()) return false;
+        if (interrupt) {
+            it = m_segments.emplace(m_segments.begin(), id, priority, m_capacity);
+        } else {
+            // behind the playing one and those of the same or a higher priority
+            it = m_segments.begin();
+            if (it != m_segments.end() && it->played) ++it;
+            while (it != m_segments.end() && it->priority >= priority) ++it;
+            it = m_segments.emplace(it, id, priority, m_capacity);
+        }
+    } else if (len > freespace()) {
+        return false;
+    }
+    it->audio.write(data, len);
+    m_inuse += len;
+    return true;
+}
+
+size_t PlaybackQueue::read(uint8_t* out, size_t len) {
+    size_t done = 0;
+    while (done < len && !m_segments.empty()) {
+        Segment& segment = m_segments.front();
+        const size_t n = segment.audio.read(out + done, len - done);
+        segment.played += n;
+        m_inuse -= n;
+        done += n;
+        if (!segment.audio.inuse()) m_segments.pop_front();
+    }
+    return done;
+}
+
+bool PlaybackQueue::queued(const std::string& id) const {
+    for (const auto& segment : m_segments) {
+        if (segment.id == id) return true;
+    }
+    return false;
+}
+
+long PlaybackQueue::cancel(const std::string& id) {
+    for (auto it = m_segments.begin(); it != m_segments.end(); ++it) {
+        if (it->id == id) {
+            const size_t dropped = it->audio.inuse();
+            m_inuse -= dropped;
+            m_segments.erase(it);
+            return (long) dropped;
+        }
+    }
+    return -1;
+}
+
+void PlaybackQueue::clear() {
+    m_segments.clear();
+    m_inuse = 0;
+}
+
+void PlaybackQueue::list(cJSON* array, size_t bytesPerSec) const {
+    for (const auto& segment : m_segments) {
+        cJSON* item = cJSON_CreateObject();
+        cJSON_AddStringToObject(item, "segmentId", segment.id.c_str());
+        cJSON_AddNumberToObject(item, "priority", segment.priority);
+        cJSON_AddItemToObject(item, "playing", cJSON_CreateBool(segment.played > 0));
+        cJSON_AddNumberToObject(item, "queuedMs", (double) segment.audio.inuse() * 1000 / bytesPerSec);
+        cJSON_AddNumberToObject(item, "playedMs", (double) segment.played * 1000 / bytesPerSec);
+        cJSON_AddItemToArray(array, item);
+    }
+}
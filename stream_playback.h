@@ -0,0 +1,98 @@
+#ifndef STREAM_PLAYBACK_H
+#define STREAM_PLAYBACK_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <list>
+#include <switch_json.h>
+
+/*
+ * Queue of audio waiting to be injected into the call.
+ *
+ * Storage is a chain of fixed size chunks taken from a module-wide free list as audio
+ * arrives and handed back as it is played, so a call that never gets audio to play
+ * holds no playback memory and an idle one gives it back.
+ */
+
+struct PlaybackChunk;
+
+class PlaybackBuffer {
+public:
+    explicit PlaybackBuffer(size_t capacity): m_capacity(capacity) {}
+    ~PlaybackBuffer();
+
+    PlaybackBuffer(const PlaybackBuffer&) = delete;
+    PlaybackBuffer& operator=(const PlaybackBuffer&) = delete;
+
+    size_t inuse() const { return m_inuse; }
+    size_t freespace() const { return m_capacity - m_inuse; }
+
+    // all of it or nothing when it does not fit
+    bool write(const uint8_t* data, size_t len);
+    // returns the bytes read, fewer than len when the queue runs dry
+    size_t read(uint8_t* out, size_t len);
+    void clear();
+
+private:
+    PlaybackChunk* m_head = nullptr;
+    PlaybackChunk* m_tail = nullptr;
+    size_t m_readPos = 0;           // in m_head
+    size_t m_writePos = 0;          // in m_tail
+    size_t m_inuse = 0;
+    size_t m_capacity;
+};
+
+/*
+ * What stream_play_frame plays, as a queue of segments: the audio of one utterance or
+ * prompt, named by the server. Chunks with the same id are appended to the segment while
+ * it is queued or playing; a segment ends when its audio runs out.
+ *
+ * Segments play in priority order, higher first, and in arrival order within a priority.
+ * The segment already playing is never preempted by priority, only by a new segment
+ * flagged interrupt, which cuts it and plays next. The capacity covers all segments.
+ */
+class PlaybackQueue {
+public:
+    explicit PlaybackQueue(size_t capacity): m_capacity(capacity) {}
+
+    PlaybackQueue(const PlaybackQueue&) = delete;
+    PlaybackQueue& operator=(const PlaybackQueue&) = delete;
+
+    size_t inuse() const { return m_inuse; }
+    size_t freespace() const { return m_capacity - m_inuse; }
+    bool playing(const std::string& id) const {
+        return !m_segments.empty() && m_segments.front().played > 0 && m_segments.front().id == id;
+    }
+
+    // appends to segment id, created with priority and interrupt when not queued;
+    // all of it or nothing when it does not fit
+    bool write(const std::string& id, int priority, bool interrupt, const uint8_t* data, size_t len);
+    // returns the bytes read, fewer than len when the queue runs dry
+    size_t read(uint8_t* out, size_t len);
+    // queued or playing, so audio written for it is appended to it
+    bool queued(const std::string& id) const;
+    // drops the segment, returns its bytes not played yet or -1 when it is not queued
+    long cancel(const std::string& id);
+    void clear();
+    // adds {segmentId, priority, playing, queuedMs, playedMs} per segment, in play order
+    void list(cJSON* array, size_t bytesPerSec) const;
+
+private:
+    struct Segment {
+        Segment(const std::string& id, int priority, size_t capacity): id(id), priority(priority), audio(capacity) {}
+        std::string id;
+        int priority;
+        size_t played = 0;
+        PlaybackBuffer audio;
+    };
+
+    std::list<Segment> m_segments;  // front is playing once played > 0
+    size_t m_inuse = 0;
+    size_t m_capacity;
+};
+
+// adds the chunk free list counters to a JSON object
+void playback_pool_stats(cJSON* root);
+
+#endif //STREAM_PLAYBACK_H
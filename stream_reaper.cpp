@@ -0,0 +1,126 @@
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <deque>
+#include <vector>
+#include <chrono>
+#include "mod_audio_stream.h"
+#include "stream_reaper.h"
+
+#define REAPER_WORKERS            (4)
+#define REAPER_SLOW_CLOSE_MS      (5000)    // a close taking longer is logged as slow
+
+namespace {
+
+    typedef std::chrono::steady_clock reaper_clock;
+
+    struct CloseJob {
+        std::string sessionId;
+        std::function<void()> close;
+    };
+
+    class Reaper {
+    public:
+        void submit(const std::string& sessionId, std::function<void()> close) {
+            {
+                std::lock_guard<std::mutex> guard(m_lock);
+                if (!m_stopping) {
+                    m_queue.push_back({sessionId, std::move(close)});
+                    if (m_queue.size() > m_maxQueued) m_maxQueued = m_queue.size();
+                    if (m_workers.size() < REAPER_WORKERS && m_idle == 0) {
+                        m_workers.emplace_back([this]() { run(); });
+                    }
+                    m_cond.notify_one();
+                    return;
+                }
+            }
+            // the module is going away, nobody would pick it up
+            close();
+        }
+
+        void shutdown() {
+            std::vector<std::thread> workers;
+            {
+                std::lock_guard<std::mutex> guard(m_lock);
+                m_stopping = true;
+                m_cond.notify_all();
+                workers.swap(m_workers);
+            }
+            for (auto& worker : workers) worker.join();
+        }
+
+        void stats(cJSON* root) {
+            std::lock_guard<std::mutex> guard(m_lock);
+            cJSON* reaper = cJSON_CreateObject();
+            cJSON_AddNumberToObject(reaper, "workers", m_workers.size());
+            cJSON_AddNumberToObject(reaper, "queued", m_queue.size());
+            cJSON_AddNumberToObject(reaper, "maxQueued", m_maxQueued);
+            cJSON_AddNumberToObject(reaper, "closing", m_workers.size() - m_idle);
+            cJSON_AddNumberToObject(reaper, "closed", m_closed);
+            cJSON_AddNumberToObject(reaper, "slow", m_slow);
+            cJSON_AddNumberToObject(reaper, "closeMaxMs", m_closeMaxMs);
+            cJSON_AddItemToObject(root, "reaper", reaper);
+        }
+
+    private:
+        void run() {
+            std::unique_lock<std::mutex> guard(m_lock);
+            while (true) {
+                m_idle++;
+                m_cond.wait(guard, [this]() { return m_stopping || !m_queue.empty(); });
+                m_idle--;
+                // pending closes still run when stopping: their I/O threads must be gone before unload
+                if (m_queue.empty()) break;
+
+                int64_t ms;
+                {
+                    CloseJob job = std::move(m_queue.front());
+                    m_queue.pop_front();
+                    guard.unlock();
+
+                    auto start = reaper_clock::now();
+                    job.close();
+                    ms = std::chrono::duration_cast<std::chrono::milliseconds>(reaper_clock::now() - start).count();
+                    if (ms > REAPER_SLOW_CLOSE_MS) {
+                        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "(%s) slow websocket close, took %lld ms\n",
+                                          job.sessionId.c_str(), (long long) ms);
+                    }
+                    // the job owns the streamer: its destructor joins threads, not under the reaper lock
+                }
+
+                guard.lock();
+                m_closed++;
+                if (ms > REAPER_SLOW_CLOSE_MS) m_slow++;
+                if (ms > m_closeMaxMs) m_closeMaxMs = ms;
+            }
+        }
+
+        std::mutex m_lock;
+        std::condition_variable m_cond;
+        std::deque<CloseJob> m_queue;
+        std::vector<std::thread> m_workers;
+        size_t m_idle = 0;
+        size_t m_maxQueued = 0;
+        uint64_t m_closed = 0;
+        uint64_t m_slow = 0;
+        int64_t m_closeMaxMs = 0;
+        bool m_stopping = false;
+    };
+
+    Reaper& reaper() {
+        static Reaper instance;
+        return instance;
+    }
+}
+
+void reaper_submit(const std::string& sessionId, std::function<void()> close) {
+    reaper().submit(sessionId, std::move(close));
+}
+
+void reaper_shutdown() {
+    reaper().shutdown();
+}
+
+void reaper_stats(cJSON* root) {
+    reaper().stats(root);
+}
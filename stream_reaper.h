@@ -0,0 +1,24 @@
+#ifndef STREAM_REAPER_H
+#define STREAM_REAPER_H
+
+#include <string>
+#include <functional>
+#include <switch_json.h>
+
+/*
+ * Module-owned workers closing the connections of ended calls.
+ *
+ * Closing a websocket blocks until its I/O thread is gone, so it is never done on the
+ * media thread. A small fixed set of workers takes the closes from a queue. Closes that
+ * take longer than REAPER_SLOW_CLOSE_MS are logged and counted once they return; they are
+ * not cut short, a hung close keeps its worker. All queued closes are run before
+ * reaper_shutdown returns.
+ */
+
+void reaper_submit(const std::string& sessionId, std::function<void()> close);
+void reaper_shutdown();
+
+// adds the reaper counters to a JSON object
+void reaper_stats(cJSON* root);
+
+#endif //STREAM_REAPER_H
@@ -0,0 +1,240 @@
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <chrono>
+#include <vector>
+#include <algorithm>
+#include "stream_recorder.h"
+#include "stream_wav.h"
+
+#define RECORD_FLUSH_MS     (250)   // how often the writer thread appends
+#define RECORD_GAP_MS       (100)   // a side further behind its capture time than this is padded
+#define RECORD_MAX_SKEW_MS  (1000)  // how long the writer waits for a side that is not fed
+
+struct RecordSide {
+    std::vector<int16_t> pending;   // not written yet
+    uint64_t base = 0;              // position of pending[0] in the recording, in samples
+    uint64_t end() const { return base + pending.size(); }
+};
+
+class CallRecorder {
+public:
+    CallRecorder(const char* sessionId, int rate): sessionId(sessionId), m_rate(rate), m_start(switch_micro_time_now()) {}
+
+    void feed(RecordTrack track, const int16_t* samples, size_t frames, int channels, switch_time_t when) {
+        std::lock_guard<std::mutex> guard(m_lock);
+        RecordSide& side = m_sides[track];
+        // a side that was not fed for a while (paused, not streaming, nothing to play) gets
+        // silence up to where these samples were captured, so both stay lined up
+        const int64_t pos = (when - m_start) * m_rate / 1000000 - (int64_t) frames;
+        if (pos > (int64_t) side.end() + m_rate * RECORD_GAP_MS / 1000) {
+            side.pending.resize(side.pending.size() + (pos - side.end()), 0);
+        }
+        const size_t at = side.pending.size();
+        side.pending.resize(at + frames, 0);
+        if (samples) {
+            for (size_t i = 0; i < frames; i++) side.pending[at + i] = samples[i * channels];
+        }
+    }
+
+    // moves what both sides have into out, interleaved, and returns the frames; a side that
+    // is behind is waited for up to RECORD_MAX_SKEW_MS, unless this is the last call
+    size_t take(std::vector<int16_t>& out, bool final) {
+        std::lock_guard<std::mutex> guard(m_lock);
+        const uint64_t lo = std::min(m_sides[0].end(), m_sides[1].end());
+        const uint64_t hi = std::max(m_sides[0].end(), m_sides[1].end());
+        const uint64_t skew = m_rate * RECORD_MAX_SKEW_MS / 1000;
+        uint64_t target = lo;
+        if (final) target = hi;
+        else if (hi - lo > skew) target = hi - skew;
+        if (target <= m_written) return 0;
+
+        const size_t frames = target - m_written;
+        out.assign(frames * 2, 0);
+        for (int t = 0; t < 2; t++) {
+            RecordSide& side = m_sides[t];
+            const size_t n = std::min(side.pending.size(), frames);
+            for (size_t i = 0; i < n; i++) out[i * 2 + t] = side.pending[i];
+            side.pending.erase(side.pending.begin(), side.pending.begin() + n);
+            side.base = target;
+        }
+        m_written = target;
+        return frames;
+    }
+
+    uint64_t written() const { return m_written; }
+    int rate() const { return m_rate; }
+
+    const std::string sessionId;
+    WavWriter wav;                  // writer thread only once added
+    bool failed = false;            // writer thread only
+    bool closing = false;           // under the writer lock
+
+private:
+    std::mutex m_lock;
+    RecordSide m_sides[2];
+    uint64_t m_written = 0;
+    const int m_rate;
+    const switch_time_t m_start;
+};
+
+namespace {
+
+    class RecordWriter {
+    public:
+        bool add(CallRecorder* recorder) {
+            std::lock_guard<std::mutex> guard(m_lock);
+            if (m_stopping) return false;
+            m_recorders.push_back(recorder);
+            if (!m_thread.joinable()) m_thread = std::thread([this]() { run(); });
+            return true;
+        }
+
+        void close(CallRecorder* recorder) {
+            std::lock_guard<std::mutex> guard(m_lock);
+            if (m_done) {
+                // shutdown already wrote and closed it
+                m_recorders.erase(std::remove(m_recorders.begin(), m_recorders.end(), recorder), m_recorders.end());
+                delete recorder;
+                return;
+            }
+            recorder->closing = true;
+            m_closed = true;
+            m_cond.notify_one();
+        }
+
+        void shutdown() {
+            {
+                std::lock_guard<std::mutex> guard(m_lock);
+                m_stopping = true;
+                m_cond.notify_one();
+            }
+            if (m_thread.joinable()) m_thread.join();
+            std::lock_guard<std::mutex> guard(m_lock);
+            m_done = true;  // when the thread never ran
+        }
+
+        void stats(cJSON* root) {
+            std::lock_guard<std::mutex> guard(m_lock);
+            cJSON* recorder = cJSON_CreateObject();
+            cJSON_AddNumberToObject(recorder, "active", m_recorders.size());
+            cJSON_AddNumberToObject(recorder, "writes", m_writes);
+            cJSON_AddNumberToObject(recorder, "bytes", m_bytes);
+            cJSON_AddNumberToObject(recorder, "errors", m_errors);
+            cJSON_AddItemToObject(root, "recorder", recorder);
+        }
+
+    private:
+        struct Batched {
+            CallRecorder* recorder;
+            bool closing;
+        };
+
+        void run() {
+            std::unique_lock<std::mutex> guard(m_lock);
+            bool last = false;
+            while (!last) {
+                m_cond.wait_for(guard, std::chrono::milliseconds(RECORD_FLUSH_MS), [this]() { return m_stopping || m_closed; });
+                last = m_stopping;
+                m_closed = false;
+                // closing recorders are ours alone from here on
+                m_batch.clear();
+                for (auto it = m_recorders.begin(); it != m_recorders.end();) {
+                    m_batch.push_back({*it, (*it)->closing});
+                    if ((*it)->closing) it = m_recorders.erase(it);
+                    else ++it;
+                }
+                guard.unlock();
+
+                uint64_t writes = 0, bytes = 0, errors = 0;
+                for (const auto& batched : m_batch) {
+                    CallRecorder* recorder = batched.recorder;
+                    const bool final = batched.closing || last;
+                    const size_t frames = recorder->take(m_buffer, final);
+                    if (frames && !recorder->failed) {
+                        if (recorder->wav.append(m_buffer.data(), frames * 2 * sizeof(int16_t)) < 0) {
+                            recorder->failed = true;
+                            errors++;
+                            switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "(%s) failed to write recording %s\n",
+                                              recorder->sessionId.c_str(), recorder->wav.path().c_str());
+                        } else {
+                            writes++;
+                            bytes += frames * 2 * sizeof(int16_t);
+                        }
+                    }
+                    if (final) {
+                        recorder->wav.close();
+                        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_INFO, "(%s) recording %s closed, %.1f seconds\n",
+                                          recorder->sessionId.c_str(), recorder->wav.path().c_str(),
+                                          (double) recorder->written() / recorder->rate());
+                    }
+                    if (batched.closing) delete recorder;
+                }
+
+                guard.lock();
+                m_writes += writes;
+                m_bytes += bytes;
+                m_errors += errors;
+            }
+            m_done = true;
+            // closed while the last pass was running
+            for (auto it = m_recorders.begin(); it != m_recorders.end();) {
+                if ((*it)->closing) {
+                    delete *it;
+                    it = m_recorders.erase(it);
+                } else {
+                    ++it;
+                }
+            }
+        }
+
+        std::mutex m_lock;
+        std::condition_variable m_cond;
+        std::thread m_thread;
+        std::vector<CallRecorder*> m_recorders;
+        std::vector<Batched> m_batch;       // writer thread only
+        std::vector<int16_t> m_buffer;      // writer thread only
+        uint64_t m_writes = 0;
+        uint64_t m_bytes = 0;
+        uint64_t m_errors = 0;
+        bool m_closed = false;
+        bool m_stopping = false;
+        bool m_done = false;
+    };
+
+    RecordWriter& record_writer() {
+        static RecordWriter writer;
+        return writer;
+    }
+}
+
+CallRecorder* recorder_open(const char* sessionId, const std::string& path, int rate) {
+    auto* recorder = new CallRecorder(sessionId, rate);
+    if (!recorder->wav.open(path, WAV_PCM, rate, 2, 16)) {
+        delete recorder;
+        return nullptr;
+    }
+    if (!record_writer().add(recorder)) {
+        recorder->wav.close();
+        delete recorder;
+        return nullptr;
+    }
+    return recorder;
+}
+
+void recorder_feed(CallRecorder* recorder, RecordTrack track, const int16_t* samples, size_t frames, int channels,
+                   switch_time_t when) {
+    recorder->feed(track, samples, frames, channels, when);
+}
+
+void recorder_close(CallRecorder* recorder) {
+    record_writer().close(recorder);
+}
+
+void recorder_shutdown() {
+    record_writer().shutdown();
+}
+
+void recorder_stats(cJSON* root) {
+    record_writer().stats(root);
+}
@@ -0,0 +1,43 @@
+#ifndef STREAM_RECORDER_H
+#define STREAM_RECORDER_H
+
+#include <string>
+#include <stddef.h>
+#include <stdint.h>
+#include <switch.h>
+#include <switch_json.h>
+
+/*
+ * Full call recording off the frames the media bug already hands us: the caller on the left
+ * channel, the audio we inject on the right, 16 bit PCM at the stream rate.
+ *
+ * The media threads only copy samples into the recorder. One module-wide writer thread
+ * lines the two sides up by capture time, interleaves them and appends them to the file a
+ * few hundred milliseconds at a time, so a slow disk never holds up a call.
+ */
+
+enum RecordTrack {
+    RECORD_CALLER = 0,
+    RECORD_BOT = 1
+};
+
+class CallRecorder;
+
+// nullptr when the file cannot be created
+CallRecorder* recorder_open(const char* sessionId, const std::string& path, int rate);
+
+// copies the first of channels interleaved channels, silence when samples is null;
+// when is the time the last sample was captured
+void recorder_feed(CallRecorder* recorder, RecordTrack track, const int16_t* samples, size_t frames, int channels,
+                   switch_time_t when);
+
+// the writer thread writes what is left and closes the file, the recorder is gone after this
+void recorder_close(CallRecorder* recorder);
+
+// writes out and closes all recordings
+void recorder_shutdown();
+
+// adds the writer counters to a JSON object
+void recorder_stats(cJSON* root);
+
+#endif //STREAM_RECORDER_H
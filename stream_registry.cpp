@@ -0,0 +1,138 @@
+#include <mutex>
+#include <unordered_map>
+#include "mod_audio_stream.h"
+#include "stream_registry.h"
+
+#define REGISTRY_SHARDS (16)
+
+namespace {
+
+    const char* const state_names[] = { "connecting", "connected", "reconnecting", "draining" };
+
+    struct Shard {
+        std::mutex lock;
+        std::unordered_map<std::string, std::shared_ptr<StreamEntry>> live;
+        std::unordered_map<std::string, CounterTotals> ended;   // by endpoint
+        uint64_t endedCount = 0;
+    };
+
+    class StreamRegistry {
+    public:
+        std::shared_ptr<StreamEntry> add(const std::string& uuid) {
+            auto entry = std::make_shared<StreamEntry>();
+            entry->uuid = uuid;
+            entry->started = switch_micro_time_now();
+            entry->counters = std::make_shared<StreamCounters>();
+            Shard& shard = shardOf(uuid);
+            std::lock_guard<std::mutex> guard(shard.lock);
+            shard.live[uuid] = entry;
+            return entry;
+        }
+
+        void remove(const std::string& uuid) {
+            Shard& shard = shardOf(uuid);
+            std::lock_guard<std::mutex> guard(shard.lock);
+            auto it = shard.live.find(uuid);
+            if (it == shard.live.end()) return;
+            StreamCounters& counters = *it->second->counters;
+            shard.ended[counters.endpoint()].add(counters);
+            shard.endedCount++;
+            shard.live.erase(it);
+        }
+
+        // the entries are copied out, one shard locked at a time
+        std::vector<std::shared_ptr<StreamEntry>> snapshot() {
+            std::vector<std::shared_ptr<StreamEntry>> all;
+            for (auto& shard : m_shards) {
+                std::lock_guard<std::mutex> guard(shard.lock);
+                for (const auto& it : shard.live) all.push_back(it.second);
+            }
+            return all;
+        }
+
+        void stats(cJSON* root) {
+            CounterTotals sum;
+            size_t active = 0;
+            uint64_t ended = 0;
+            for (auto& shard : m_shards) {
+                std::lock_guard<std::mutex> guard(shard.lock);
+                for (const auto& it : shard.ended) sum.add(it.second);
+                for (const auto& it : shard.live) sum.add(*it.second->counters);
+                active += shard.live.size();
+                ended += shard.endedCount;
+            }
+            cJSON* item = cJSON_CreateObject();
+            cJSON_AddNumberToObject(item, "active", active);
+            cJSON_AddNumberToObject(item, "ended", (double) ended);
+            counters_json(sum, item);
+            cJSON_AddItemToObject(root, "streams", item);
+        }
+
+        void prometheus(std::string& out) {
+            std::map<std::string, CounterTotals> byEndpoint;
+            for (auto& shard : m_shards) {
+                std::lock_guard<std::mutex> guard(shard.lock);
+                for (const auto& it : shard.ended) byEndpoint[it.first].add(it.second);
+                for (const auto& it : shard.live) byEndpoint[it.second->counters->endpoint()].add(*it.second->counters);
+            }
+            counters_prometheus(byEndpoint, out);
+        }
+
+    private:
+        Shard& shardOf(const std::string& uuid) {
+            return m_shards[std::hash<std::string>()(uuid) % REGISTRY_SHARDS];
+        }
+
+        Shard m_shards[REGISTRY_SHARDS];
+    };
+
+    StreamRegistry& registry() {
+        static StreamRegistry instance;
+        return instance;
+    }
+}
+
+std::shared_ptr<StreamEntry> registry_add(const std::string& uuid) {
+    return registry().add(uuid);
+}
+
+void registry_remove(const std::string& uuid) {
+    registry().remove(uuid);
+}
+
+std::vector<std::string> registry_find(const std::string& endpoint) {
+    std::vector<std::string> uuids;
+    for (const auto& entry : registry().snapshot()) {
+        if (endpoint.empty() || entry->counters->endpoint() == endpoint) uuids.push_back(entry->uuid);
+    }
+    return uuids;
+}
+
+char* registry_list() {
+    const switch_time_t now = switch_micro_time_now();
+    cJSON* list = cJSON_CreateArray();
+    for (const auto& entry : registry().snapshot()) {
+        StreamCounters& counters = *entry->counters;
+        cJSON* item = cJSON_CreateObject();
+        cJSON_AddStringToObject(item, "uuid", entry->uuid.c_str());
+        cJSON_AddStringToObject(item, "state", state_names[entry->state.load()]);
+        cJSON_AddItemToObject(item, "paused", cJSON_CreateBool(entry->paused.load()));
+        cJSON_AddStringToObject(item, "endpoint", counters.endpoint().c_str());
+        cJSON_AddNumberToObject(item, "durationMs", (now - entry->started) / 1000);
+        cJSON_AddNumberToObject(item, "uplinkBytes", (double) counters.uplinkBytes.load(std::memory_order_relaxed));
+        cJSON_AddNumberToObject(item, "downlinkBytes", (double) counters.downlinkBytes.load(std::memory_order_relaxed));
+        cJSON_AddNumberToObject(item, "connects", (double) counters.connects.load(std::memory_order_relaxed));
+        cJSON_AddItemToArray(list, item);
+    }
+    char* json = cJSON_PrintUnformatted(list);
+    cJSON_Delete(list);
+    return json;
+}
+
+void registry_stats(cJSON* root) {
+    registry().stats(root);
+}
+
+void registry_prometheus(std::string& out) {
+    registry().prometheus(out);
+}
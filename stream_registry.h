@@ -0,0 +1,48 @@
+#ifndef STREAM_REGISTRY_H
+#define STREAM_REGISTRY_H
+
+#include <atomic>
+#include <memory>
+#include <string>
+#include <vector>
+#include <switch.h>
+#include <switch_json.h>
+#include "stream_counters.h"
+
+/*
+ * Module-wide view of the active streams, keyed by session uuid.
+ *
+ * Entries are spread over shards with a lock each, so starting and ending streams only
+ * contends with the streams of the same shard. Ended streams leave their counters behind,
+ * summed up by endpoint, for the module totals.
+ */
+
+enum StreamState {
+    STREAM_CONNECTING,
+    STREAM_CONNECTED,
+    STREAM_RECONNECTING,
+    STREAM_DRAINING
+};
+
+struct StreamEntry {
+    std::string uuid;
+    switch_time_t started = 0;
+    std::shared_ptr<StreamCounters> counters;
+    std::atomic<int> state{STREAM_CONNECTING};
+    std::atomic<bool> paused{false};
+};
+
+std::shared_ptr<StreamEntry> registry_add(const std::string& uuid);
+void registry_remove(const std::string& uuid);
+
+// uuids of the active streams on an endpoint, all of them when endpoint is empty
+std::vector<std::string> registry_find(const std::string& endpoint);
+
+// JSON array of the active streams, caller frees
+char* registry_list();
+// adds the stream counts and the counters summed up to a JSON object
+void registry_stats(cJSON* root);
+// appends the counters by endpoint in Prometheus text format
+void registry_prometheus(std::string& out);
+
+#endif //STREAM_REGISTRY_H
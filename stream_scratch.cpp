@@ -0,0 +1,55 @@
+#include <switch.h>
+#include <speex/speex_resampler.h>
+#include "stream_scratch.h"
+
+void ScratchArena::reset() {
+    if (!m_spill.empty()) {
+        m_capacity = m_used + m_spilled;
+        m_block.reset(new uint8_t[m_capacity]);
+        m_spill.clear();
+        m_spilled = 0;
+    }
+    m_used = 0;
+}
+
+CachedResampler::~CachedResampler() {
+    if (m_state) speex_resampler_destroy(m_state);
+}
+
+SpeexResamplerState* CachedResampler::get(int inRate, int outRate, int* err) {
+    *err = 0;
+    if (m_state && inRate == m_inRate && outRate == m_outRate) return m_state;
+    if (m_state) speex_resampler_destroy(m_state);
+    m_state = speex_resampler_init(1, inRate, outRate, SWITCH_RESAMPLE_QUALITY, err);
+    if (*err) m_state = nullptr;
+    else speex_resampler_skip_zeros(m_state);
+    m_inRate = inRate;
+    m_outRate = outRate;
+    m_pending = false;
+    return m_state;
+}
+
+spx_uint32_t CachedResampler::process(const int16_t* in, spx_uint32_t len, int16_t* out, spx_uint32_t room) {
+    speex_resampler_process_int(m_state, 0, in, &len, out, &room);
+    m_pending = true;
+    return room;
+}
+
+size_t CachedResampler::tail() const {
+    return m_state ? (size_t) speex_resampler_get_input_latency(m_state) * m_outRate / m_inRate + 1 : 0;
+}
+
+spx_uint32_t CachedResampler::flush(int16_t* out, spx_uint32_t room) {
+    if (!m_pending) return 0;
+    spx_uint32_t zeros = speex_resampler_get_input_latency(m_state);
+    speex_resampler_process_int(m_state, 0, nullptr, &zeros, out, &room);
+    reset();
+    return room;
+}
+
+void CachedResampler::reset() {
+    if (!m_state) return;
+    speex_resampler_reset_mem(m_state);
+    speex_resampler_skip_zeros(m_state);
+    m_pending = false;
+}
@@ -0,0 +1,74 @@
+#ifndef STREAM_SCRATCH_H
+#define STREAM_SCRATCH_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <memory>
+#include <vector>
+#include <speex/speex_resampler.h>
+
+/*
+ * Bump allocator for the buffers of one downlink message, reset when the next message
+ * starts. Allocations that do not fit get a block of their own until the reset, which
+ * then grows the main block to fit them all, so once it has seen the largest message
+ * a stream gets no more heap allocations from it.
+ */
+class ScratchArena {
+public:
+    template <typename T>
+    T* alloc(size_t count) {
+        const size_t bytes = (count * sizeof(T) + 15) & ~(size_t) 15;
+        if (m_used + bytes > m_capacity) {
+            m_spill.emplace_back(new uint8_t[bytes]);
+            m_spilled += bytes;
+            return reinterpret_cast<T*>(m_spill.back().get());
+        }
+        T* p = reinterpret_cast<T*>(m_block.get() + m_used);
+        m_used += bytes;
+        return p;
+    }
+
+    void reset();
+
+    size_t capacity() const { return m_capacity; }
+
+private:
+    std::unique_ptr<uint8_t[]> m_block;
+    size_t m_capacity = 0;
+    size_t m_used = 0;
+    std::vector<std::unique_ptr<uint8_t[]>> m_spill;
+    size_t m_spilled = 0;
+};
+
+/*
+ * A mono resampler kept across the chunks of a segment, recreated only when the rates
+ * change. Keeping it also keeps the filter history, so consecutive chunks join without a
+ * gap; at the end of the segment what is left in the filter is flushed out, and the next
+ * segment starts without the filter delay.
+ */
+class CachedResampler {
+public:
+    CachedResampler() = default;
+    ~CachedResampler();
+
+    CachedResampler(const CachedResampler&) = delete;
+    CachedResampler& operator=(const CachedResampler&) = delete;
+
+    SpeexResamplerState* get(int inRate, int outRate, int* err);
+    // returns the samples written to out
+    spx_uint32_t process(const int16_t* in, spx_uint32_t len, int16_t* out, spx_uint32_t room);
+    // the most flush() writes
+    size_t tail() const;
+    // the end of the segment: zeros behind the last input push it out of the filter
+    spx_uint32_t flush(int16_t* out, spx_uint32_t room);
+    // drops what is in the filter, the next input comes out on time
+    void reset();
+
+private:
+    SpeexResamplerState* m_state = nullptr;
+    int m_inRate = 0;
+    int m_outRate = 0;
+    bool m_pending = false;     // input went in since the last flush or reset
+};
+
+#endif //STREAM_SCRATCH_H
@@ -0,0 +1,170 @@
+#include <cmath>
+#include <algorithm>
+#include "stream_stretch.h"
+
+#define STRETCH_LOW_MS  (60)    // backlog under which playout slows down
+
+TimeStretch::TimeStretch(int rate, int targetMs, int maxSpeedup, int maxSlowdown)
+    : m_window(rate / 100 * 2), m_hop(rate / 100), m_tolerance(rate / 200), m_targetMs(targetMs),
+      m_maxSpeedup(maxSpeedup / 100.0), m_maxSlowdown(maxSlowdown / 100.0),
+      m_hann(m_window), m_tail(m_hop) {
+    // periodic Hann: overlapped by half, the windows add up to 1
+    for (size_t i = 0; i < m_window; i++) {
+        m_hann[i] = 0.5f - 0.5f * (float) cos(2 * M_PI * i / m_window);
+    }
+}
+
+double TimeStretch::speed(double backlogMs) const {
+    if (backlogMs > m_targetMs) {
+        return 1 + m_maxSpeedup * std::min(1.0, (backlogMs - m_targetMs) / m_targetMs);
+    }
+    if (backlogMs < STRETCH_LOW_MS) {
+        return 1 - m_maxSlowdown * (1 - backlogMs / STRETCH_LOW_MS);
+    }
+    return 1;
+}
+
+size_t TimeStretch::render(PlaybackQueue& queue, int16_t* out, size_t samples, double speed) {
+    size_t done = take(out, samples);
+    while (done < samples) {
+        if (speed == 1) {
+            if (m_active) {
+                flush();
+                done += take(out + done, samples - done);
+                continue;
+            }
+            done += queue.read((uint8_t*) (out + done), (samples - done) * sizeof(int16_t)) / sizeof(int16_t);
+            break;
+        }
+        if (!m_active) {
+            m_active = true;
+            m_nominal = 0;
+            m_natural = 0;
+            // as if a window had just ended at the first sample, so the first one plays it as is
+            m_fresh = true;
+        }
+
+        // the next window and the search range around it
+        const size_t need = std::max((size_t) m_nominal + m_tolerance + m_window, m_natural + m_hop);
+        if (m_in.size() < need) {
+            const size_t at = m_in.size();
+            m_in.resize(need);
+            const size_t got = queue.read((uint8_t*) (m_in.data() + at), (need - at) * sizeof(int16_t)) / sizeof(int16_t);
+            m_in.resize(at + got);
+            if (m_in.size() < need) {
+                flush();
+                done += take(out + done, samples - done);
+                break;
+            }
+        }
+        step(speed);
+        done += take(out + done, samples - done);
+    }
+    return done;
+}
+
+void TimeStretch::reset() {
+    m_in.clear();
+    m_out.clear();
+    m_outPos = 0;
+    m_active = false;
+}
+
+size_t TimeStretch::held() const {
+    return m_in.size() - std::min(m_natural, m_in.size()) + m_out.size() - m_outPos;
+}
+
+void TimeStretch::step(double speed) {
+    const size_t nominal = (size_t) m_nominal;
+    const size_t k = bestOffset(nominal > m_tolerance ? nominal - m_tolerance : 0, nominal + m_tolerance, m_natural);
+    if (m_fresh) {
+        for (size_t i = 0; i < m_hop; i++) m_tail[i] = (1 - m_hann[i]) * m_in[i];
+        m_fresh = false;
+    }
+
+    if (m_outPos) {
+        m_out.erase(m_out.begin(), m_out.begin() + m_outPos);
+        m_outPos = 0;
+    }
+    for (size_t i = 0; i < m_hop; i++) {
+        const float v = m_tail[i] + m_hann[i] * m_in[k + i];
+        m_out.push_back((int16_t) std::max(-32768.0f, std::min(32767.0f, v)));
+        m_tail[i] = m_hann[m_hop + i] * m_in[k + m_hop + i];
+    }
+    m_natural = k + m_hop;
+    m_nominal += m_hop * speed;
+
+    // input no later window can reach
+    const size_t drop = std::min(m_natural, (size_t) m_nominal > m_tolerance ? (size_t) m_nominal - m_tolerance : 0);
+    if (drop) {
+        m_in.erase(m_in.begin(), m_in.begin() + drop);
+        m_natural -= drop;
+        m_nominal -= drop;
+    }
+}
+
+// back to normal speed: what follows the last window, the first half overlapped with its tail
+void TimeStretch::flush() {
+    if (m_outPos) {
+        m_out.erase(m_out.begin(), m_out.begin() + m_outPos);
+        m_outPos = 0;
+    }
+    if (!m_fresh) {
+        for (size_t i = 0; i < m_hop; i++) {
+            const float v = m_tail[i] + (m_natural + i < m_in.size() ? m_hann[i] * m_in[m_natural + i] : 0);
+            m_out.push_back((int16_t) std::max(-32768.0f, std::min(32767.0f, v)));
+        }
+        for (size_t i = m_natural + m_hop; i < m_in.size(); i++) m_out.push_back(m_in[i]);
+    } else {
+        m_out.insert(m_out.end(), m_in.begin(), m_in.end());
+    }
+    m_in.clear();
+    m_active = false;
+}
+
+size_t TimeStretch::take(int16_t* out, size_t samples) {
+    const size_t n = std::min(samples, m_out.size() - m_outPos);
+    std::copy(m_out.begin() + m_outPos, m_out.begin() + m_outPos + n, out);
+    m_outPos += n;
+    if (m_outPos == m_out.size()) {
+        m_out.clear();
+        m_outPos = 0;
+    }
+    return n;
+}
+
+// the window start in [from, to] that best continues m_in[natural...], by normalized
+// cross-correlation over half a window: every other sample and start first, then refined
+size_t TimeStretch::bestOffset(size_t from, size_t to, size_t natural) const {
+    const int16_t* ref = m_in.data() + natural;
+    auto score = [&](size_t at, size_t stride) {
+        const int16_t* x = m_in.data() + at;
+        double corr = 0, energy = 1;
+        for (size_t i = 0; i < m_hop; i += stride) {
+            corr += (double) x[i] * ref[i];
+            energy += (double) x[i] * x[i];
+        }
+        return corr / sqrt(energy);
+    };
+
+    size_t best = from;
+    double bestScore = -INFINITY;
+    for (size_t at = from; at <= to; at += 2) {
+        const double s = score(at, 2);
+        if (s > bestScore) {
+            bestScore = s;
+            best = at;
+        }
+    }
+    const size_t lo = best > from ? best - 1 : from;
+    const size_t hi = std::min(best + 1, to);
+    bestScore = -INFINITY;
+    for (size_t at = lo; at <= hi; at++) {
+        const double s = score(at, 1);
+        if (s > bestScore) {
+            bestScore = s;
+            best = at;
+        }
+    }
+    return best;
+}
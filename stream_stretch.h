@@ -0,0 +1,59 @@
+#ifndef STREAM_STRETCH_H
+#define STREAM_STRETCH_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+#include "stream_playback.h"
+
+/*
+ * Playout speed control between the playback queue and the frame injector (WSOLA).
+ *
+ * Past the target backlog the queued audio is played faster, up to maxSpeedup percent at
+ * twice the target; close to running dry it is played up to maxSlowdown percent slower.
+ * Pitch is kept: the output is built from 20 ms windows of the input, overlapped by half,
+ * each taken where it best continues the previous one within 5 ms of its nominal place.
+ * At normal speed nothing is done beyond handing back what the last windows still held.
+ */
+
+class TimeStretch {
+public:
+    TimeStretch(int rate, int targetMs, int maxSpeedup, int maxSlowdown);
+
+    TimeStretch(const TimeStretch&) = delete;
+    TimeStretch& operator=(const TimeStretch&) = delete;
+
+    // playout speed for backlogMs of queued audio, 1 when within bounds
+    double speed(double backlogMs) const;
+    // fills out with up to samples mono samples played at speed, taken from queue; fewer
+    // when the queue runs dry
+    size_t render(PlaybackQueue& queue, int16_t* out, size_t samples, double speed);
+    // input taken from the queue and not played yet
+    size_t held() const;
+    // drops the held audio, for when what is queued was cancelled
+    void reset();
+
+private:
+    void step(double speed);
+    void flush();
+    size_t take(int16_t* out, size_t samples);
+    size_t bestOffset(size_t from, size_t to, size_t natural) const;
+
+    const size_t m_window;          // samples per window, 20 ms
+    const size_t m_hop;             // output samples per window, half of it
+    const size_t m_tolerance;       // search range around the nominal place, 5 ms
+    const int m_targetMs;
+    const double m_maxSpeedup;
+    const double m_maxSlowdown;
+    std::vector<float> m_hann;
+    std::vector<float> m_tail;      // second half of the last window, weighted
+    std::vector<int16_t> m_in;      // input from m_in[0]
+    std::vector<int16_t> m_out;     // output ready from m_outPos
+    size_t m_outPos = 0;
+    double m_nominal = 0;           // where the next window would start at normal speed
+    size_t m_natural = 0;           // what follows the last window in the input
+    bool m_active = false;
+    bool m_fresh = false;           // active, no window taken yet
+};
+
+#endif //STREAM_STRETCH_H
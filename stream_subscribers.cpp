@@ -0,0 +1,162 @@
+#include <mutex>
+#include <atomic>
+#include <thread>
+#include <memory>
+#include <vector>
+#include <functional>
+#include <unordered_map>
+#include "mod_audio_stream.h"
+#include "stream_subscribers.h"
+
+#define SUBSCRIBER_SHARDS (16)
+
+struct audio_stream_subscription {
+    std::string uuid;
+    audio_stream_callback_t callback;
+    void *userData;
+    std::atomic<bool> active{true};
+    std::atomic<int> running{0};
+};
+
+namespace {
+
+    typedef std::shared_ptr<audio_stream_subscription> SubscriptionRef;
+
+    // the subscription whose callback this thread is in, lets it unsubscribe itself
+    thread_local audio_stream_subscription* t_current = nullptr;
+
+    /*
+     * Per session subscriptions live in shards keyed by uuid so that dispatching for one call
+     * only contends with the calls of the same shard. The lock is held just long enough to take
+     * a reference on the subscriptions, never while a callback runs.
+     */
+    class Subscribers {
+    public:
+        audio_stream_subscription* subscribe(const char* uuid, audio_stream_callback_t callback, void* userData) {
+            SubscriptionRef sub = std::make_shared<audio_stream_subscription>();
+            sub->uuid = uuid ? uuid : "";
+            sub->callback = callback;
+            sub->userData = userData;
+
+            if (uuid) {
+                Shard& shard = shardOf(sub->uuid);
+                std::lock_guard<std::mutex> guard(shard.lock);
+                shard.bySession[sub->uuid].push_back(sub);
+            } else {
+                std::lock_guard<std::mutex> guard(m_globalLock);
+                m_global.push_back(sub);
+            }
+            m_count++;
+            return sub.get();
+        }
+
+        void unsubscribe(audio_stream_subscription* sub) {
+            SubscriptionRef ref;
+            if (!sub->uuid.empty()) {
+                Shard& shard = shardOf(sub->uuid);
+                std::lock_guard<std::mutex> guard(shard.lock);
+                auto it = shard.bySession.find(sub->uuid);
+                if (it != shard.bySession.end()) {
+                    ref = take(it->second, sub);
+                    if (it->second.empty()) shard.bySession.erase(it);
+                }
+            } else {
+                std::lock_guard<std::mutex> guard(m_globalLock);
+                ref = take(m_global, sub);
+            }
+            if (!ref) return;
+            m_count--;
+
+            ref->active = false;
+            // a callback unsubscribing itself is the one still running
+            const int self = t_current == sub ? 1 : 0;
+            while (ref->running > self) std::this_thread::yield();
+        }
+
+        void dispatch(const std::string& uuid, const char* eventName, const char* json, switch_size_t len) {
+            if (!m_count) return;
+
+            std::vector<SubscriptionRef> targets;
+            {
+                Shard& shard = shardOf(uuid);
+                std::lock_guard<std::mutex> guard(shard.lock);
+                auto it = shard.bySession.find(uuid);
+                if (it != shard.bySession.end()) targets = it->second;
+            }
+            {
+                std::lock_guard<std::mutex> guard(m_globalLock);
+                targets.insert(targets.end(), m_global.begin(), m_global.end());
+            }
+            if (targets.empty()) return;
+
+            for (const auto& sub : targets) {
+                sub->running++;
+                if (sub->active) {
+                    audio_stream_subscription* outer = t_current;
+                    t_current = sub.get();
+                    sub->callback(uuid.c_str(), eventName, json, len, sub->userData);
+                    t_current = outer;
+                    m_delivered++;
+                }
+                sub->running--;
+            }
+        }
+
+        void stats(cJSON* root) {
+            cJSON* item = cJSON_CreateObject();
+            cJSON_AddNumberToObject(item, "subscriptions", m_count.load());
+            cJSON_AddNumberToObject(item, "delivered", (double) m_delivered.load());
+            cJSON_AddItemToObject(root, "subscribers", item);
+        }
+
+    private:
+        struct Shard {
+            std::mutex lock;
+            std::unordered_map<std::string, std::vector<SubscriptionRef>> bySession;
+        };
+
+        Shard& shardOf(const std::string& uuid) {
+            return m_shards[std::hash<std::string>()(uuid) % SUBSCRIBER_SHARDS];
+        }
+
+        static SubscriptionRef take(std::vector<SubscriptionRef>& subs, audio_stream_subscription* sub) {
+            for (auto it = subs.begin(); it != subs.end(); ++it) {
+                if (it->get() == sub) {
+                    SubscriptionRef ref = *it;
+                    subs.erase(it);
+                    return ref;
+                }
+            }
+            return nullptr;
+        }
+
+        Shard m_shards[SUBSCRIBER_SHARDS];
+        std::mutex m_globalLock;
+        std::vector<SubscriptionRef> m_global;
+        std::atomic<int> m_count{0};
+        std::atomic<uint64_t> m_delivered{0};
+    };
+
+    Subscribers& subscribers() {
+        static Subscribers instance;
+        return instance;
+    }
+}
+
+SWITCH_MOD_DECLARE(audio_stream_subscription_t *) audio_stream_subscribe(const char *uuid, audio_stream_callback_t callback,
+                                                                         void *user_data) {
+    if (!callback) return nullptr;
+    return subscribers().subscribe(uuid, callback, user_data);
+}
+
+SWITCH_MOD_DECLARE(void) audio_stream_unsubscribe(audio_stream_subscription_t *subscription) {
+    if (subscription) subscribers().unsubscribe(subscription);
+}
+
+void subscribers_dispatch(const std::string &uuid, const char *eventName, const char *json, size_t len) {
+    subscribers().dispatch(uuid, eventName, json, len);
+}
+
+void subscribers_stats(cJSON *root) {
+    subscribers().stats(root);
+}
@@ -0,0 +1,44 @@
+#ifndef STREAM_SUBSCRIBERS_H
+#define STREAM_SUBSCRIBERS_H
+
+#include <switch.h>
+#include <switch_json.h>
+
+/*
+ * In-process delivery of the stream events (connect, json, play, ...) to other modules,
+ * without going through the FreeSWITCH event bus.
+ *
+ * The callback runs on the thread that received the message. json points into the module's
+ * own buffer and is only valid for the duration of the call; copy what must outlive it, and
+ * hand heavy work off to another thread. Once audio_stream_unsubscribe returns the callback
+ * is no longer running and will not be called again.
+ *
+ * The symbols are exported from mod_audio_stream.so: load the module with global="true" in
+ * modules.conf.xml or look them up with switch_dso_func_sym.
+ */
+
+SWITCH_BEGIN_EXTERN_C
+
+typedef struct audio_stream_subscription audio_stream_subscription_t;
+
+typedef void (*audio_stream_callback_t)(const char *uuid, const char *event_name, const char *json, switch_size_t len,
+                                        void *user_data);
+
+// uuid NULL subscribes to the events of every session
+SWITCH_MOD_DECLARE(audio_stream_subscription_t *) audio_stream_subscribe(const char *uuid, audio_stream_callback_t callback,
+                                                                         void *user_data);
+// may be called from within the subscription's own callback
+SWITCH_MOD_DECLARE(void) audio_stream_unsubscribe(audio_stream_subscription_t *subscription);
+
+SWITCH_END_EXTERN_C
+
+#ifdef __cplusplus
+#include <string>
+
+// delivers an event to the subscribers of the session and the global ones
+void subscribers_dispatch(const std::string &uuid, const char *eventName, const char *json, size_t len);
+// adds the subscription counters to a JSON object
+void subscribers_stats(cJSON *root);
+#endif
+
+#endif //STREAM_SUBSCRIBERS_H
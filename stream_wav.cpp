@@ -0,0 +1,118 @@
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include "stream_wav.h"
+
+#define WAV_OPEN_SIZE  (0xFFFFFFFFu)    // sizes until close() patches them
+
+namespace {
+
+    uint8_t* put_le16(uint8_t* p, uint16_t value) {
+        p[0] = value & 0xFF;
+        p[1] = (value >> 8) & 0xFF;
+        return p + 2;
+    }
+
+    uint8_t* put_le32(uint8_t* p, uint32_t value) {
+        p[0] = value & 0xFF;
+        p[1] = (value >> 8) & 0xFF;
+        p[2] = (value >> 16) & 0xFF;
+        p[3] = (value >> 24) & 0xFF;
+        return p + 4;
+    }
+
+    uint8_t* put_tag(uint8_t* p, const char* tag) {
+        for (int i = 0; i < 4; i++) *p++ = tag[i];
+        return p;
+    }
+
+    bool write_all(int fd, struct iovec* iov, int count) {
+        while (count > 0) {
+            ssize_t n = writev(fd, iov, count);
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                return false;
+            }
+            while (count > 0 && (size_t) n >= iov->iov_len) {
+                n -= iov->iov_len;
+                iov++;
+                count--;
+            }
+            if (count > 0) {
+                iov->iov_base = (uint8_t*) iov->iov_base + n;
+                iov->iov_len -= n;
+            }
+        }
+        return true;
+    }
+}
+
+uint32_t wav_header(uint8_t* out, WavFormat format, int rate, int channels, int bitsPerSample, uint32_t dataBytes) {
+    // PCM uses the 16 byte fmt chunk, the others the 18 byte one with an empty extension
+    const uint32_t fmtSize = format == WAV_PCM ? 16 : 18;
+    const uint32_t headerBytes = 28 + fmtSize;
+    const uint16_t blockAlign = channels * bitsPerSample / 8;
+    uint8_t* p = put_tag(out, "RIFF");
+    p = put_le32(p, dataBytes == WAV_OPEN_SIZE ? WAV_OPEN_SIZE : headerBytes - 8 + dataBytes);
+    p = put_tag(p, "WAVE");
+    p = put_tag(p, "fmt ");
+    p = put_le32(p, fmtSize);
+    p = put_le16(p, format);
+    p = put_le16(p, channels);
+    p = put_le32(p, rate);
+    p = put_le32(p, rate * blockAlign);
+    p = put_le16(p, blockAlign);
+    p = put_le16(p, bitsPerSample);
+    if (fmtSize == 18) p = put_le16(p, 0);
+    p = put_tag(p, "data");
+    put_le32(p, dataBytes);
+    return headerBytes;
+}
+
+bool WavWriter::open(const std::string& path, WavFormat format, int rate, int channels, int bitsPerSample) {
+    close();
+    m_fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (m_fd < 0) return false;
+    m_path = path;
+    m_dataBytes = 0;
+
+    uint8_t header[WAV_HEADER_MAX];
+    m_headerBytes = wav_header(header, format, rate, channels, bitsPerSample, WAV_OPEN_SIZE);
+    struct iovec iov = { header, m_headerBytes };
+    if (!write_all(m_fd, &iov, 1)) {
+        ::close(m_fd);
+        m_fd = -1;
+        return false;
+    }
+    return true;
+}
+
+int64_t WavWriter::append(const void* data, size_t len) {
+    struct iovec iov = { const_cast<void*>(data), len };
+    return append(&iov, 1);
+}
+
+int64_t WavWriter::append(struct iovec* iov, int count) {
+    if (m_fd < 0) return -1;
+    size_t len = 0;
+    for (int i = 0; i < count; i++) len += iov[i].iov_len;
+    const int64_t offset = m_headerBytes + m_dataBytes;
+    if (!write_all(m_fd, iov, count)) return -1;
+    m_dataBytes += len;
+    return offset;
+}
+
+bool WavWriter::close() {
+    if (m_fd < 0) return false;
+    bool patched = false;
+    // sizes past 4 GB stay open ended
+    if (m_dataBytes + m_headerBytes - 8 < WAV_OPEN_SIZE) {
+        uint8_t riffSize[4], dataSize[4];
+        put_le32(riffSize, (uint32_t) (m_headerBytes - 8 + m_dataBytes));
+        put_le32(dataSize, (uint32_t) m_dataBytes);
+        patched = pwrite(m_fd, riffSize, 4, 4) == 4 && pwrite(m_fd, dataSize, 4, m_headerBytes - 4) == 4;
+    }
+    ::close(m_fd);
+    m_fd = -1;
+    return patched;
+}
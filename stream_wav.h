@@ -0,0 +1,56 @@
+#ifndef STREAM_WAV_H
+#define STREAM_WAV_H
+
+#include <string>
+#include <stdint.h>
+#include <sys/uio.h>
+
+/*
+ * A WAV file written as the audio arrives. The header goes out first with open ended sizes,
+ * which common readers take as "up to the end of the file", the audio is appended and the
+ * real sizes are patched in by close().
+ */
+
+enum WavFormat {
+    WAV_PCM = 1,
+    WAV_ALAW = 6,
+    WAV_MULAW = 7
+};
+
+#define WAV_HEADER_MAX  (46)
+
+// fills out with a complete header for dataBytes of audio, UINT32_MAX for open ended sizes,
+// and returns its length
+uint32_t wav_header(uint8_t* out, WavFormat format, int rate, int channels, int bitsPerSample, uint32_t dataBytes);
+
+class WavWriter {
+public:
+    WavWriter() = default;
+    ~WavWriter() { close(); }
+
+    WavWriter(const WavWriter&) = delete;
+    WavWriter& operator=(const WavWriter&) = delete;
+
+    // creates or truncates path and writes the header
+    bool open(const std::string& path, WavFormat format, int rate, int channels, int bitsPerSample);
+    // returns the position in the file the data was written at, -1 on error
+    int64_t append(const void* data, size_t len);
+    // several buffers with one system call
+    int64_t append(struct iovec* iov, int count);
+    // patches the sizes into the header and closes the file, false when they could not be
+    // (the file is then still readable as open ended)
+    bool close();
+
+    bool isOpen() const { return m_fd >= 0; }
+    const std::string& path() const { return m_path; }
+    uint64_t dataBytes() const { return m_dataBytes; }
+    uint32_t headerBytes() const { return m_headerBytes; }
+
+private:
+    int m_fd = -1;
+    std::string m_path;
+    uint32_t m_headerBytes = 0;
+    uint64_t m_dataBytes = 0;
+};
+
+#endif //STREAM_WAV_H
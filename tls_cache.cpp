@@ -0,0 +1,130 @@
+#include <mutex>
+#include <unordered_map>
+#include "mod_audio_stream.h"
+#include <switch_json.h>
+#include "tls_cache.h"
+
+namespace {
+
+    struct TlsPeer {
+        std::string peer;           // host:port
+        SSL_SESSION* session = nullptr;
+        uint64_t handshakes = 0;    // full ones
+        uint64_t resumed = 0;
+        uint64_t pooled = 0;
+        int64_t handshakeUsecTotal = 0;
+        int64_t handshakeUsecMax = 0;
+        int64_t handshakeUsecLast = 0;
+        int64_t resumeUsecTotal = 0;
+    };
+
+    std::mutex g_lock;
+    std::unordered_map<std::string, TlsPeer> g_peers;
+
+    std::string host_port(const std::string& uri) {
+        // validate_ws_uri already checked the shape: wss://host[:port][/path]
+        size_t start = uri.find("://");
+        start = start == std::string::npos ? 0 : start + 3;
+        size_t end = uri.find('/', start);
+        std::string hp = uri.substr(start, end == std::string::npos ? std::string::npos : end - start);
+        if (hp.find(':') == std::string::npos) hp.append(":443");
+        return hp;
+    }
+
+    // a session is only offered to connections made with the same TLS options
+    TlsPeer& peer_for(const TransportConfig& cfg) {
+        std::string hp = host_port(cfg.uri);
+        std::string key(hp);
+        key.append("|").append(cfg.tls.caFile);
+        key.append("|").append(cfg.tls.certFile);
+        key.append("|").append(cfg.tls.keyFile);
+        key.append(cfg.tls.disableHostnameValidation ? "|1" : "|0");
+        TlsPeer& peer = g_peers[key];
+        if (peer.peer.empty()) peer.peer = hp;
+        return peer;
+    }
+
+    void full_handshake(TlsPeer& peer, int64_t usec) {
+        peer.handshakes++;
+        peer.handshakeUsecTotal += usec;
+        peer.handshakeUsecLast = usec;
+        if (usec > peer.handshakeUsecMax) peer.handshakeUsecMax = usec;
+    }
+}
+
+bool tls_cache_applies(const TransportConfig& cfg) {
+    return 0 == cfg.uri.compare(0, 6, "wss://");
+}
+
+void tls_cache_handshake(const TransportConfig& cfg, int64_t usec) {
+    std::lock_guard<std::mutex> guard(g_lock);
+    full_handshake(peer_for(cfg), usec);
+}
+
+void tls_cache_pooled(const TransportConfig& cfg) {
+    std::lock_guard<std::mutex> guard(g_lock);
+    peer_for(cfg).pooled++;
+}
+
+void tls_cache_resume(const TransportConfig& cfg, SSL* ssl) {
+    std::lock_guard<std::mutex> guard(g_lock);
+    TlsPeer& peer = peer_for(cfg);
+    // SSL_set_session takes its own reference
+    if (peer.session) SSL_set_session(ssl, peer.session);
+}
+
+void tls_cache_connected(const TransportConfig& cfg, SSL* ssl, int64_t usec) {
+    // called once the upgrade response is read rather than right after SSL_connect: with
+    // TLS 1.3 the server sends its tickets after the handshake, they have arrived by now
+    SSL_SESSION* session = SSL_get1_session(ssl);
+    if (session && !SSL_SESSION_is_resumable(session)) {
+        SSL_SESSION_free(session);
+        session = nullptr;
+    }
+    std::lock_guard<std::mutex> guard(g_lock);
+    TlsPeer& peer = peer_for(cfg);
+    if (SSL_session_reused(ssl)) {
+        peer.resumed++;
+        peer.resumeUsecTotal += usec;
+    } else {
+        full_handshake(peer, usec);
+    }
+    if (session) {
+        if (peer.session) SSL_SESSION_free(peer.session);
+        peer.session = session;
+    }
+}
+
+char* tls_cache_status() {
+    cJSON* root = cJSON_CreateArray();
+    {
+        std::lock_guard<std::mutex> guard(g_lock);
+        for (const auto& it : g_peers) {
+            const TlsPeer& peer = it.second;
+            uint64_t tls = peer.handshakes + peer.resumed;
+            cJSON* item = cJSON_CreateObject();
+            cJSON_AddStringToObject(item, "peer", peer.peer.c_str());
+            cJSON_AddNumberToObject(item, "handshakes", peer.handshakes);
+            cJSON_AddNumberToObject(item, "resumed", peer.resumed);
+            cJSON_AddNumberToObject(item, "resumeRatio", tls ? (double) peer.resumed / tls : 0.0);
+            cJSON_AddNumberToObject(item, "pooled", peer.pooled);
+            cJSON_AddItemToObject(item, "sessionCached", cJSON_CreateBool(peer.session != nullptr));
+            cJSON_AddNumberToObject(item, "handshakeAvgMs", peer.handshakes ? peer.handshakeUsecTotal / 1000.0 / peer.handshakes : 0.0);
+            cJSON_AddNumberToObject(item, "handshakeMaxMs", peer.handshakeUsecMax / 1000.0);
+            cJSON_AddNumberToObject(item, "handshakeLastMs", peer.handshakeUsecLast / 1000.0);
+            cJSON_AddNumberToObject(item, "resumeAvgMs", peer.resumed ? peer.resumeUsecTotal / 1000.0 / peer.resumed : 0.0);
+            cJSON_AddItemToArray(root, item);
+        }
+    }
+    char* json = cJSON_PrintUnformatted(root);
+    cJSON_Delete(root);
+    return json;
+}
+
+void tls_cache_shutdown() {
+    std::lock_guard<std::mutex> guard(g_lock);
+    for (auto& it : g_peers) {
+        if (it.second.session) SSL_SESSION_free(it.second.session);
+        it.second.session = nullptr;
+    }
+}
@@ -0,0 +1,35 @@
+#ifndef TLS_CACHE_H
+#define TLS_CACHE_H
+
+#include <stdint.h>
+#include <openssl/ssl.h>
+#include "ws_transport.h"
+
+/*
+ * Process-wide TLS session cache and stats, keyed by host:port and TLS options.
+ *
+ * Connections that own their SSL object (the event loop transport) resume the last session
+ * stored for their peer, so only the first connection to a peer pays for a full handshake.
+ * libwsc clients build their own SSL context and always do a full one.
+ *
+ * Also counts the wss call setups served without any handshake, by a pooled or multiplexed
+ * connection.
+ */
+
+bool tls_cache_applies(const TransportConfig& cfg);
+// a full handshake done by a libwsc client, usec from connect to open
+void tls_cache_handshake(const TransportConfig& cfg, int64_t usec);
+// a call setup served by a connection that was already open
+void tls_cache_pooled(const TransportConfig& cfg);
+
+// before SSL_connect: offers the session stored for the peer, if any
+void tls_cache_resume(const TransportConfig& cfg, SSL* ssl);
+// once the connection is open: counts a full or resumed handshake and stores the session
+void tls_cache_connected(const TransportConfig& cfg, SSL* ssl, int64_t usec);
+
+// JSON array with per peer counters, caller frees
+char* tls_cache_status();
+// frees the stored sessions
+void tls_cache_shutdown();
+
+#endif //TLS_CACHE_H
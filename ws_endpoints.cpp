@@ -0,0 +1,152 @@
+#include <mutex>
+#include <chrono>
+#include <algorithm>
+#include <unordered_map>
+#include "mod_audio_stream.h"
+#include "ws_endpoints.h"
+#include "stream_metrics.h"
+
+#define ENDPOINT_BACKOFF_MS      (1000)
+#define ENDPOINT_MAX_BACKOFF_MS  (30000)
+
+namespace {
+
+    typedef std::chrono::steady_clock endpoint_clock;
+
+    struct EndpointHealth {
+        int active = 0;
+        int failures = 0;           // consecutive
+        uint64_t connects = 0;
+        uint64_t failed = 0;
+        double connectMsAvg = 0;    // moving average
+        endpoint_clock::time_point retryAt;
+    };
+
+    std::mutex g_lock;
+    std::unordered_map<std::string, EndpointHealth> g_endpoints;
+
+    double score(const EndpointHealth& e, EndpointPolicy policy) {
+        if (policy == ENDPOINT_LATENCY) {
+            // endpoints nobody connected to yet get tried
+            return (e.active + 1) * (e.connects ? e.connectMsAvg + 1 : 1);
+        }
+        return e.active;
+    }
+}
+
+EndpointPolicy endpoint_policy(const char* name) {
+    if (name && strcasecmp(name, "latency") == 0) return ENDPOINT_LATENCY;
+    return ENDPOINT_LEAST_CONNECTIONS;
+}
+
+std::vector<std::string> endpoint_split(const std::string& list) {
+    std::vector<std::string> out;
+    size_t start = 0;
+    while (start <= list.size()) {
+        size_t end = list.find(',', start);
+        if (end == std::string::npos) end = list.size();
+        std::string uri = list.substr(start, end - start);
+        uri.erase(0, uri.find_first_not_of(" \t"));
+        uri.erase(uri.find_last_not_of(" \t") + 1);
+        if (!uri.empty() && std::find(out.begin(), out.end(), uri) == out.end()) out.push_back(uri);
+        start = end + 1;
+    }
+    return out;
+}
+
+std::string endpoint_pick(const std::vector<std::string>& endpoints, EndpointPolicy policy) {
+    if (endpoints.size() == 1) return endpoints[0];
+
+    const auto now = endpoint_clock::now();
+    std::lock_guard<std::mutex> guard(g_lock);
+    const std::string* best = nullptr;
+    double bestScore = 0;
+    const std::string* soonest = nullptr;
+    endpoint_clock::time_point soonestAt;
+    for (const auto& uri : endpoints) {
+        const EndpointHealth& e = g_endpoints[uri];
+        if (e.failures && e.retryAt > now) {
+            if (!soonest || e.retryAt < soonestAt) {
+                soonest = &uri;
+                soonestAt = e.retryAt;
+            }
+            continue;
+        }
+        // ties go to the first listed, so the list order is the failover order
+        double s = score(e, policy);
+        if (!best || s < bestScore) {
+            best = &uri;
+            bestScore = s;
+        }
+    }
+    return best ? *best : *soonest;
+}
+
+void endpoint_connected(const std::string& uri, int64_t connectUsec) {
+    std::lock_guard<std::mutex> guard(g_lock);
+    EndpointHealth& e = g_endpoints[uri];
+    double ms = connectUsec / 1000.0;
+    e.connectMsAvg = e.connects ? e.connectMsAvg * 0.8 + ms * 0.2 : ms;
+    e.connects++;
+    e.active++;
+    if (e.failures) {
+        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_INFO, "endpoint %s is healthy again\n", uri.c_str());
+        e.failures = 0;
+    }
+}
+
+void endpoint_released(const std::string& uri) {
+    std::lock_guard<std::mutex> guard(g_lock);
+    EndpointHealth& e = g_endpoints[uri];
+    if (e.active > 0) e.active--;
+}
+
+void endpoint_failed(const std::string& uri) {
+    std::lock_guard<std::mutex> guard(g_lock);
+    EndpointHealth& e = g_endpoints[uri];
+    int backoff = std::min(ENDPOINT_MAX_BACKOFF_MS, ENDPOINT_BACKOFF_MS << std::min(e.failures, 5));
+    e.failures++;
+    e.failed++;
+    e.retryAt = endpoint_clock::now() + std::chrono::milliseconds(backoff);
+    switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "endpoint %s failed to connect, skipped for %d ms\n",
+                      uri.c_str(), backoff);
+}
+
+void endpoint_stats(cJSON* root) {
+    const auto now = endpoint_clock::now();
+    cJSON* list = cJSON_CreateArray();
+    std::lock_guard<std::mutex> guard(g_lock);
+    for (const auto& it : g_endpoints) {
+        const EndpointHealth& e = it.second;
+        bool backingOff = e.failures && e.retryAt > now;
+        cJSON* item = cJSON_CreateObject();
+        cJSON_AddStringToObject(item, "uri", it.first.c_str());
+        cJSON_AddStringToObject(item, "health", backingOff ? "unhealthy" : "healthy");
+        cJSON_AddNumberToObject(item, "active", e.active);
+        cJSON_AddNumberToObject(item, "connects", e.connects);
+        cJSON_AddNumberToObject(item, "failed", e.failed);
+        cJSON_AddNumberToObject(item, "connectMsAvg", (int64_t) e.connectMsAvg);
+        if (backingOff) {
+            cJSON_AddNumberToObject(item, "retryInMs",
+                                    std::chrono::duration_cast<std::chrono::milliseconds>(e.retryAt - now).count());
+        }
+        cJSON_AddItemToArray(list, item);
+    }
+    cJSON_AddItemToObject(root, "endpoints", list);
+}
+
+void endpoint_prometheus(std::string& out) {
+    const auto now = endpoint_clock::now();
+    std::lock_guard<std::mutex> guard(g_lock);
+    metrics_family(out, "active_streams", "gauge");
+    for (const auto& it : g_endpoints) metrics_sample(out, "active_streams", it.first, it.second.active);
+    metrics_family(out, "endpoint_up", "gauge");
+    for (const auto& it : g_endpoints) {
+        const EndpointHealth& e = it.second;
+        metrics_sample(out, "endpoint_up", it.first, e.failures && e.retryAt > now ? 0 : 1);
+    }
+    metrics_family(out, "endpoint_connects_total", "counter");
+    for (const auto& it : g_endpoints) metrics_sample(out, "endpoint_connects_total", it.first, (double) it.second.connects);
+    metrics_family(out, "connect_failures_total", "counter");
+    for (const auto& it : g_endpoints) metrics_sample(out, "connect_failures_total", it.first, (double) it.second.failed);
+}
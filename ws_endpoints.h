@@ -0,0 +1,40 @@
+#ifndef WS_ENDPOINTS_H
+#define WS_ENDPOINTS_H
+
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include <switch_json.h>
+
+/*
+ * Process-wide health of the websocket endpoints, keyed by url.
+ *
+ * A call may be started with several endpoints; each connection attempt picks one of them.
+ * Endpoints that fail to connect are skipped for a backoff period that doubles with every
+ * consecutive failure, and a successful connect makes them healthy again.
+ */
+
+enum EndpointPolicy {
+    ENDPOINT_LEAST_CONNECTIONS,     // fewest streams currently connected
+    ENDPOINT_LATENCY                // fewest streams weighted by the average connect time
+};
+
+EndpointPolicy endpoint_policy(const char* name);
+
+// splits a comma separated list of urls
+std::vector<std::string> endpoint_split(const std::string& list);
+
+// the endpoint for the next connection attempt: a healthy one by policy, or the one
+// whose backoff ends first when none is
+std::string endpoint_pick(const std::vector<std::string>& endpoints, EndpointPolicy policy);
+
+void endpoint_connected(const std::string& uri, int64_t connectUsec);
+void endpoint_released(const std::string& uri);
+void endpoint_failed(const std::string& uri);
+
+// adds the endpoint table to a JSON object
+void endpoint_stats(cJSON* root);
+// appends the endpoint table in Prometheus text format
+void endpoint_prometheus(std::string& out);
+
+#endif //WS_ENDPOINTS_H
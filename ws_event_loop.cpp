@@ -0,0 +1,1126 @@
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <future>
+#include <deque>
+#include <vector>
+#include <condition_variable>
+#include <unordered_map>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+#include <unistd.h>
+#include <errno.h>
+#include <strings.h>
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include <openssl/rand.h>
+#include <openssl/sha.h>
+#include "mod_audio_stream.h"
+#include "ws_event_loop.h"
+#include "tls_cache.h"
+#include "base64.h"
+
+#define LOOP_TICK_MS             (250)
+#define LOOP_CONNECT_TIMEOUT_MS  (10000)
+#define LOOP_READ_CHUNK          (16384)
+#define LOOP_MAX_PENDING_BYTES   (8 * 1024 * 1024)  // unsent data per connection before frames are dropped
+#define LOOP_MAX_FRAME_BYTES     (64 * 1024 * 1024)
+#define LOOP_MAX_HANDSHAKE_BYTES (16384)
+#define LOOP_RESOLVERS           (4)      // threads running host lookups
+
+namespace {
+
+    typedef std::chrono::steady_clock loop_clock;
+
+    // same codes as libwsc reports, see the error event in the README
+    enum {
+        WS_ERR_IO = 1,
+        WS_ERR_INVALID_HEADER = 2,
+        WS_ERR_SERVER_MASKED = 3,
+        WS_ERR_NOT_SUPPORTED = 4,
+        WS_ERR_PING_TIMEOUT = 5,
+        WS_ERR_CONNECT_FAILED = 6,
+        WS_ERR_TLS_INIT_FAILED = 7,
+        WS_ERR_SSL_HANDSHAKE_FAILED = 8,
+        WS_ERR_SSL_ERROR = 9
+    };
+
+    enum { WS_OP_CONT = 0x0, WS_OP_TEXT = 0x1, WS_OP_BINARY = 0x2, WS_OP_CLOSE = 0x8, WS_OP_PING = 0x9, WS_OP_PONG = 0xA };
+
+    std::string ssl_error_string() {
+        char buf[256];
+        unsigned long err = ERR_get_error();
+        if (!err) return "unknown TLS error";
+        ERR_error_string_n(err, buf, sizeof(buf));
+        ERR_clear_error();
+        return buf;
+    }
+
+    struct ParsedUri {
+        bool tls = false;
+        std::string host;
+        std::string port;
+        std::string path;
+    };
+
+    bool parse_uri(const std::string& uri, ParsedUri& out) {
+        size_t start;
+        if (uri.compare(0, 6, "wss://") == 0) {
+            out.tls = true;
+            start = 6;
+        } else if (uri.compare(0, 5, "ws://") == 0) {
+            start = 5;
+        } else {
+            return false;
+        }
+        size_t slash = uri.find('/', start);
+        std::string authority = uri.substr(start, slash == std::string::npos ? std::string::npos : slash - start);
+        out.path = slash == std::string::npos ? "/" : uri.substr(slash);
+
+        size_t colon;
+        if (!authority.empty() && authority[0] == '[') {
+            size_t close = authority.find(']');
+            if (close == std::string::npos) return false;
+            out.host = authority.substr(1, close - 1);
+            colon = authority.find(':', close);
+        } else {
+            colon = authority.find(':');
+            out.host = authority.substr(0, colon);
+        }
+        out.port = colon == std::string::npos ? (out.tls ? "443" : "80") : authority.substr(colon + 1);
+        return !out.host.empty() && !out.port.empty();
+    }
+
+    class EventLoop;
+    SSL_CTX* tls_context(const TransportConfig& cfg, std::string& error);
+
+    /*
+     * One websocket connection. Socket and TLS state are guarded by m_lock: the loop thread
+     * reads, any thread may send. Callbacks are collected under the lock and delivered by
+     * the loop thread once it is released.
+     */
+    class LoopConnection : public std::enable_shared_from_this<LoopConnection> {
+    public:
+        LoopConnection(const TransportConfig& cfg, const std::string& sessionId, const TransportCallbacks& cb):
+            m_cfg(cfg), m_sessionId(sessionId), m_cb(cb) {
+            RAND_bytes((unsigned char*) &m_maskSeed, sizeof(m_maskSeed));
+            m_maskSeed |= 1;
+        }
+
+        ~LoopConnection() {
+            if (m_ssl) SSL_free(m_ssl);
+            if (m_fd >= 0) ::close(m_fd);
+        }
+
+        // caller thread: hands the host lookup to the resolver threads, see resolved()
+        void start(const std::shared_ptr<EventLoop>& loop);
+
+        // loop thread
+        void resolved(struct addrinfo* res, const std::string& error);
+        void registered() { m_registered = true; }
+        void onEvents(uint32_t events);
+        void onTick(loop_clock::time_point now);
+        void shutdown();
+        void failAsync(int code, const std::string& msg);
+
+        int fd() const { return m_fd; }
+        const std::shared_ptr<EventLoop>& loop() const { return m_loop; }
+        bool isOpen() const { return m_state == OPEN; }
+        uint64_t dropped() const { return m_dropped; }
+
+        // any thread
+        void send(uint8_t opcode, const uint8_t* data, size_t len) {
+            std::lock_guard<std::mutex> guard(m_lock);
+            if (m_state != OPEN) return;
+            queueFrame(opcode, data, len);
+            flush();
+        }
+
+    private:
+        enum State { IDLE, RESOLVING, TCP_CONNECTING, TLS_HANDSHAKE, UPGRADING, OPEN, CLOSED };
+        enum PendingKind { P_OPEN, P_MESSAGE, P_ERROR, P_CLOSE };
+
+        struct Pending {
+            PendingKind kind;
+            int code;
+            std::string data;
+        };
+
+        void connect(struct addrinfo* res);
+        void deliver();
+        void teardown();
+        void setWantWrite(bool on);
+
+        void fail(int code, const std::string& msg) {
+            if (m_state == CLOSED) return;
+            switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "(%s) event loop connection failed: %d %s\n",
+                              m_sessionId.c_str(), code, msg.c_str());
+            m_pending.push_back({P_ERROR, code, msg});
+            teardown();
+        }
+
+        void closed(int code, const std::string& reason) {
+            if (m_state == CLOSED) return;
+            m_pending.push_back({P_CLOSE, code, reason});
+            teardown();
+        }
+
+        // >0 bytes read, 0 would block, -1 closed by peer, -2 error
+        int ioRead(char* buf, size_t len) {
+            if (m_ssl) {
+                int n = SSL_read(m_ssl, buf, (int) len);
+                if (n > 0) return n;
+                int err = SSL_get_error(m_ssl, n);
+                if (err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE) return 0;
+                if (err == SSL_ERROR_ZERO_RETURN || (err == SSL_ERROR_SYSCALL && errno == 0)) return -1;
+                return -2;
+            }
+            ssize_t n = ::recv(m_fd, buf, len, 0);
+            if (n > 0) return (int) n;
+            if (n == 0) return -1;
+            return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR ? 0 : -2;
+        }
+
+        // >=0 bytes written, -1 error. OpenSSL writes without MSG_NOSIGNAL, FreeSWITCH ignores SIGPIPE
+        int ioWrite(const char* buf, size_t len) {
+            if (m_ssl) {
+                int n = SSL_write(m_ssl, buf, (int) len);
+                if (n > 0) return n;
+                int err = SSL_get_error(m_ssl, n);
+                return err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE ? 0 : -1;
+            }
+            ssize_t n = ::send(m_fd, buf, len, MSG_NOSIGNAL);
+            if (n >= 0) return (int) n;
+            return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR ? 0 : -1;
+        }
+
+        uint32_t nextMask() {
+            // xorshift, masking only has to be unpredictable enough for proxies
+            m_maskSeed ^= m_maskSeed << 13;
+            m_maskSeed ^= m_maskSeed >> 17;
+            m_maskSeed ^= m_maskSeed << 5;
+            return m_maskSeed;
+        }
+
+        void queueFrame(uint8_t opcode, const uint8_t* data, size_t len) {
+            if (m_out.size() - m_outPos + len > LOOP_MAX_PENDING_BYTES) {
+                if (m_dropped++ % 100 == 0) {
+                    switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "(%s) event loop connection is not draining, dropped %llu frames\n",
+                                      m_sessionId.c_str(), (unsigned long long) m_dropped);
+                }
+                return;
+            }
+            uint8_t header[14];
+            size_t hdr = 2;
+            header[0] = 0x80 | opcode;
+            if (len < 126) {
+                header[1] = 0x80 | (uint8_t) len;
+            } else if (len <= 0xffff) {
+                header[1] = 0x80 | 126;
+                header[2] = (uint8_t) (len >> 8);
+                header[3] = (uint8_t) len;
+                hdr = 4;
+            } else {
+                header[1] = 0x80 | 127;
+                for (int i = 0; i < 8; i++) header[2 + i] = (uint8_t) ((uint64_t) len >> (56 - 8 * i));
+                hdr = 10;
+            }
+            uint32_t mask = nextMask();
+            uint8_t* key = header + hdr;
+            memcpy(key, &mask, 4);
+            hdr += 4;
+
+            m_out.append((const char*) header, hdr);
+            size_t at = m_out.size();
+            m_out.resize(at + len);
+            char* dst = &m_out[at];
+            for (size_t i = 0; i < len; i++) dst[i] = (char) (data[i] ^ key[i & 3]);
+        }
+
+        void flush() {
+            while (m_outPos < m_out.size()) {
+                int n = ioWrite(m_out.data() + m_outPos, m_out.size() - m_outPos);
+                if (n < 0) {
+                    // reported by the loop thread, sends may come from any thread
+                    m_ioError = true;
+                    setWantWrite(true);
+                    return;
+                }
+                if (n == 0) break;
+                m_outPos += n;
+                m_lastSend = loop_clock::now();
+            }
+            if (m_outPos == m_out.size()) {
+                m_out.clear();
+                m_outPos = 0;
+            } else if (m_outPos > LOOP_READ_CHUNK && m_outPos * 2 > m_out.size()) {
+                m_out.erase(0, m_outPos);
+                m_outPos = 0;
+            }
+            setWantWrite(m_outPos < m_out.size());
+        }
+
+        void handshake() {
+            ERR_clear_error();
+            int r = SSL_connect(m_ssl);
+            if (r == 1) {
+                sendUpgrade();
+                return;
+            }
+            int err = SSL_get_error(m_ssl, r);
+            if (err == SSL_ERROR_WANT_READ) {
+                setWantWrite(false);
+            } else if (err == SSL_ERROR_WANT_WRITE) {
+                setWantWrite(true);
+            } else {
+                fail(WS_ERR_SSL_HANDSHAKE_FAILED, ssl_error_string());
+            }
+        }
+
+        void sendUpgrade() {
+            unsigned char nonce[16];
+            RAND_bytes(nonce, sizeof(nonce));
+            m_key = base64_encode(nonce, sizeof(nonce));
+
+            std::string req("GET ");
+            req.append(m_uri.path).append(" HTTP/1.1\r\nHost: ");
+            if (m_uri.host.find(':') != std::string::npos) req.append("[").append(m_uri.host).append("]");
+            else req.append(m_uri.host);
+            if (m_uri.port != (m_uri.tls ? "443" : "80")) req.append(":").append(m_uri.port);
+            req.append("\r\nUpgrade: websocket\r\nConnection: Upgrade\r\nSec-WebSocket-Key: ").append(m_key);
+            req.append("\r\nSec-WebSocket-Version: 13\r\n");
+            // parsed once with the profile or the channel variables
+            for (const auto& header : m_cfg.headerFields) {
+                req.append(header.first).append(": ").append(header.second).append("\r\n");
+            }
+            req.append("\r\n");
+
+            m_state = UPGRADING;
+            m_out.append(req);
+            flush();
+        }
+
+        bool parseUpgrade() {
+            size_t end = m_in.find("\r\n\r\n", m_inPos);
+            if (end == std::string::npos) {
+                if (m_in.size() - m_inPos > LOOP_MAX_HANDSHAKE_BYTES) fail(WS_ERR_INVALID_HEADER, "handshake response too large");
+                return false;
+            }
+            std::string response = m_in.substr(m_inPos, end - m_inPos);
+            m_inPos = end + 4;
+
+            if (response.compare(0, 12, "HTTP/1.1 101") != 0) {
+                fail(WS_ERR_INVALID_HEADER, response.substr(0, response.find("\r\n")));
+                return false;
+            }
+
+            std::string accept;
+            size_t pos = 0;
+            while ((pos = response.find("\r\n", pos)) != std::string::npos) {
+                pos += 2;
+                size_t eol = response.find("\r\n", pos);
+                std::string line = response.substr(pos, eol == std::string::npos ? std::string::npos : eol - pos);
+                static const char name[] = "sec-websocket-accept:";
+                if (line.size() > sizeof(name) - 1 && strncasecmp(line.c_str(), name, sizeof(name) - 1) == 0) {
+                    accept = line.substr(sizeof(name) - 1);
+                    accept.erase(0, accept.find_first_not_of(" \t"));
+                    accept.erase(accept.find_last_not_of(" \t") + 1);
+                }
+            }
+
+            std::string expected = m_key + "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+            unsigned char digest[SHA_DIGEST_LENGTH];
+            SHA1((const unsigned char*) expected.data(), expected.size(), digest);
+            if (accept != base64_encode(digest, sizeof(digest))) {
+                fail(WS_ERR_INVALID_HEADER, "bad Sec-WebSocket-Accept");
+                return false;
+            }
+
+            m_state = OPEN;
+            m_lastRecv = m_lastPing = loop_clock::now();
+            if (m_ssl) tls_cache_connected(m_cfg, m_ssl, switch_micro_time_now() - m_connectStart);
+            m_pending.push_back({P_OPEN, 0, std::string()});
+            return true;
+        }
+
+        void parseFrames() {
+            while (m_state == OPEN) {
+                const uint8_t* p = (const uint8_t*) m_in.data() + m_inPos;
+                size_t avail = m_in.size() - m_inPos;
+                if (avail < 2) return;
+
+                bool fin = p[0] & 0x80;
+                uint8_t opcode = p[0] & 0x0f;
+                if (p[0] & 0x70) return fail(WS_ERR_NOT_SUPPORTED, "reserved bits set");
+                if (p[1] & 0x80) return fail(WS_ERR_SERVER_MASKED, "server frame is masked");
+
+                uint64_t len = p[1] & 0x7f;
+                size_t hdr = 2;
+                if (len == 126) {
+                    if (avail < 4) return;
+                    len = ((uint64_t) p[2] << 8) | p[3];
+                    hdr = 4;
+                } else if (len == 127) {
+                    if (avail < 10) return;
+                    len = 0;
+                    for (int i = 0; i < 8; i++) len = (len << 8) | p[2 + i];
+                    hdr = 10;
+                }
+                if (len > LOOP_MAX_FRAME_BYTES) return fail(WS_ERR_IO, "frame too large");
+                if (avail < hdr + len) return;
+
+                const char* payload = (const char*) p + hdr;
+                m_inPos += hdr + len;
+
+                switch (opcode) {
+                    case WS_OP_CONT:
+                        if (!m_fragmented) return fail(WS_ERR_INVALID_HEADER, "unexpected continuation frame");
+                        m_message.append(payload, len);
+                        if (fin) {
+                            m_fragmented = false;
+                            m_pending.push_back({P_MESSAGE, 0, std::string()});
+                            m_pending.back().data.swap(m_message);
+                        }
+                        break;
+                    case WS_OP_TEXT:
+                    case WS_OP_BINARY:
+                        if (fin) {
+                            m_pending.push_back({P_MESSAGE, 0, std::string(payload, len)});
+                        } else {
+                            m_fragmented = true;
+                            m_message.assign(payload, len);
+                        }
+                        break;
+                    case WS_OP_CLOSE: {
+                        int code = len >= 2 ? ((uint8_t) payload[0] << 8) | (uint8_t) payload[1] : 1005;
+                        std::string reason = len > 2 ? std::string(payload + 2, len - 2) : std::string();
+                        // echo the close, best effort
+                        queueFrame(WS_OP_CLOSE, (const uint8_t*) payload, len >= 2 ? 2 : 0);
+                        flush();
+                        return closed(code, reason);
+                    }
+                    case WS_OP_PING:
+                        queueFrame(WS_OP_PONG, (const uint8_t*) payload, len);
+                        flush();
+                        break;
+                    case WS_OP_PONG:
+                        break;
+                    default:
+                        return fail(WS_ERR_NOT_SUPPORTED, "unknown opcode");
+                }
+            }
+        }
+
+        void readAll() {
+            char buf[LOOP_READ_CHUNK];
+            while (m_state == UPGRADING || m_state == OPEN) {
+                int n = ioRead(buf, sizeof(buf));
+                if (n == 0) break;
+                if (n == -1) {
+                    if (m_state == OPEN) closed(1006, "connection closed by peer");
+                    else fail(WS_ERR_CONNECT_FAILED, "connection closed during handshake");
+                    return;
+                }
+                if (n == -2) {
+                    if (m_ssl) fail(WS_ERR_SSL_ERROR, ssl_error_string());
+                    else fail(WS_ERR_IO, strerror(errno));
+                    return;
+                }
+                m_lastRecv = loop_clock::now();
+                m_in.append(buf, n);
+                if (m_state == UPGRADING && !parseUpgrade()) continue;
+                parseFrames();
+                if (m_inPos == m_in.size()) {
+                    m_in.clear();
+                    m_inPos = 0;
+                } else if (m_inPos > LOOP_READ_CHUNK) {
+                    m_in.erase(0, m_inPos);
+                    m_inPos = 0;
+                }
+            }
+        }
+
+        TransportConfig m_cfg;
+        std::string m_sessionId;
+        TransportCallbacks m_cb;
+        ParsedUri m_uri;
+        std::shared_ptr<EventLoop> m_loop;   // kept alive past the group's shutdown
+
+        std::mutex m_lock;
+        std::atomic<State> m_state{IDLE};
+        int m_fd = -1;
+        SSL* m_ssl = nullptr;
+        bool m_registered = false;
+        bool m_wantWrite = true;
+        bool m_ioError = false;
+        bool m_active = true;       // loop thread only, cleared by shutdown
+        std::string m_key;
+        std::string m_in;
+        size_t m_inPos = 0;
+        std::string m_out;
+        size_t m_outPos = 0;
+        std::string m_message;
+        bool m_fragmented = false;
+        uint32_t m_maskSeed = 0;
+        std::atomic<uint64_t> m_dropped{0};
+        std::vector<Pending> m_pending;
+        switch_time_t m_connectStart = 0;
+        loop_clock::time_point m_deadline;
+        loop_clock::time_point m_lastSend;
+        loop_clock::time_point m_lastRecv;
+        loop_clock::time_point m_lastPing;
+    };
+
+    class EventLoop {
+    public:
+        explicit EventLoop(int index): m_index(index) {}
+
+        // the descriptors stay open until the last connection lets go of the loop
+        ~EventLoop() {
+            if (m_epfd >= 0) ::close(m_epfd);
+            if (m_wakefd >= 0) ::close(m_wakefd);
+        }
+
+        bool start() {
+            m_epfd = epoll_create1(EPOLL_CLOEXEC);
+            m_wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+            if (m_epfd < 0 || m_wakefd < 0) {
+                switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "event loop %d: %s\n", m_index, strerror(errno));
+                return false;
+            }
+            struct epoll_event ev;
+            memset(&ev, 0, sizeof(ev));
+            ev.events = EPOLLIN;
+            ev.data.fd = m_wakefd;
+            epoll_ctl(m_epfd, EPOLL_CTL_ADD, m_wakefd, &ev);
+            m_thread = std::thread([this]() { run(); });
+            return true;
+        }
+
+        void stop() {
+            {
+                std::lock_guard<std::mutex> guard(m_lock);
+                m_stopping = true;
+            }
+            wake();
+            if (m_thread.joinable()) m_thread.join();
+        }
+
+        // runs fn on the loop thread, or right away once the thread is gone
+        void post(std::function<void()> fn) {
+            {
+                std::lock_guard<std::mutex> guard(m_lock);
+                if (!m_exited) {
+                    m_tasks.push_back(std::move(fn));
+                    wake();
+                    return;
+                }
+            }
+            fn();
+        }
+
+        bool inLoop() const {
+            return std::this_thread::get_id() == m_thread.get_id();
+        }
+
+        // the thread is gone, connections still open are shut down by the thread closing them
+        bool exited() const { return m_exited; }
+
+        // loop thread
+        void add(const std::shared_ptr<LoopConnection>& conn) {
+            if (m_exited) {
+                conn->failAsync(WS_ERR_CONNECT_FAILED, "event loop stopped");
+                return;
+            }
+            struct epoll_event ev;
+            memset(&ev, 0, sizeof(ev));
+            ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP;
+            ev.data.fd = conn->fd();
+            if (epoll_ctl(m_epfd, EPOLL_CTL_ADD, conn->fd(), &ev) < 0) {
+                conn->failAsync(WS_ERR_IO, strerror(errno));
+                return;
+            }
+            m_connections[conn->fd()] = conn;
+            conn->registered();
+        }
+
+        // any thread
+        void setWantWrite(int fd, bool on) {
+            struct epoll_event ev;
+            memset(&ev, 0, sizeof(ev));
+            ev.events = EPOLLIN | EPOLLRDHUP | (on ? (uint32_t) EPOLLOUT : 0u);
+            ev.data.fd = fd;
+            epoll_ctl(m_epfd, EPOLL_CTL_MOD, fd, &ev);
+        }
+
+        // loop thread, nothing to do once it is gone
+        void remove(int fd) {
+            if (m_exited) return;
+            epoll_ctl(m_epfd, EPOLL_CTL_DEL, fd, nullptr);
+            m_connections.erase(fd);
+        }
+
+        std::atomic<int> load{0};
+        std::atomic<uint64_t> dropped{0};
+
+    private:
+        void wake() {
+            uint64_t one = 1;
+            if (m_wakefd >= 0 && ::write(m_wakefd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+                switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "event loop %d: wake failed: %s\n", m_index, strerror(errno));
+            }
+        }
+
+        void run() {
+            struct epoll_event events[64];
+            auto lastTick = loop_clock::now();
+            while (true) {
+                int n = epoll_wait(m_epfd, events, 64, LOOP_TICK_MS);
+                if (n < 0 && errno != EINTR) {
+                    switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "event loop %d: %s\n", m_index, strerror(errno));
+                    break;
+                }
+                for (int i = 0; i < n; i++) {
+                    if (events[i].data.fd == m_wakefd) {
+                        uint64_t count;
+                        while (::read(m_wakefd, &count, sizeof(count)) > 0) {}
+                        continue;
+                    }
+                    auto it = m_connections.find(events[i].data.fd);
+                    if (it == m_connections.end()) continue;
+                    std::shared_ptr<LoopConnection> conn = it->second;
+                    conn->onEvents(events[i].events);
+                }
+
+                std::vector<std::function<void()>> tasks;
+                {
+                    std::lock_guard<std::mutex> guard(m_lock);
+                    tasks.swap(m_tasks);
+                    if (m_stopping && tasks.empty()) {
+                        m_connections.clear();
+                        m_exited = true;
+                        break;
+                    }
+                }
+                for (auto& task : tasks) task();
+
+                auto now = loop_clock::now();
+                if (now - lastTick >= std::chrono::milliseconds(LOOP_TICK_MS)) {
+                    lastTick = now;
+                    std::vector<std::shared_ptr<LoopConnection>> all;
+                    all.reserve(m_connections.size());
+                    for (auto& it : m_connections) all.push_back(it.second);
+                    for (auto& conn : all) conn->onTick(now);
+                }
+            }
+
+            // anything still registered was not closed by its owner, it shuts down on its own
+            // thread when it is. After a failed epoll_wait, tasks already posted run here
+            std::vector<std::function<void()>> tasks;
+            {
+                std::lock_guard<std::mutex> guard(m_lock);
+                if (!m_exited) m_connections.clear();
+                m_exited = true;
+                tasks.swap(m_tasks);
+            }
+            for (auto& task : tasks) task();
+        }
+
+        int m_index;
+        int m_epfd = -1;
+        int m_wakefd = -1;
+        std::thread m_thread;
+        std::mutex m_lock;
+        std::vector<std::function<void()>> m_tasks;
+        bool m_stopping = false;
+        std::atomic<bool> m_exited{false};
+        std::unordered_map<int, std::shared_ptr<LoopConnection>> m_connections;
+    };
+
+    /*
+     * Host lookups for new connections. getaddrinfo blocks for as long as DNS takes, so it
+     * runs on a few threads of its own instead of the thread starting the stream or a loop.
+     */
+    class Resolver {
+    public:
+        // done gets the addresses, which it frees, or an error
+        typedef std::function<void(struct addrinfo* res, const std::string& error)> Done;
+
+        void resolve(const std::string& host, const std::string& port, Done done) {
+            {
+                std::lock_guard<std::mutex> guard(m_lock);
+                if (!m_stopping) {
+                    m_queue.push_back({host, port, std::move(done)});
+                    if (m_workers.size() < LOOP_RESOLVERS && m_idle == 0) {
+                        m_workers.emplace_back([this]() { run(); });
+                    }
+                    m_cond.notify_one();
+                    return;
+                }
+            }
+            done(nullptr, "shutting down");
+        }
+
+        // lookups in progress finish, queued ones fail
+        void shutdown() {
+            std::vector<std::thread> workers;
+            std::deque<Lookup> queued;
+            {
+                std::lock_guard<std::mutex> guard(m_lock);
+                m_stopping = true;
+                m_cond.notify_all();
+                workers.swap(m_workers);
+                queued.swap(m_queue);
+            }
+            for (auto& lookup : queued) lookup.done(nullptr, "shutting down");
+            for (auto& worker : workers) worker.join();
+        }
+
+    private:
+        struct Lookup {
+            std::string host;
+            std::string port;
+            Done done;
+        };
+
+        void run() {
+            std::unique_lock<std::mutex> guard(m_lock);
+            while (true) {
+                m_idle++;
+                m_cond.wait(guard, [this]() { return m_stopping || !m_queue.empty(); });
+                m_idle--;
+                if (m_stopping) break;
+
+                Lookup lookup = std::move(m_queue.front());
+                m_queue.pop_front();
+                guard.unlock();
+
+                struct addrinfo hints, *res = nullptr;
+                memset(&hints, 0, sizeof(hints));
+                hints.ai_family = AF_UNSPEC;
+                hints.ai_socktype = SOCK_STREAM;
+                int rc = getaddrinfo(lookup.host.c_str(), lookup.port.c_str(), &hints, &res);
+                if (rc != 0) lookup.done(nullptr, gai_strerror(rc));
+                else lookup.done(res, std::string());
+
+                guard.lock();
+            }
+        }
+
+        std::mutex m_lock;
+        std::condition_variable m_cond;
+        std::deque<Lookup> m_queue;
+        std::vector<std::thread> m_workers;
+        size_t m_idle = 0;
+        bool m_stopping = false;
+    };
+
+    class LoopGroup {
+    public:
+        std::shared_ptr<EventLoop> pick() {
+            std::lock_guard<std::mutex> guard(m_lock);
+            if (m_stopping) return nullptr;
+            if (m_loops.empty()) {
+                unsigned n = std::thread::hardware_concurrency();
+                if (n == 0) n = 1;
+                for (unsigned i = 0; i < n; i++) {
+                    std::shared_ptr<EventLoop> loop = std::make_shared<EventLoop>((int) i);
+                    if (loop->start()) m_loops.push_back(loop);
+                }
+                switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_INFO, "started %u websocket event loops\n", (unsigned) m_loops.size());
+                if (m_loops.empty()) return nullptr;
+            }
+            std::shared_ptr<EventLoop> best = m_loops[0];
+            for (auto& loop : m_loops) {
+                if (loop->load < best->load) best = loop;
+            }
+            best->load++;
+            return best;
+        }
+
+        SSL_CTX* context(const TransportConfig& cfg, std::string& error) {
+            std::string key = cfg.tls.caFile + "|" + cfg.tls.certFile + "|" + cfg.tls.keyFile;
+            std::lock_guard<std::mutex> guard(m_lock);
+            auto it = m_contexts.find(key);
+            if (it != m_contexts.end()) return it->second;
+
+            SSL_CTX* ctx = SSL_CTX_new(TLS_client_method());
+            if (!ctx) {
+                error = ssl_error_string();
+                return nullptr;
+            }
+            SSL_CTX_set_mode(ctx, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+            bool ok = true;
+            if (cfg.tls.caFile == "NONE") {
+                SSL_CTX_set_verify(ctx, SSL_VERIFY_NONE, nullptr);
+            } else {
+                SSL_CTX_set_verify(ctx, SSL_VERIFY_PEER, nullptr);
+                if (cfg.tls.caFile.empty() || cfg.tls.caFile == "SYSTEM") ok = SSL_CTX_set_default_verify_paths(ctx) == 1;
+                else ok = SSL_CTX_load_verify_locations(ctx, cfg.tls.caFile.c_str(), nullptr) == 1;
+            }
+            if (ok && !cfg.tls.certFile.empty()) ok = SSL_CTX_use_certificate_chain_file(ctx, cfg.tls.certFile.c_str()) == 1;
+            if (ok && !cfg.tls.keyFile.empty()) ok = SSL_CTX_use_PrivateKey_file(ctx, cfg.tls.keyFile.c_str(), SSL_FILETYPE_PEM) == 1;
+            if (!ok) {
+                error = ssl_error_string();
+                SSL_CTX_free(ctx);
+                return nullptr;
+            }
+            m_contexts[key] = ctx;
+            return ctx;
+        }
+
+        void stats(cJSON* root) {
+            std::lock_guard<std::mutex> guard(m_lock);
+            cJSON* group = cJSON_CreateObject();
+            cJSON* loads = cJSON_CreateArray();
+            int total = 0;
+            uint64_t dropped = 0;
+            for (auto& loop : m_loops) {
+                cJSON_AddItemToArray(loads, cJSON_CreateNumber(loop->load));
+                total += loop->load;
+                dropped += loop->dropped;
+            }
+            cJSON_AddNumberToObject(group, "threads", m_loops.size());
+            cJSON_AddNumberToObject(group, "connections", total);
+            cJSON_AddNumberToObject(group, "droppedFrames", dropped);
+            cJSON_AddItemToObject(group, "perThread", loads);
+            cJSON_AddItemToObject(root, "eventLoop", group);
+        }
+
+        void resolve(const std::string& host, const std::string& port, Resolver::Done done) {
+            m_resolver.resolve(host, port, std::move(done));
+        }
+
+        void shutdown() {
+            // the lookups left hand their connections back to the loops, which are still running
+            m_resolver.shutdown();
+            std::vector<std::shared_ptr<EventLoop>> loops;
+            {
+                std::lock_guard<std::mutex> guard(m_lock);
+                m_stopping = true;
+                loops.swap(m_loops);
+            }
+            for (auto& loop : loops) loop->stop();
+            std::lock_guard<std::mutex> guard(m_lock);
+            for (auto& it : m_contexts) SSL_CTX_free(it.second);
+            m_contexts.clear();
+        }
+
+    private:
+        std::mutex m_lock;
+        std::vector<std::shared_ptr<EventLoop>> m_loops;
+        std::unordered_map<std::string, SSL_CTX*> m_contexts;
+        Resolver m_resolver;
+        bool m_stopping = false;
+    };
+
+    LoopGroup& loop_group() {
+        static LoopGroup group;
+        return group;
+    }
+
+    SSL_CTX* tls_context(const TransportConfig& cfg, std::string& error) {
+        return loop_group().context(cfg, error);
+    }
+
+    void LoopConnection::start(const std::shared_ptr<EventLoop>& loop) {
+        std::shared_ptr<LoopConnection> self = shared_from_this();
+        m_loop = loop;
+        m_connectStart = switch_micro_time_now();
+        m_deadline = loop_clock::now() + std::chrono::milliseconds(LOOP_CONNECT_TIMEOUT_MS);
+
+        if (!parse_uri(m_cfg.uri, m_uri)) {
+            loop->post([self]() { self->failAsync(WS_ERR_CONNECT_FAILED, "invalid url"); });
+            return;
+        }
+
+        m_state = RESOLVING;
+        loop_group().resolve(m_uri.host, m_uri.port, [self, loop](struct addrinfo* res, const std::string& error) {
+            loop->post([self, res, error]() { self->resolved(res, error); });
+        });
+    }
+
+    // connects to the first address that takes a socket, and registers with the loop
+    void LoopConnection::resolved(struct addrinfo* res, const std::string& error) {
+        std::shared_ptr<LoopConnection> self = shared_from_this();
+        {
+            std::lock_guard<std::mutex> guard(m_lock);
+            // closed by its owner while the lookup ran
+            if (!m_active || m_state != RESOLVING) {
+                if (res) freeaddrinfo(res);
+                return;
+            }
+            if (!res) {
+                fail(WS_ERR_CONNECT_FAILED, error);
+            } else if (loop_clock::now() > m_deadline) {
+                freeaddrinfo(res);
+                fail(WS_ERR_CONNECT_FAILED, "connect timeout");
+            } else {
+                connect(res);
+            }
+        }
+        if (m_state == TCP_CONNECTING) m_loop->add(self);
+        deliver();
+    }
+
+    // caller holds m_lock, frees res
+    void LoopConnection::connect(struct addrinfo* res) {
+        int err = 0;
+        for (struct addrinfo* ai = res; ai; ai = ai->ai_next) {
+            int fd = ::socket(ai->ai_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+            if (fd < 0) {
+                err = errno;
+                continue;
+            }
+            int one = 1;
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+            if (::connect(fd, ai->ai_addr, ai->ai_addrlen) == 0 || errno == EINPROGRESS) {
+                m_fd = fd;
+                break;
+            }
+            err = errno;
+            ::close(fd);
+        }
+        freeaddrinfo(res);
+        if (m_fd < 0) {
+            fail(WS_ERR_CONNECT_FAILED, strerror(err));
+            return;
+        }
+
+        if (m_uri.tls) {
+            std::string error;
+            SSL_CTX* ctx = tls_context(m_cfg, error);
+            if (ctx) m_ssl = SSL_new(ctx);
+            if (!m_ssl) {
+                if (error.empty()) error = ssl_error_string();
+                fail(WS_ERR_TLS_INIT_FAILED, error);
+                return;
+            }
+            SSL_set_fd(m_ssl, m_fd);
+            SSL_set_tlsext_host_name(m_ssl, m_uri.host.c_str());
+            if (!m_cfg.tls.disableHostnameValidation && m_cfg.tls.caFile != "NONE") {
+                SSL_set1_host(m_ssl, m_uri.host.c_str());
+            }
+            SSL_set_connect_state(m_ssl);
+            // an abbreviated handshake when an earlier connection to the peer left a session
+            tls_cache_resume(m_cfg, m_ssl);
+        }
+
+        m_state = TCP_CONNECTING;
+    }
+
+    void LoopConnection::onEvents(uint32_t events) {
+        {
+            std::lock_guard<std::mutex> guard(m_lock);
+            switch (m_state) {
+                case TCP_CONNECTING: {
+                    int err = 0;
+                    socklen_t len = sizeof(err);
+                    getsockopt(m_fd, SOL_SOCKET, SO_ERROR, &err, &len);
+                    if (err) {
+                        fail(WS_ERR_CONNECT_FAILED, strerror(err));
+                    } else if (events & (EPOLLOUT | EPOLLERR | EPOLLHUP)) {
+                        if (m_ssl) {
+                            m_state = TLS_HANDSHAKE;
+                            handshake();
+                        } else {
+                            sendUpgrade();
+                        }
+                    }
+                    break;
+                }
+                case TLS_HANDSHAKE:
+                    handshake();
+                    break;
+                case UPGRADING:
+                case OPEN:
+                    if (events & EPOLLOUT) flush();
+                    readAll();
+                    break;
+                default:
+                    break;
+            }
+            // after reading, a close frame from the server explains a failed write better
+            if (m_ioError) {
+                fail(m_ssl ? WS_ERR_SSL_ERROR : WS_ERR_IO, "write failed");
+            }
+        }
+        deliver();
+    }
+
+    void LoopConnection::onTick(loop_clock::time_point now) {
+        {
+            std::lock_guard<std::mutex> guard(m_lock);
+            if (m_ioError) {
+                fail(m_ssl ? WS_ERR_SSL_ERROR : WS_ERR_IO, "write failed");
+            } else if (m_state != OPEN && m_state != CLOSED && now > m_deadline) {
+                fail(WS_ERR_CONNECT_FAILED, "connect timeout");
+            } else if (m_state == OPEN && m_cfg.heartBeat > 0) {
+                auto interval = std::chrono::seconds(m_cfg.heartBeat);
+                if (now - m_lastRecv > 2 * interval) {
+                    fail(WS_ERR_PING_TIMEOUT, "ping timeout");
+                } else if (now - m_lastPing >= interval) {
+                    m_lastPing = now;
+                    queueFrame(WS_OP_PING, nullptr, 0);
+                    flush();
+                }
+            }
+        }
+        deliver();
+    }
+
+    void LoopConnection::failAsync(int code, const std::string& msg) {
+        {
+            std::lock_guard<std::mutex> guard(m_lock);
+            if (!m_active) return;
+            fail(code, msg);
+        }
+        deliver();
+    }
+
+    void LoopConnection::shutdown() {
+        std::lock_guard<std::mutex> guard(m_lock);
+        m_active = false;
+        m_pending.clear();
+        if (m_state == OPEN) {
+            uint8_t normal[2] = { 1000 >> 8, 1000 & 0xff };
+            queueFrame(WS_OP_CLOSE, normal, sizeof(normal));
+            flush();
+        }
+        teardown();
+    }
+
+    // caller holds m_lock
+    void LoopConnection::teardown() {
+        if (m_state == CLOSED) return;
+        m_state = CLOSED;
+        if (m_registered) {
+            m_loop->remove(m_fd);
+            m_registered = false;
+        }
+        if (m_ssl) {
+            SSL_free(m_ssl);
+            m_ssl = nullptr;
+        }
+        if (m_fd >= 0) {
+            ::close(m_fd);
+            m_fd = -1;
+        }
+        if (m_loop) {
+            m_loop->load--;
+            m_loop->dropped += m_dropped;
+        }
+    }
+
+    // caller holds m_lock
+    void LoopConnection::setWantWrite(bool on) {
+        if (m_wantWrite == on || !m_registered) return;
+        m_wantWrite = on;
+        m_loop->setWantWrite(m_fd, on);
+    }
+
+    // loop thread, or LoopTransport::connect's without a loop; without m_lock: callbacks may send or close
+    void LoopConnection::deliver() {
+        std::vector<Pending> pending;
+        {
+            std::lock_guard<std::mutex> guard(m_lock);
+            pending.swap(m_pending);
+        }
+        for (auto& p : pending) {
+            if (!m_active) return;
+            switch (p.kind) {
+                case P_OPEN:    m_cb.onOpen(); break;
+                case P_MESSAGE: m_cb.onMessage(p.data.c_str(), p.data.size()); break;
+                case P_ERROR:   m_cb.onError(p.code, p.data); break;
+                case P_CLOSE:   m_cb.onClose(p.code, p.data); break;
+            }
+        }
+    }
+
+    class LoopTransport : public StreamTransport {
+    public:
+        LoopTransport(const TransportConfig& cfg, const std::string& sessionId, const TransportCallbacks& cb):
+            m_conn(std::make_shared<LoopConnection>(cfg, sessionId, cb)) {}
+
+        ~LoopTransport() override {
+            close();
+        }
+
+        void connect() override {
+            std::shared_ptr<EventLoop> loop = loop_group().pick();
+            if (!loop) {
+                // the loops failed to start or are stopping: fail like a connect would, from
+                // another thread so the streamer is not called back from its constructor
+                switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "no websocket event loop available\n");
+                std::shared_ptr<LoopConnection> conn = m_conn;
+                m_failThread = std::thread([conn]() {
+                    conn->failAsync(WS_ERR_CONNECT_FAILED, "no websocket event loop available");
+                });
+                return;
+            }
+            m_conn->start(loop);
+        }
+
+        void close() override {
+            if (m_closed) return;
+            std::shared_ptr<EventLoop> loop = m_conn->loop();
+            if (!loop) {
+                if (!m_failThread.joinable()) return;
+                m_closed = true;
+                m_conn->shutdown();
+                // closed from its own error callback
+                if (m_failThread.get_id() == std::this_thread::get_id()) m_failThread.detach();
+                else m_failThread.join();
+                return;
+            }
+            m_closed = true;
+            // after the group's shutdown post runs the shutdown inline as well
+            if (loop->inLoop() || loop->exited()) {
+                m_conn->shutdown();
+                return;
+            }
+            std::shared_ptr<LoopConnection> conn = m_conn;
+            std::promise<void> done;
+            loop->post([conn, &done]() {
+                conn->shutdown();
+                done.set_value();
+            });
+            done.get_future().wait();
+        }
+
+        bool isConnected() override {
+            return m_conn->isOpen();
+        }
+
+        void sendBinary(const uint8_t* data, size_t len) override {
+            m_conn->send(WS_OP_BINARY, data, len);
+        }
+
+        void sendText(const char* text, size_t len) override {
+            m_conn->send(WS_OP_TEXT, (const uint8_t*) text, len);
+        }
+
+    private:
+        std::shared_ptr<LoopConnection> m_conn;
+        std::thread m_failThread;   // reports the missing event loop, see connect()
+        bool m_closed = false;
+    };
+}
+
+std::unique_ptr<StreamTransport> event_loop_transport(const TransportConfig& cfg, const std::string& sessionId,
+                                                      const TransportCallbacks& callbacks) {
+    return std::unique_ptr<StreamTransport>(new LoopTransport(cfg, sessionId, callbacks));
+}
+
+void event_loop_stats(cJSON* root) {
+    loop_group().stats(root);
+}
+
+void event_loop_shutdown() {
+    loop_group().shutdown();
+}
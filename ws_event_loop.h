@@ -0,0 +1,24 @@
+#ifndef WS_EVENT_LOOP_H
+#define WS_EVENT_LOOP_H
+
+#include <memory>
+#include <switch_json.h>
+#include "ws_transport.h"
+
+/*
+ * Websocket connections served by a fixed set of epoll I/O threads (one per core by default)
+ * instead of one WebSocketClient thread per call. A new connection goes to the loop that
+ * currently serves the fewest connections.
+ *
+ * All callbacks run on the connection's loop thread. Per message deflate is not offered.
+ */
+
+std::unique_ptr<StreamTransport> event_loop_transport(const TransportConfig& cfg, const std::string& sessionId,
+                                                      const TransportCallbacks& callbacks);
+
+// adds the loop counters to a JSON object
+void event_loop_stats(cJSON* root);
+// stops the loops, connections must have been closed before
+void event_loop_shutdown();
+
+#endif //WS_EVENT_LOOP_H
@@ -0,0 +1,360 @@
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <algorithm>
+#include <vector>
+#include <unordered_map>
+#include "mod_audio_stream.h"
+#include <switch_json.h>
+#include "ws_pool.h"
+#include "tls_cache.h"
+
+#define POOL_IDLE_EXPIRY_SEC (600)  // endpoints not claimed from for this long are drained
+#define POOL_MAX_BACKOFF_MS  (30000)
+
+namespace {
+
+    typedef std::chrono::steady_clock pool_clock;
+
+    void pool_wake();
+
+    /*
+     * A connection opened ahead of time. Until it is claimed its events only matter to the pool,
+     * once claimed they are forwarded to the call that bound it.
+     */
+    class WarmConnection {
+    public:
+        WarmConnection(const TransportConfig& cfg): m_cfg(cfg) {
+            transport_apply_config(m_client, cfg);
+        }
+
+        void start() {
+            m_client.setMessageCallback([this](const std::string& message) {
+                std::lock_guard<std::recursive_mutex> guard(m_lock);
+                if (m_bound) m_cb.onMessage(message.c_str(), message.size());
+            });
+            m_client.setOpenCallback([this]() {
+                if (tls_cache_applies(m_cfg)) {
+                    tls_cache_handshake(m_cfg, switch_micro_time_now() - m_connectStart);
+                }
+                std::unique_lock<std::recursive_mutex> guard(m_lock);
+                m_open = true;
+                if (m_bound) {
+                    m_cb.onOpen();
+                } else if (!m_claimed) {
+                    guard.unlock();
+                    pool_wake();
+                }
+            });
+            m_client.setErrorCallback([this](int code, const std::string& msg) {
+                onDrop(true, code, msg);
+            });
+            m_client.setCloseCallback([this](int code, const std::string& reason) {
+                onDrop(false, code, reason);
+            });
+            m_connectStart = switch_micro_time_now();
+            m_client.connect();
+        }
+
+        // blocking, must not be called from one of the client's callbacks
+        void stop() {
+            {
+                std::lock_guard<std::recursive_mutex> guard(m_lock);
+                m_bound = false;
+            }
+            m_client.disconnect();
+        }
+
+        bool isOpen() const { return m_open; }
+        bool isDead() const { return m_dead; }
+
+        bool claim() {
+            std::lock_guard<std::recursive_mutex> guard(m_lock);
+            if (m_dead || !m_open) return false;
+            m_claimed = true;
+            return true;
+        }
+
+        void bind(const TransportCallbacks& cb) {
+            std::lock_guard<std::recursive_mutex> guard(m_lock);
+            m_cb = cb;
+            m_bound = true;
+            if (m_dead) {
+                m_cb.onClose(1006, "pooled connection lost");
+            } else if (m_open) {
+                m_cb.onOpen();
+            }
+        }
+
+        bool isConnected() {
+            return m_open && m_client.isConnected();
+        }
+
+        void sendBinary(const uint8_t* data, size_t len) {
+            m_client.sendBinary(data, len);
+        }
+
+        void sendText(const char* text, size_t len) {
+            m_client.sendMessage(text, len);
+        }
+
+    private:
+        void onDrop(bool error, int code, const std::string& msg) {
+            std::unique_lock<std::recursive_mutex> guard(m_lock);
+            m_dead = true;
+            m_open = false;
+            if (m_bound) {
+                if (error) m_cb.onError(code, msg);
+                else m_cb.onClose(code, msg);
+            } else if (!m_claimed) {
+                guard.unlock();
+                pool_wake();
+            }
+        }
+
+        TransportConfig m_cfg;
+        switch_time_t m_connectStart = 0;
+        WebSocketClient m_client;
+        std::recursive_mutex m_lock;
+        TransportCallbacks m_cb;
+        bool m_bound = false;
+        bool m_claimed = false;
+        std::atomic<bool> m_open{false};
+        std::atomic<bool> m_dead{false};
+    };
+
+    class PooledTransport : public StreamTransport {
+    public:
+        PooledTransport(const std::shared_ptr<WarmConnection>& conn, const TransportCallbacks& cb): m_conn(conn), m_cb(cb) {}
+
+        void connect() override {
+            m_conn->bind(m_cb);
+        }
+
+        void close() override {
+            m_conn->stop();
+        }
+
+        bool isConnected() override {
+            return m_conn->isConnected();
+        }
+
+        void sendBinary(const uint8_t* data, size_t len) override {
+            m_conn->sendBinary(data, len);
+        }
+
+        void sendText(const char* text, size_t len) override {
+            m_conn->sendText(text, len);
+        }
+
+    private:
+        std::shared_ptr<WarmConnection> m_conn;
+        TransportCallbacks m_cb;
+    };
+
+    struct PoolEntry {
+        TransportConfig cfg;
+        size_t target = 0;
+        std::deque<std::shared_ptr<WarmConnection>> idle;
+        std::vector<std::shared_ptr<WarmConnection>> connecting;
+        uint64_t hits = 0;
+        uint64_t misses = 0;
+        int failures = 0;
+        pool_clock::time_point retryAt;
+        pool_clock::time_point lastClaim;
+    };
+
+    class WarmPool {
+    public:
+        std::shared_ptr<WarmConnection> claim(const TransportConfig& cfg) {
+            std::shared_ptr<WarmConnection> conn;
+            std::lock_guard<std::mutex> guard(m_lock);
+            if (m_stopping) return conn;
+
+            auto& entry = m_entries[transport_key(cfg)];
+            if (!entry.target) {
+                entry.cfg = cfg;
+                switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_INFO, "warming %d connections to %s\n",
+                                  cfg.poolSize, cfg.uri.c_str());
+            }
+            entry.target = cfg.poolSize;
+            entry.lastClaim = pool_clock::now();
+
+            while (!entry.idle.empty()) {
+                auto candidate = entry.idle.front();
+                entry.idle.pop_front();
+                if (candidate->claim()) {
+                    conn = candidate;
+                    break;
+                }
+                m_graveyard.push_back(candidate);
+            }
+            if (conn) {
+                entry.hits++;
+                if (tls_cache_applies(cfg)) tls_cache_pooled(cfg);
+            } else {
+                entry.misses++;
+            }
+
+            if (!m_thread.joinable()) {
+                m_thread = std::thread([this]() { run(); });
+            }
+            m_cond.notify_one();
+            return conn;
+        }
+
+        void wake() {
+            std::lock_guard<std::mutex> guard(m_lock);
+            m_cond.notify_one();
+        }
+
+        char* status() {
+            cJSON* root = cJSON_CreateArray();
+            std::lock_guard<std::mutex> guard(m_lock);
+            for (const auto& it : m_entries) {
+                const PoolEntry& entry = it.second;
+                cJSON* item = cJSON_CreateObject();
+                cJSON_AddStringToObject(item, "uri", entry.cfg.uri.c_str());
+                cJSON_AddNumberToObject(item, "target", entry.target);
+                cJSON_AddNumberToObject(item, "idle", entry.idle.size());
+                cJSON_AddNumberToObject(item, "connecting", entry.connecting.size());
+                cJSON_AddNumberToObject(item, "hits", entry.hits);
+                cJSON_AddNumberToObject(item, "misses", entry.misses);
+                cJSON_AddItemToArray(root, item);
+            }
+            char* json = cJSON_PrintUnformatted(root);
+            cJSON_Delete(root);
+            return json;
+        }
+
+        void shutdown() {
+            {
+                std::lock_guard<std::mutex> guard(m_lock);
+                m_stopping = true;
+                m_cond.notify_one();
+            }
+            if (m_thread.joinable()) m_thread.join();
+
+            std::vector<std::shared_ptr<WarmConnection>> all;
+            {
+                std::lock_guard<std::mutex> guard(m_lock);
+                for (auto& it : m_entries) {
+                    all.insert(all.end(), it.second.idle.begin(), it.second.idle.end());
+                    all.insert(all.end(), it.second.connecting.begin(), it.second.connecting.end());
+                }
+                all.insert(all.end(), m_graveyard.begin(), m_graveyard.end());
+                m_entries.clear();
+                m_graveyard.clear();
+            }
+            for (const auto& conn : all) conn->stop();
+        }
+
+    private:
+        void run() {
+            std::unique_lock<std::mutex> guard(m_lock);
+            while (!m_stopping) {
+                m_cond.wait_for(guard, std::chrono::seconds(1));
+                if (m_stopping) break;
+
+                std::vector<std::shared_ptr<WarmConnection>> fresh;
+                std::vector<std::shared_ptr<WarmConnection>> dead;
+                dead.swap(m_graveyard);
+                refill(fresh, dead);
+
+                // connecting and disconnecting may block, never do it holding the pool lock
+                guard.unlock();
+                for (const auto& conn : dead) conn->stop();
+                for (const auto& conn : fresh) conn->start();
+                guard.lock();
+            }
+        }
+
+        // caller holds m_lock
+        void refill(std::vector<std::shared_ptr<WarmConnection>>& fresh, std::vector<std::shared_ptr<WarmConnection>>& dead) {
+            const auto now = pool_clock::now();
+            for (auto it = m_entries.begin(); it != m_entries.end();) {
+                PoolEntry& entry = it->second;
+
+                for (auto c = entry.connecting.begin(); c != entry.connecting.end();) {
+                    if ((*c)->isOpen()) {
+                        entry.idle.push_back(*c);
+                        entry.failures = 0;
+                        c = entry.connecting.erase(c);
+                    } else if ((*c)->isDead()) {
+                        dead.push_back(*c);
+                        entry.failures++;
+                        int backoff = std::min(POOL_MAX_BACKOFF_MS, 500 << std::min(entry.failures, 6));
+                        entry.retryAt = now + std::chrono::milliseconds(backoff);
+                        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "warm connection to %s failed, retrying in %d ms\n",
+                                          entry.cfg.uri.c_str(), backoff);
+                        c = entry.connecting.erase(c);
+                    } else {
+                        ++c;
+                    }
+                }
+                for (auto c = entry.idle.begin(); c != entry.idle.end();) {
+                    if ((*c)->isDead()) {
+                        dead.push_back(*c);
+                        c = entry.idle.erase(c);
+                    } else {
+                        ++c;
+                    }
+                }
+
+                if (now - entry.lastClaim > std::chrono::seconds(POOL_IDLE_EXPIRY_SEC)) {
+                    switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_INFO, "draining unused warm connections to %s\n",
+                                      entry.cfg.uri.c_str());
+                    dead.insert(dead.end(), entry.idle.begin(), entry.idle.end());
+                    dead.insert(dead.end(), entry.connecting.begin(), entry.connecting.end());
+                    it = m_entries.erase(it);
+                    continue;
+                }
+
+                size_t have = entry.idle.size() + entry.connecting.size();
+                if (have < entry.target && now >= entry.retryAt) {
+                    // one at a time while the endpoint is failing
+                    size_t want = entry.failures ? 1 : entry.target - have;
+                    for (size_t i = 0; i < want; i++) {
+                        auto conn = std::make_shared<WarmConnection>(entry.cfg);
+                        entry.connecting.push_back(conn);
+                        fresh.push_back(conn);
+                    }
+                }
+                ++it;
+            }
+        }
+
+        std::mutex m_lock;
+        std::condition_variable m_cond;
+        std::unordered_map<std::string, PoolEntry> m_entries;
+        std::vector<std::shared_ptr<WarmConnection>> m_graveyard;
+        std::thread m_thread;
+        bool m_stopping = false;
+    };
+
+    WarmPool& warm_pool() {
+        static WarmPool pool;
+        return pool;
+    }
+
+    void pool_wake() {
+        warm_pool().wake();
+    }
+}
+
+std::unique_ptr<StreamTransport> ws_pool_claim(const TransportConfig& cfg, const TransportCallbacks& callbacks) {
+    auto conn = warm_pool().claim(cfg);
+    if (!conn) return nullptr;
+    return std::unique_ptr<StreamTransport>(new PooledTransport(conn, callbacks));
+}
+
+char* ws_pool_status() {
+    return warm_pool().status();
+}
+
+void ws_pool_shutdown() {
+    warm_pool().shutdown();
+}
@@ -0,0 +1,22 @@
+#ifndef WS_POOL_H
+#define WS_POOL_H
+
+#include "ws_transport.h"
+
+/*
+ * Pre-warmed connections.
+ *
+ * An endpoint is registered with the pool by the first call that asks for it (STREAM_POOL_SIZE),
+ * from then on the pool keeps that many idle, already upgraded connections to it and refills
+ * them in the background as calls claim them.
+ */
+
+// nullptr on a miss, the caller then connects on its own
+std::unique_ptr<StreamTransport> ws_pool_claim(const TransportConfig& cfg, const TransportCallbacks& callbacks);
+
+// JSON array with idle/connecting/hit/miss counters per endpoint, caller frees
+char* ws_pool_status();
+
+void ws_pool_shutdown();
+
+#endif //WS_POOL_H
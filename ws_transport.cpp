@@ -0,0 +1,483 @@
+#include <cstdio>
+#include <cstring>
+#include <mutex>
+#include <atomic>
+#include <vector>
+#include <unordered_map>
+#include "mod_audio_stream.h"
+#include <switch_json.h>
+#include "ws_transport.h"
+
+#include "ws_pool.h"
+#include "ws_event_loop.h"
+#include "tls_cache.h"
+
+void transport_apply_config(WebSocketClient& client, const TransportConfig& cfg) {
+    client.setUrl(cfg.uri);
+    client.setTLSOptions(cfg.tls);
+
+    // Optional heart beat, sent every xx seconds when there is not any traffic
+    // to make sure that load balancers do not kill an idle connection.
+    if(cfg.heartBeat)
+        client.setPingInterval(cfg.heartBeat);
+
+    // Per message deflate connection is enabled by default. You can tweak its parameters or disable it
+    if(cfg.disableDeflate)
+        client.enableCompression(false);
+
+    // Set extra headers if any
+    if(!cfg.headers.empty())
+        client.setHeaders(cfg.headers);
+}
+
+std::string transport_key(const TransportConfig& cfg) {
+    std::string key(cfg.uri);
+    key.append("|").append(cfg.extraHeaders);
+    key.append("|").append(cfg.tls.caFile);
+    key.append("|").append(cfg.tls.certFile);
+    key.append("|").append(cfg.tls.keyFile);
+    key.append(cfg.tls.disableHostnameValidation ? "|1" : "|0");
+    key.append("|").append(std::to_string(cfg.heartBeat));
+    key.append(cfg.disableDeflate ? "|1" : "|0");
+    return key;
+}
+
+namespace {
+
+    /*
+     * One WebSocketClient per call, the original behaviour.
+     */
+    class DirectTransport : public StreamTransport {
+    public:
+        DirectTransport(const TransportConfig& cfg, const TransportCallbacks& cb): m_cfg(cfg) {
+            transport_apply_config(m_client, cfg);
+
+            m_client.setMessageCallback([cb](const std::string& message) {
+                cb.onMessage(message.c_str(), message.size());
+            });
+            if (tls_cache_applies(cfg)) {
+                m_client.setOpenCallback([this, cb]() {
+                    tls_cache_handshake(m_cfg, switch_micro_time_now() - m_connectStart);
+                    cb.onOpen();
+                });
+            } else {
+                m_client.setOpenCallback(cb.onOpen);
+            }
+            m_client.setErrorCallback(cb.onError);
+            m_client.setCloseCallback(cb.onClose);
+        }
+
+        void connect() override {
+            m_connectStart = switch_micro_time_now();
+            // start our background thread and receive messages
+            m_client.connect();
+        }
+
+        void close() override {
+            m_client.disconnect();
+        }
+
+        bool isConnected() override {
+            return m_client.isConnected();
+        }
+
+        void sendBinary(const uint8_t* data, size_t len) override {
+            m_client.sendBinary(data, len);
+        }
+
+        void sendText(const char* text, size_t len) override {
+            m_client.sendMessage(text, len);
+        }
+
+    private:
+        TransportConfig m_cfg;
+        WebSocketClient m_client;
+        switch_time_t m_connectStart = 0;
+    };
+
+    /*
+     * Multiplexed mode.
+     *
+     * Every call to the same endpoint (uri, headers, tls options) shares one of a small
+     * number of connections. Frames are tagged with a per-connection stream id:
+     *   binary: 4 byte big-endian stream id followed by the audio payload
+     *   text:   "<stream id>|<payload>", in both directions
+     * Stream id 0 carries control messages:
+     *   {"type":"open","streamId":N,"uuid":"..."}   sent when a call joins the connection
+     *   {"type":"close","streamId":N}               sent when it leaves, or received to end it
+     */
+    struct MuxStream {
+        uint32_t id;
+        std::string sessionId;
+        TransportCallbacks cb;
+        std::recursive_mutex lock;  // held while delivering, so detach waits for an in-flight callback
+        bool alive = true;
+        std::atomic<bool> closed{false};    // ended by the server, the shared connection stays up
+    };
+
+    template <typename F>
+    void deliver(const std::shared_ptr<MuxStream>& stream, F fn) {
+        std::lock_guard<std::recursive_mutex> guard(stream->lock);
+        if (stream->alive) fn(stream->cb);
+    }
+
+    class MuxConnection {
+    public:
+        MuxConnection(const std::string& key, const TransportConfig& cfg): m_key(key), m_cfg(cfg) {
+            transport_apply_config(m_client, cfg);
+        }
+
+        void start() {
+            m_client.setMessageCallback([this](const std::string& message) {
+                onMessage(message);
+            });
+            m_client.setOpenCallback([this]() {
+                onOpen();
+            });
+            m_client.setErrorCallback([this](int code, const std::string& msg) {
+                onDrop(true, code, msg);
+            });
+            m_client.setCloseCallback([this](int code, const std::string& reason) {
+                onDrop(false, code, reason);
+            });
+            m_connectStart = switch_micro_time_now();
+            m_client.connect();
+        }
+
+        void stop() {
+            m_client.disconnect();
+        }
+
+        const std::string& key() const { return m_key; }
+
+        bool isConnected() {
+            return m_open && m_client.isConnected();
+        }
+
+        bool isDead() const { return m_dead; }
+
+        size_t load() {
+            std::lock_guard<std::mutex> guard(m_lock);
+            return m_streams.size();
+        }
+
+        // returns true if the connection is already open, in which case the caller announces the stream
+        bool attach(const std::shared_ptr<MuxStream>& stream) {
+            std::lock_guard<std::mutex> guard(m_lock);
+            stream->id = m_nextId++;
+            if (m_nextId == 0) m_nextId = 1;
+            m_streams[stream->id] = stream;
+            return m_open;
+        }
+
+        // stops delivery to the stream, waiting for a callback in progress on another thread
+        void retire(const std::shared_ptr<MuxStream>& stream) {
+            {
+                std::lock_guard<std::recursive_mutex> guard(stream->lock);
+                stream->alive = false;
+            }
+            if (isConnected()) {
+                char ctl[64];
+                int n = snprintf(ctl, sizeof(ctl), "{\"type\":\"close\",\"streamId\":%u}", stream->id);
+                sendText(0, ctl, n);
+            }
+        }
+
+        // returns the number of streams left on the connection
+        size_t detach(const std::shared_ptr<MuxStream>& stream) {
+            std::lock_guard<std::mutex> guard(m_lock);
+            m_streams.erase(stream->id);
+            return m_streams.size();
+        }
+
+        void announce(const std::shared_ptr<MuxStream>& stream) {
+            char ctl[MAX_SESSION_ID + 64];
+            int n = snprintf(ctl, sizeof(ctl), "{\"type\":\"open\",\"streamId\":%u,\"uuid\":\"%s\"}",
+                             stream->id, stream->sessionId.c_str());
+            sendText(0, ctl, n);
+        }
+
+        void sendBinary(uint32_t id, const uint8_t* data, size_t len) {
+            static thread_local std::vector<uint8_t> frame;
+            frame.resize(len + 4);
+            frame[0] = (id >> 24) & 0xFF;
+            frame[1] = (id >> 16) & 0xFF;
+            frame[2] = (id >> 8) & 0xFF;
+            frame[3] = id & 0xFF;
+            memcpy(frame.data() + 4, data, len);
+            std::lock_guard<std::mutex> guard(m_sendLock);
+            m_client.sendBinary(frame.data(), frame.size());
+        }
+
+        void sendText(uint32_t id, const char* text, size_t len) {
+            static thread_local std::string frame;
+            frame.assign(std::to_string(id));
+            frame.push_back('|');
+            frame.append(text, len);
+            std::lock_guard<std::mutex> guard(m_sendLock);
+            m_client.sendMessage(frame.c_str(), frame.size());
+        }
+
+    private:
+        std::vector<std::shared_ptr<MuxStream>> snapshot() {
+            std::vector<std::shared_ptr<MuxStream>> streams;
+            streams.reserve(m_streams.size());
+            for (const auto& it : m_streams) streams.push_back(it.second);
+            return streams;
+        }
+
+        std::shared_ptr<MuxStream> find(uint32_t id) {
+            std::lock_guard<std::mutex> guard(m_lock);
+            auto it = m_streams.find(id);
+            return it != m_streams.end() ? it->second : nullptr;
+        }
+
+        void onOpen() {
+            std::vector<std::shared_ptr<MuxStream>> streams;
+            {
+                std::lock_guard<std::mutex> guard(m_lock);
+                m_open = true;
+                streams = snapshot();
+            }
+            if (tls_cache_applies(m_cfg)) {
+                tls_cache_handshake(m_cfg, switch_micro_time_now() - m_connectStart);
+            }
+            switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_INFO, "mux connection %p to %s open, %zu streams\n",
+                              (void *) this, m_key.c_str(), streams.size());
+            for (const auto& stream : streams) {
+                announce(stream);
+                deliver(stream, [](TransportCallbacks& cb) { cb.onOpen(); });
+            }
+        }
+
+        void onDrop(bool error, int code, const std::string& msg);
+
+        void onMessage(const std::string& message) {
+            const char* p = message.c_str();
+            uint32_t id = 0;
+            const char* sep = p;
+            while (*sep >= '0' && *sep <= '9') {
+                id = id * 10 + (*sep - '0');
+                ++sep;
+            }
+            if (sep == p || *sep != '|') {
+                switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "mux connection to %s: untagged message dropped\n",
+                                  m_key.c_str());
+                return;
+            }
+            const char* payload = sep + 1;
+            size_t len = message.size() - (payload - p);
+
+            if (id == 0) {
+                onControl(payload);
+                return;
+            }
+            auto stream = find(id);
+            if (stream) {
+                deliver(stream, [payload, len](TransportCallbacks& cb) { cb.onMessage(payload, len); });
+            }
+        }
+
+        void onControl(const char* payload) {
+            cJSON* json = cJSON_Parse(payload);
+            if (!json) return;
+            const char* type = cJSON_GetObjectCstr(json, "type");
+            cJSON* jsId = cJSON_GetObjectItem(json, "streamId");
+            if (type && jsId && 0 == strcmp(type, "close")) {
+                auto stream = find((uint32_t) jsId->valueint);
+                if (stream) {
+                    stream->closed = true;
+                    cJSON* jsCode = cJSON_GetObjectItem(json, "code");
+                    const char* reason = cJSON_GetObjectCstr(json, "reason");
+                    int code = jsCode ? jsCode->valueint : 1000;
+                    std::string why(reason ? reason : "Normal closure");
+                    deliver(stream, [code, &why](TransportCallbacks& cb) { cb.onClose(code, why); });
+                }
+            }
+            cJSON_Delete(json);
+        }
+
+        std::string m_key;
+        TransportConfig m_cfg;
+        switch_time_t m_connectStart = 0;
+        WebSocketClient m_client;
+        std::mutex m_lock;
+        std::mutex m_sendLock;
+        std::unordered_map<uint32_t, std::shared_ptr<MuxStream>> m_streams;
+        uint32_t m_nextId = 1;
+        std::atomic<bool> m_open{false};
+        std::atomic<bool> m_dead{false};
+    };
+
+    class MuxRegistry {
+    public:
+        std::shared_ptr<MuxConnection> acquire(const TransportConfig& cfg, const std::shared_ptr<MuxStream>& stream, bool& wasOpen) {
+            const std::string key = transport_key(cfg);
+            std::shared_ptr<MuxConnection> conn;
+            bool created = false;
+            {
+                std::lock_guard<std::mutex> guard(m_lock);
+                auto& pool = m_pools[key];
+                size_t best = 0;
+                for (const auto& c : pool) {
+                    size_t load = c->load();
+                    if (!conn || load < best) {
+                        conn = c;
+                        best = load;
+                    }
+                }
+                if (!conn || (best >= (size_t) cfg.muxStreams && pool.size() < (size_t) cfg.muxConnections)) {
+                    conn = std::make_shared<MuxConnection>(key, cfg);
+                    pool.push_back(conn);
+                    created = true;
+                }
+                wasOpen = conn->attach(stream);
+            }
+            if (created) {
+                switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_INFO, "opening mux connection %p to %s\n",
+                                  (void *) conn.get(), cfg.uri.c_str());
+                conn->start();
+            } else if (tls_cache_applies(cfg)) {
+                tls_cache_pooled(cfg);
+            }
+            return conn;
+        }
+
+        void release(const std::shared_ptr<MuxConnection>& conn, const std::shared_ptr<MuxStream>& stream) {
+            bool last;
+            conn->retire(stream);
+            {
+                std::lock_guard<std::mutex> guard(m_lock);
+                last = conn->detach(stream) == 0 && forget(conn);
+            }
+            if (last) {
+                switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_INFO, "closing idle mux connection %p to %s\n",
+                                  (void *) conn.get(), conn->key().c_str());
+                conn->stop();
+            }
+        }
+
+        void drop(MuxConnection* conn) {
+            std::lock_guard<std::mutex> guard(m_lock);
+            auto it = m_pools.find(conn->key());
+            if (it == m_pools.end()) return;
+            auto& pool = it->second;
+            for (auto c = pool.begin(); c != pool.end(); ++c) {
+                if (c->get() == conn) {
+                    pool.erase(c);
+                    break;
+                }
+            }
+        }
+
+    private:
+        // caller holds m_lock; returns true if the connection was still registered
+        bool forget(const std::shared_ptr<MuxConnection>& conn) {
+            auto it = m_pools.find(conn->key());
+            if (it != m_pools.end()) {
+                auto& pool = it->second;
+                for (auto c = pool.begin(); c != pool.end(); ++c) {
+                    if (*c == conn) {
+                        pool.erase(c);
+                        if (pool.empty()) m_pools.erase(it);
+                        return true;
+                    }
+                }
+            }
+            // already dropped after an error, still needs its client stopped
+            return conn->isDead();
+        }
+
+        std::mutex m_lock;
+        std::unordered_map<std::string, std::vector<std::shared_ptr<MuxConnection>>> m_pools;
+    };
+
+    MuxRegistry& mux_registry() {
+        static MuxRegistry registry;
+        return registry;
+    }
+
+    void MuxConnection::onDrop(bool error, int code, const std::string& msg) {
+        std::vector<std::shared_ptr<MuxStream>> streams;
+        {
+            std::lock_guard<std::mutex> guard(m_lock);
+            if (m_dead.exchange(true)) return;
+            m_open = false;
+            streams = snapshot();
+        }
+        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "mux connection %p to %s %s (%d: %s), %zu streams affected\n",
+                          (void *) this, m_key.c_str(), error ? "failed" : "closed", code, msg.c_str(), streams.size());
+
+        // no new streams on this connection, the last one leaving will stop it
+        mux_registry().drop(this);
+
+        for (const auto& stream : streams) {
+            if (error) {
+                deliver(stream, [code, &msg](TransportCallbacks& cb) { cb.onError(code, msg); });
+            } else {
+                deliver(stream, [code, &msg](TransportCallbacks& cb) { cb.onClose(code, msg); });
+            }
+        }
+    }
+
+    class MuxTransport : public StreamTransport {
+    public:
+        MuxTransport(const TransportConfig& cfg, const std::string& sessionId, const TransportCallbacks& cb)
+            : m_cfg(cfg), m_stream(std::make_shared<MuxStream>()) {
+            m_stream->sessionId = sessionId;
+            m_stream->cb = cb;
+        }
+
+        void connect() override {
+            bool wasOpen = false;
+            auto conn = mux_registry().acquire(m_cfg, m_stream, wasOpen);
+            std::atomic_store(&m_conn, conn);
+            if (wasOpen) {
+                conn->announce(m_stream);
+                deliver(m_stream, [](TransportCallbacks& cb) { cb.onOpen(); });
+            }
+        }
+
+        void close() override {
+            auto conn = std::atomic_exchange(&m_conn, std::shared_ptr<MuxConnection>());
+            if (conn) mux_registry().release(conn, m_stream);
+        }
+
+        // a stream the server closed is not connected, even though its connection is
+        bool isConnected() override {
+            auto conn = std::atomic_load(&m_conn);
+            return !m_stream->closed && conn && conn->isConnected();
+        }
+
+        // the stream may have been closed, or the connection lost, since the caller checked
+        void sendBinary(const uint8_t* data, size_t len) override {
+            auto conn = std::atomic_load(&m_conn);
+            if (!m_stream->closed && conn && conn->isConnected()) conn->sendBinary(m_stream->id, data, len);
+        }
+
+        void sendText(const char* text, size_t len) override {
+            auto conn = std::atomic_load(&m_conn);
+            if (!m_stream->closed && conn && conn->isConnected()) conn->sendText(m_stream->id, text, len);
+        }
+
+    private:
+        TransportConfig m_cfg;
+        std::shared_ptr<MuxStream> m_stream;
+        std::shared_ptr<MuxConnection> m_conn;
+    };
+}
+
+std::unique_ptr<StreamTransport> transport_create(const TransportConfig& cfg, const std::string& sessionId,
+                                                  const TransportCallbacks& callbacks) {
+    if (cfg.multiplex) {
+        return std::unique_ptr<StreamTransport>(new MuxTransport(cfg, sessionId, callbacks));
+    }
+    if (cfg.eventLoop) {
+        return event_loop_transport(cfg, sessionId, callbacks);
+    }
+    if (cfg.poolSize > 0) {
+        std::unique_ptr<StreamTransport> pooled = ws_pool_claim(cfg, callbacks);
+        if (pooled) return pooled;
+    }
+    return std::unique_ptr<StreamTransport>(new DirectTransport(cfg, callbacks));
+}
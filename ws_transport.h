@@ -0,0 +1,60 @@
+#ifndef WS_TRANSPORT_H
+#define WS_TRANSPORT_H
+
+#include <map>
+#include <string>
+#include <memory>
+#include <functional>
+#include "WebSocketClient.h"
+
+/*
+ * Transport used by AudioStreamer to reach the websocket endpoint.
+ *
+ * A transport is either a dedicated WebSocketClient per call, a connection served
+ * by the shared event loops, or a stream multiplexed over a connection shared by
+ * all calls to the same endpoint.
+ */
+
+struct TransportConfig {
+    std::string uri;
+    std::string extraHeaders;   // every extra-headers value and <header> as given, part of the connection key
+    WebSocketHeaders headers;
+    std::map<std::string, std::string> headerFields;    // the same headers, for the event loop's own upgrade request
+    WebSocketTLSOptions tls;
+    int heartBeat = 0;
+    bool disableDeflate = false;
+    bool multiplex = false;
+    int muxConnections = 2;     // max shared connections per endpoint
+    int muxStreams = 256;       // streams per connection before opening another one
+    int poolSize = 0;           // idle pre-connected clients kept for this endpoint
+    bool eventLoop = false;     // served by the shared epoll loops instead of a client thread
+};
+
+struct TransportCallbacks {
+    std::function<void()> onOpen;
+    std::function<void(const char* data, size_t len)> onMessage;
+    std::function<void(int code, const std::string& msg)> onError;
+    std::function<void(int code, const std::string& reason)> onClose;
+};
+
+class StreamTransport {
+public:
+    virtual ~StreamTransport() = default;
+
+    // start connecting; callbacks may fire before this returns
+    virtual void connect() = 0;
+    // blocking, no callbacks are delivered once it returns
+    virtual void close() = 0;
+    virtual bool isConnected() = 0;
+    virtual void sendBinary(const uint8_t* data, size_t len) = 0;
+    virtual void sendText(const char* text, size_t len) = 0;
+};
+
+void transport_apply_config(WebSocketClient& client, const TransportConfig& cfg);
+// identifies connections that can be shared or reused: uri, headers, TLS and connection options
+std::string transport_key(const TransportConfig& cfg);
+
+std::unique_ptr<StreamTransport> transport_create(const TransportConfig& cfg, const std::string& sessionId,
+                                                  const TransportCallbacks& callbacks);
+
+#endif //WS_TRANSPORT_H